@@ -0,0 +1,102 @@
+import os
+import sys
+import random
+import argparse
+import itertools
+
+# Corpora used by `make bench`. Every corpus is a pure function of its entry
+# here, so two machines generate byte-identical input.
+#   files       number of input files the words are spread over
+#   size        total bytes
+#   vocab       distinct base words
+#   zipf        exponent of the Zipfian word frequencies
+#   heavy       share of all tokens taken by the single most frequent word
+CORPORA = {
+    "zipf-few-large": {"seed": 1, "files": 4, "size": 32 << 20, "vocab": 50000, "zipf": 1.1, "heavy": 0.0},
+    "zipf-many-small": {"seed": 2, "files": 2000, "size": 8 << 20, "vocab": 20000, "zipf": 1.0, "heavy": 0.0},
+    "skewed-keys": {"seed": 3, "files": 8, "size": 16 << 20, "vocab": 50000, "zipf": 1.2, "heavy": 0.3},
+}
+
+LETTERS = "abcdefghijklmnopqrstuvwxyz"
+# decorations a token may carry; the word count strips the leading and trailing ones
+# and drops tokens with anything else inside, like the contraction
+PREFIXES = ["", "", "", "", "(", "\""]
+SUFFIXES = ["", "", "", "", ",", ".", ";", "!", "\""]
+
+def make_vocabulary(rng, size):
+    """Distinct lowercase base words, 1 to 12 letters long, in frequency rank order."""
+    words = set()
+    while len(words) < size:
+        length = min(12, max(1, int(rng.gauss(6, 2.5))))
+        words.add("".join(rng.choice(LETTERS) for _ in range(length)))
+    # sorted first: set order differs between Python runs
+    words = sorted(words)
+    rng.shuffle(words)
+    return words
+
+def make_tokens(rng, vocabulary, spec):
+    """The token list the corpus draws from and its cumulative Zipfian weights."""
+    tokens = []
+    weights = []
+    for rank, word in enumerate(vocabulary, start=1):
+        weight = 1.0 / rank ** spec["zipf"]
+        variant = rng.random()
+        if variant < 0.05:
+            word = word.capitalize()
+        elif variant < 0.06:
+            word = word + "'s"
+        tokens.append(rng.choice(PREFIXES) + word + rng.choice(SUFFIXES))
+        weights.append(weight)
+    if spec["heavy"] > 0:
+        # one extra word with the requested share of all draws
+        total = sum(weights)
+        tokens.append("the")
+        weights.append(total * spec["heavy"] / (1.0 - spec["heavy"]))
+    return tokens, list(itertools.accumulate(weights))
+
+def write_file(rng, path, size, tokens, cumulative):
+    """Writes about size bytes of space-separated tokens in lines of about 80 bytes."""
+    with open(path, "w", encoding="ascii") as out:
+        written = 0
+        while written < size:
+            # about 8 bytes a token; small files must not overshoot by a whole batch
+            batch = rng.choices(tokens, cum_weights=cumulative, k=max(16, min(4096, (size - written) // 8)))
+            lines = []
+            line = []
+            line_bytes = 0
+            for token in batch:
+                line.append(token)
+                line_bytes += len(token) + 1
+                if line_bytes >= 80:
+                    lines.append(" ".join(line))
+                    line = []
+                    line_bytes = 0
+            if line:
+                lines.append(" ".join(line))
+            text = "\n".join(lines) + "\n"
+            out.write(text)
+            written += len(text)
+
+def generate(name, directory):
+    """Generates the named corpus into directory, which must not exist yet."""
+    spec = CORPORA[name]
+    rng = random.Random(spec["seed"])
+    vocabulary = make_vocabulary(rng, spec["vocab"])
+    tokens, cumulative = make_tokens(rng, vocabulary, spec)
+
+    os.makedirs(directory)
+    per_file = spec["size"] // spec["files"]
+    for i in range(spec["files"]):
+        # a few files are much larger than the rest when there are many of them
+        size = per_file * 8 if spec["files"] > 100 and i % 100 == 0 else per_file
+        write_file(rng, os.path.join(directory, "part-%05d.txt" % i), size, tokens, cumulative)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Deterministic synthetic corpus generator")
+    parser.add_argument('--corpus', choices=sorted(CORPORA), required=True)
+    parser.add_argument('--output', help="Directory to create", required=True)
+
+    args = parser.parse_args()
+    if os.path.exists(args.output):
+        sys.exit("refusing to overwrite " + args.output)
+    generate(args.corpus, args.output)
@@ -0,0 +1,175 @@
+import os
+import sys
+import json
+import time
+import shutil
+import filecmp
+import argparse
+import subprocess
+
+import gen_corpus
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+
+# extra partitioners run on a corpus besides the default hash partitioner
+EXTRA_PARTITIONERS = {"skewed-keys": ["range"]}
+
+def corpus_bytes(directory):
+    """Bytes of every file under directory, subdirectories included, like findInputFiles."""
+    return sum(os.path.getsize(os.path.join(root, name)) for root, _, names in os.walk(directory) for name in names)
+
+def prepare_corpus(name, data_dir):
+    """Generates the corpus and its expected word count once; later runs reuse both."""
+    corpus = os.path.join(data_dir, name)
+    expected = corpus + ".expected.txt"
+    if not os.path.isdir(corpus):
+        print("generating corpus %s" % name, flush=True)
+        # generated under a temporary name, so an interrupted run leaves no half corpus behind
+        partial = corpus + ".partial"
+        shutil.rmtree(partial, ignore_errors=True)
+        gen_corpus.generate(name, partial)
+        os.rename(partial, corpus)
+    if not os.path.isfile(expected):
+        print("counting corpus %s with mapreduce.py" % name, flush=True)
+        reference = corpus + ".reference"
+        shutil.rmtree(reference, ignore_errors=True)
+        with open(os.devnull, "w") as quiet:
+            subprocess.run([sys.executable, os.path.join(REPO_DIR, "mapreduce.py"), "--input", corpus, "--output", reference],
+                           stdout=quiet, check=True)
+        os.rename(os.path.join(reference, "output.txt"), expected)
+        shutil.rmtree(reference)
+    return corpus, expected
+
+def run_once(binary, corpus, run_dir, workers, reduce, partitioner):
+    """Runs the engine once; returns wall seconds, peak RSS in KiB and the exit status.
+
+    The peak RSS is the master's plus that of its largest worker process. The
+    rusage wait4 returns mixes the two as a maximum, so both come from the
+    master's own getrusage in metrics.json, RUSAGE_SELF and RUSAGE_CHILDREN.
+    """
+    shutil.rmtree(run_dir, ignore_errors=True)
+    os.makedirs(run_dir)
+    command = [binary, "--input", corpus, "--output", run_dir, "--nworkers", str(workers), "--nreduce", str(reduce),
+               "--partitioner", partitioner, "--log-level", "warning", "--quiet"]
+    start = time.monotonic()
+    # the engine writes mapreduce.log to its working directory
+    process = subprocess.Popen(command, cwd=run_dir)
+    # wait4 rather than Popen.wait, for the resource usage of this child alone
+    _, status, usage = os.wait4(process.pid, 0)
+    wall = time.monotonic() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+    rss = usage.ru_maxrss
+    try:
+        with open(os.path.join(run_dir, "metrics.json")) as file:
+            metrics = json.load(file)
+        rss = metrics["peakRssKB"] + metrics["workerPeakRssKB"]
+    except (OSError, ValueError, KeyError):
+        pass
+    return wall, rss, process.returncode
+
+def phase_throughput(run_dir):
+    """MB/s of the map, reduce and merge phases from the run's metrics.json."""
+    with open(os.path.join(run_dir, "metrics.json")) as file:
+        metrics = json.load(file)
+    return {phase["name"]: phase.get("readMBPerSecond", 0.0) for phase in metrics["phases"]}
+
+def run_grid(args):
+    binary = os.path.abspath(args.binary)
+    os.makedirs(args.data, exist_ok=True)
+    results = {}
+    for name in args.corpora:
+        corpus, expected = prepare_corpus(name, args.data)
+        size = corpus_bytes(corpus)
+        for partitioner in ["hash"] + EXTRA_PARTITIONERS.get(name, []):
+            for workers in args.workers:
+                for reduce in args.reduce:
+                    key = "%s/%s/w%d/r%d" % (name, partitioner, workers, reduce)
+                    run_dir = os.path.join(args.out, key.replace("/", "-"))
+                    best = None
+                    for _ in range(args.repeat):
+                        wall, rss, code = run_once(binary, corpus, run_dir, workers, reduce, partitioner)
+                        if code != 0:
+                            best = (wall, rss, code)
+                            break
+                        if best is None or wall < best[0]:
+                            best = (wall, rss, code)
+                            phases = phase_throughput(run_dir)
+                            correct = filecmp.cmp(os.path.join(run_dir, "output.txt"), expected, shallow=False)
+                    wall, rss, code = best
+                    result = {
+                        "inputBytes": size,
+                        "wallSeconds": round(wall, 4),
+                        "mbPerSecond": round(size / wall / 1e6, 2),
+                        "peakRssMB": round(rss / 1024.0, 1),
+                        "correct": code == 0 and correct,
+                    }
+                    if code == 0:
+                        for phase in ("map", "reduce", "merge"):
+                            result[phase + "MBPerSecond"] = round(phases.get(phase, 0.0), 2)
+                    results[key] = result
+                    print("%-40s %8.3fs %8.1f MB/s  map %7.1f  reduce %7.1f  merge %7.1f MB/s  rss %7.1f MB  %s" % (
+                        key, wall, result["mbPerSecond"], result.get("mapMBPerSecond", 0.0),
+                        result.get("reduceMBPerSecond", 0.0), result.get("mergeMBPerSecond", 0.0),
+                        result["peakRssMB"], "ok" if result["correct"] else "WRONG OUTPUT"), flush=True)
+    return results
+
+def compare(results, baseline, threshold):
+    """Names the runs slower than the baseline by more than threshold."""
+    regressions = []
+    for key, result in sorted(results.items()):
+        if key not in baseline:
+            continue
+        floor = baseline[key]["mbPerSecond"] * (1.0 - threshold)
+        if result["mbPerSecond"] < floor:
+            regressions.append("%s: %.1f MB/s, baseline %.1f MB/s" % (key, result["mbPerSecond"], baseline[key]["mbPerSecond"]))
+    return regressions
+
+def main():
+    parser = argparse.ArgumentParser(description="MapReduce throughput benchmark")
+    parser.add_argument('--binary', default=os.path.join(REPO_DIR, "mapreduce"))
+    parser.add_argument('--data', default=os.path.join(BENCH_DIR, "data"), help="Where generated corpora are kept")
+    parser.add_argument('--out', default=os.path.join(BENCH_DIR, "out"), help="Where runs write their output")
+    parser.add_argument('--corpora', default=",".join(gen_corpus.CORPORA))
+    parser.add_argument('--workers', default="1,4")
+    parser.add_argument('--reduce', default="4,16")
+    parser.add_argument('--repeat', type=int, default=3, help="Runs per grid point; the fastest counts")
+    parser.add_argument('--baseline', default=os.path.join(BENCH_DIR, "baseline.json"))
+    parser.add_argument('--threshold', type=float, default=0.2, help="Tolerated throughput drop against the baseline")
+    parser.add_argument('--save-baseline', action="store_true", help="Store this run as the new baseline")
+
+    args = parser.parse_args()
+    args.corpora = args.corpora.split(",")
+    args.workers = [int(n) for n in args.workers.split(",")]
+    args.reduce = [int(n) for n in args.reduce.split(",")]
+    args.repeat = max(1, args.repeat)
+
+    results = run_grid(args)
+    with open(os.path.join(args.out, "results.json"), "w") as file:
+        json.dump(results, file, indent=2, sort_keys=True)
+
+    wrong = [key for key, result in sorted(results.items()) if not result["correct"]]
+    if wrong:
+        print("output differs from mapreduce.py or the run failed: " + ", ".join(wrong))
+        return 1
+
+    if args.save_baseline:
+        with open(args.baseline, "w") as file:
+            json.dump(results, file, indent=2, sort_keys=True)
+        print("baseline saved to " + args.baseline)
+        return 0
+    if not os.path.isfile(args.baseline):
+        print("no baseline at %s; record one with `make bench-baseline`" % args.baseline)
+        return 0
+    with open(args.baseline) as file:
+        regressions = compare(results, json.load(file), args.threshold)
+    if regressions:
+        print("throughput dropped more than %d%% below the baseline:" % round(args.threshold * 100))
+        for line in regressions:
+            print("  " + line)
+        return 1
+    print("throughput within %d%% of the baseline" % round(args.threshold * 100))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
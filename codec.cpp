@@ -0,0 +1,626 @@
+#include "codec.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+static const char MAGIC[4] = {'M', 'R', 'Z', '1'};
+
+static void putU32(char* out, std::uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+static std::uint32_t getU32(const char* in) {
+    std::uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<std::uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+bool parseCodec(const std::string& name, Codec& codec) {
+    if (name == "none") {
+        codec = Codec::None;
+    } else if (name == "lz") {
+        codec = Codec::Lz;
+#ifdef HAVE_ZLIB
+    } else if (name == "zlib") {
+        codec = Codec::Zlib;
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
+
+Codec codecByName(const std::string& name) {
+    Codec codec = Codec::None;
+    parseCodec(name, codec);
+    return codec;
+}
+
+const char* codecName(Codec codec) {
+    switch (codec) {
+    case Codec::Lz:
+        return "lz";
+    case Codec::Zlib:
+        return "zlib";
+    default:
+        return "none";
+    }
+}
+
+namespace {
+
+// The lz format is a series of sequences, each some literal bytes followed by
+// a copy of earlier output:
+//
+//   token u8 (literal length << 4 | match length - 4) | more literal length |
+//   literals | u16 offset | more match length
+//
+// A nibble of 15 continues in bytes of 255 until a smaller byte. The last
+// sequence of a block has literals only.
+constexpr int LZ_HASH_BITS = 14;
+constexpr std::size_t LZ_MIN_MATCH = 4;
+constexpr std::size_t LZ_MAX_OFFSET = 65535;
+// matches stop this far from the end, so a block always ends in literals
+constexpr std::size_t LZ_LAST_LITERALS = 5;
+
+inline std::uint32_t load32(const char* p) {
+    std::uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline std::uint32_t lzHash(std::uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+void putLength(std::string& out, std::size_t length) {
+    while (length >= 255) {
+        out.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+bool getLength(const unsigned char*& pos, const unsigned char* end, std::size_t& length) {
+    unsigned char byte;
+    do {
+        if (pos == end) {
+            return false;
+        }
+        byte = *pos++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+void putSequence(std::string& out, const char* literals, std::size_t literalLength, std::size_t offset, std::size_t matchLength) {
+    std::size_t literalNibble = std::min<std::size_t>(literalLength, 15);
+    std::size_t matchNibble = matchLength == 0 ? 0 : std::min<std::size_t>(matchLength - LZ_MIN_MATCH, 15);
+    out.push_back(static_cast<char>(literalNibble << 4 | matchNibble));
+    if (literalNibble == 15) {
+        putLength(out, literalLength - 15);
+    }
+    out.append(literals, literalLength);
+    if (matchLength == 0) {
+        return;
+    }
+    out.push_back(static_cast<char>(offset & 0xff));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (matchNibble == 15) {
+        putLength(out, matchLength - LZ_MIN_MATCH - 15);
+    }
+}
+
+// Greedy single-probe matching on a hash of the next four bytes; the search
+// takes bigger steps the longer it goes without a match, so data that does
+// not compress is skipped over quickly.
+void lzCompress(std::string_view in, std::string& out) {
+    const char* src = in.data();
+    std::size_t size = in.size();
+    // positions + 1, so 0 means empty
+    std::vector<std::uint32_t> table(std::size_t(1) << LZ_HASH_BITS, 0);
+    // worst case: all literals, plus their length bytes
+    out.reserve(out.size() + size + size / 255 + 16);
+    std::size_t matchLimit = size > LZ_LAST_LITERALS ? size - LZ_LAST_LITERALS : 0;
+    std::size_t anchor = 0;
+    std::size_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= matchLimit) {
+        std::uint32_t sequence = load32(src + pos);
+        std::uint32_t& slot = table[lzHash(sequence)];
+        std::size_t candidate = slot;
+        slot = static_cast<std::uint32_t>(pos + 1);
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET || load32(src + candidate - 1) != sequence) {
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+        std::size_t ref = candidate - 1;
+        std::size_t end = pos + LZ_MIN_MATCH;
+        while (end + 8 <= matchLimit) {
+            std::uint64_t a;
+            std::uint64_t b;
+            std::memcpy(&a, src + end, 8);
+            std::memcpy(&b, src + ref + (end - pos), 8);
+            if (a != b) {
+                end += __builtin_ctzll(a ^ b) >> 3;
+                break;
+            }
+            end += 8;
+        }
+        while (end < matchLimit && src[end] == src[ref + (end - pos)]) {
+            ++end;
+        }
+        putSequence(out, src + anchor, pos - anchor, pos - ref, end - pos);
+        pos = end;
+        anchor = end;
+    }
+    putSequence(out, src + anchor, size - anchor, 0, 0);
+}
+
+bool lzDecompress(std::string_view in, char* dst, std::size_t rawSize) {
+    const unsigned char* pos = reinterpret_cast<const unsigned char*>(in.data());
+    const unsigned char* end = pos + in.size();
+    char* out = dst;
+    char* outEnd = dst + rawSize;
+    while (pos < end) {
+        unsigned token = *pos++;
+        std::size_t literalLength = token >> 4;
+        if (literalLength == 15 && !getLength(pos, end, literalLength)) {
+            return false;
+        }
+        if (literalLength > static_cast<std::size_t>(end - pos) || literalLength > static_cast<std::size_t>(outEnd - out)) {
+            return false;
+        }
+        std::memcpy(out, pos, literalLength);
+        out += literalLength;
+        pos += literalLength;
+        if (pos == end) {
+            break;
+        }
+
+        if (end - pos < 2) {
+            return false;
+        }
+        std::size_t offset = pos[0] | static_cast<std::size_t>(pos[1]) << 8;
+        pos += 2;
+        std::size_t matchLength = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && !getLength(pos, end, matchLength)) {
+            return false;
+        }
+        if (offset == 0 || offset > static_cast<std::size_t>(out - dst) || matchLength > static_cast<std::size_t>(outEnd - out)) {
+            return false;
+        }
+        const char* from = out - offset;
+        if (offset >= matchLength) {
+            std::memcpy(out, from, matchLength);
+        } else {
+            // the copy overlaps what it produces, which repeats the last offset bytes
+            for (std::size_t i = 0; i < matchLength; ++i) {
+                out[i] = from[i];
+            }
+        }
+        out += matchLength;
+    }
+    return out == outEnd;
+}
+
+// Appends the compressed form of data to out.
+void compress(Codec codec, std::string_view data, std::string& out) {
+    if (codec == Codec::Lz) {
+        lzCompress(data, out);
+        return;
+    }
+#ifdef HAVE_ZLIB
+    if (codec == Codec::Zlib) {
+        std::size_t start = out.size();
+        uLongf storedBytes = compressBound(data.size());
+        out.resize(start + storedBytes);
+        if (compress2(reinterpret_cast<Bytef*>(&out[start]), &storedBytes, reinterpret_cast<const Bytef*>(data.data()),
+                      data.size(), Z_BEST_SPEED) != Z_OK) {
+            // stored raw by the caller
+            storedBytes = data.size();
+        }
+        out.resize(start + storedBytes);
+        return;
+    }
+#endif
+    out.append(data);
+}
+
+bool decompress(Codec codec, std::string_view stored, char* dst, std::size_t rawSize) {
+    if (stored.size() == rawSize) {
+        std::memcpy(dst, stored.data(), rawSize);
+        return true;
+    }
+    if (codec == Codec::Lz) {
+        return lzDecompress(stored, dst, rawSize);
+    }
+#ifdef HAVE_ZLIB
+    if (codec == Codec::Zlib) {
+        uLongf length = rawSize;
+        return uncompress(reinterpret_cast<Bytef*>(dst), &length, reinterpret_cast<const Bytef*>(stored.data()),
+                          stored.size()) == Z_OK && length == rawSize;
+    }
+#endif
+    return false;
+}
+
+} // namespace
+
+void appendBlock(std::string& out, Codec codec, std::string_view data) {
+    std::size_t headerAt = out.size();
+    out.append(COMPRESSION_BLOCK_HEADER_SIZE, '\0');
+    std::size_t start = out.size();
+    compress(codec, data, out);
+    if (out.size() - start >= data.size()) {
+        out.resize(start);
+        out.append(data);
+    }
+    putU32(&out[headerAt], static_cast<std::uint32_t>(data.size()));
+    putU32(&out[headerAt + 4], static_cast<std::uint32_t>(out.size() - start));
+}
+
+bool decodeBlock(const char*& pos, const char* end, Codec codec, std::string& out) {
+    if (static_cast<std::size_t>(end - pos) < COMPRESSION_BLOCK_HEADER_SIZE) {
+        return false;
+    }
+    std::size_t rawBytes = getU32(pos);
+    std::size_t storedBytes = getU32(pos + 4);
+    const char* stored = pos + COMPRESSION_BLOCK_HEADER_SIZE;
+    if (storedBytes > static_cast<std::size_t>(end - stored) || storedBytes > rawBytes) {
+        return false;
+    }
+    std::size_t offset = out.size();
+    out.resize(offset + rawBytes);
+    if (!decompress(codec, std::string_view(stored, storedBytes), &out[offset], rawBytes)) {
+        out.resize(offset);
+        return false;
+    }
+    pos = stored + storedBytes;
+    return true;
+}
+
+// A block queued on the decode pool; whoever gets to it first decodes it.
+struct AheadBlock {
+    enum class State { Queued, Running, Done, Cancelled };
+
+    AheadBlock(const char* begin, const char* end, Codec codec) : begin(begin), end(end), codec(codec) {}
+
+    const char* begin;
+    const char* end;
+    Codec codec;
+    std::string data;
+    bool ok = false;
+    State state = State::Queued;
+    std::mutex mtx;
+    std::condition_variable changed;
+
+    void run() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (state != State::Queued) {
+                return;
+            }
+            state = State::Running;
+        }
+        const char* pos = begin;
+        bool decoded = decodeBlock(pos, end, codec, data);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            ok = decoded;
+            state = State::Done;
+        }
+        changed.notify_all();
+    }
+
+    // Decodes the block unless the pool has started it, then waits for it.
+    void await() {
+        run();
+        std::unique_lock<std::mutex> lock(mtx);
+        changed.wait(lock, [this]() { return state == State::Done; });
+    }
+
+    // Drops the block if the pool has not started it, or waits for it.
+    void cancel() {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (state == State::Queued) {
+            state = State::Cancelled;
+        }
+        changed.wait(lock, [this]() { return state != State::Running; });
+    }
+};
+
+namespace {
+
+class DecodePool {
+public:
+    static DecodePool& getInstance() {
+        static DecodePool pool;
+        return pool;
+    }
+
+    void submit(std::shared_ptr<AheadBlock> block) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            queue.push_back(std::move(block));
+        }
+        changed.notify_one();
+    }
+
+    ~DecodePool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    std::mutex mtx;
+    std::condition_variable changed;
+    std::deque<std::shared_ptr<AheadBlock>> queue;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    DecodePool() {
+        std::size_t count = std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, DECODE_THREADS);
+        for (std::size_t t = 0; t < count; ++t) {
+            threads.emplace_back(&DecodePool::work, this);
+        }
+    }
+
+    void work() {
+        for (;;) {
+            std::shared_ptr<AheadBlock> block;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                block = std::move(queue.front());
+                queue.pop_front();
+            }
+            block->run();
+        }
+    }
+};
+
+} // namespace
+
+BlockStream::BlockStream(const char* begin, const char* end, Codec codec)
+    : pos(begin), queuedEnd(begin), end(end), codec(codec) {}
+
+BlockStream::BlockStream(const BlockStream& other)
+    : pos(other.pos), queuedEnd(other.pos), end(other.end), codec(other.codec) {}
+
+BlockStream& BlockStream::operator=(const BlockStream& other) {
+    if (this != &other) {
+        cancel();
+        pos = queuedEnd = other.pos;
+        end = other.end;
+        codec = other.codec;
+    }
+    return *this;
+}
+
+BlockStream::BlockStream(BlockStream&& other) noexcept
+    : pos(other.pos), queuedEnd(other.queuedEnd), end(other.end), codec(other.codec), ahead(std::move(other.ahead)) {
+    other.ahead.clear();
+    other.pos = other.queuedEnd = other.end = nullptr;
+}
+
+BlockStream& BlockStream::operator=(BlockStream&& other) noexcept {
+    if (this != &other) {
+        cancel();
+        pos = other.pos;
+        queuedEnd = other.queuedEnd;
+        end = other.end;
+        codec = other.codec;
+        ahead = std::move(other.ahead);
+        other.ahead.clear();
+        other.pos = other.queuedEnd = other.end = nullptr;
+    }
+    return *this;
+}
+
+BlockStream::~BlockStream() {
+    cancel();
+}
+
+void BlockStream::cancel() {
+    for (const auto& block : ahead) {
+        block->cancel();
+    }
+    ahead.clear();
+    queuedEnd = pos;
+}
+
+// Queues the block after the last one queued; one whose header does not fit
+// is queued up to end, and fails to decode.
+void BlockStream::queueBlock(bool onPool) {
+    const char* blockEnd = end;
+    if (static_cast<std::size_t>(end - queuedEnd) >= COMPRESSION_BLOCK_HEADER_SIZE) {
+        std::size_t storedBytes = getU32(queuedEnd + 4);
+        if (storedBytes <= static_cast<std::size_t>(end - queuedEnd) - COMPRESSION_BLOCK_HEADER_SIZE) {
+            blockEnd = queuedEnd + COMPRESSION_BLOCK_HEADER_SIZE + storedBytes;
+        }
+    }
+    ahead.push_back(std::make_shared<AheadBlock>(queuedEnd, blockEnd, codec));
+    if (onPool) {
+        DecodePool::getInstance().submit(ahead.back());
+    }
+    queuedEnd = blockEnd;
+}
+
+bool BlockStream::next(std::string& out) {
+    if (pos == end) {
+        return false;
+    }
+    // a stream that has nothing ahead yet decodes its first block itself
+    if (ahead.empty()) {
+        queueBlock(false);
+    }
+    std::shared_ptr<AheadBlock> block = std::move(ahead.front());
+    ahead.erase(ahead.begin());
+    block->await();
+    if (!block->ok) {
+        cancel();
+        pos = queuedEnd = end;
+        return false;
+    }
+    if (out.empty()) {
+        out.swap(block->data);
+    } else {
+        out.append(block->data);
+    }
+    pos = block->end;
+    while (ahead.size() < DECODE_AHEAD_BLOCKS && queuedEnd != end) {
+        queueBlock(true);
+    }
+    return true;
+}
+
+bool BlockWriter::open(const std::string& path, Codec codec) {
+    this->codec = codec;
+    pending.clear();
+    totalBytes = 0;
+    out.open(path, std::ios::binary | std::ios::trunc);
+    if (codec != Codec::None) {
+        char header[COMPRESSED_FILE_HEADER_SIZE] = {};
+        std::memcpy(header, MAGIC, sizeof(MAGIC));
+        header[4] = static_cast<char>(codec);
+        out.write(header, sizeof(header));
+        totalBytes += sizeof(header);
+    }
+    return static_cast<bool>(out);
+}
+
+void BlockWriter::writeBlock(std::string_view data) {
+    block.clear();
+    appendBlock(block, codec, data);
+    out.write(block.data(), block.size());
+    totalBytes += block.size();
+}
+
+bool BlockWriter::write(std::string_view data) {
+    if (codec == Codec::None) {
+        out.write(data.data(), data.size());
+        totalBytes += data.size();
+        return static_cast<bool>(out);
+    }
+    if (!pending.empty()) {
+        std::size_t take = std::min(COMPRESSION_BLOCK_BYTES - pending.size(), data.size());
+        pending.append(data.substr(0, take));
+        data.remove_prefix(take);
+        if (pending.size() < COMPRESSION_BLOCK_BYTES) {
+            return static_cast<bool>(out);
+        }
+        writeBlock(pending);
+        pending.clear();
+    }
+    while (data.size() >= COMPRESSION_BLOCK_BYTES) {
+        writeBlock(data.substr(0, COMPRESSION_BLOCK_BYTES));
+        data.remove_prefix(COMPRESSION_BLOCK_BYTES);
+    }
+    pending.append(data);
+    return static_cast<bool>(out);
+}
+
+bool BlockWriter::close() {
+    if (!pending.empty()) {
+        writeBlock(pending);
+        pending.clear();
+    }
+    out.flush();
+    bool ok = static_cast<bool>(out);
+    out.close();
+    return ok;
+}
+
+std::string compressFile(std::string_view data, Codec codec) {
+    if (codec == Codec::None) {
+        return std::string(data);
+    }
+    std::string out(COMPRESSED_FILE_HEADER_SIZE, '\0');
+    std::memcpy(&out[0], MAGIC, sizeof(MAGIC));
+    out[4] = static_cast<char>(codec);
+    for (std::size_t pos = 0; pos < data.size(); pos += COMPRESSION_BLOCK_BYTES) {
+        appendBlock(out, codec, data.substr(pos, COMPRESSION_BLOCK_BYTES));
+    }
+    return out;
+}
+
+bool BlockReader::open(const std::string& path) {
+    damagedBlock = false;
+    // the old mapping goes away, so nothing may still decode from it
+    blocks = BlockStream();
+    plain = std::string_view();
+    if (!file.open(path)) {
+        storedBytes = 0;
+        return false;
+    }
+    storedBytes = file.size();
+    std::string_view data = file.view();
+    codec = Codec::None;
+    if (data.size() >= COMPRESSED_FILE_HEADER_SIZE && std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) == 0) {
+        codec = static_cast<Codec>(data[4]);
+        blocks = BlockStream(data.data() + COMPRESSED_FILE_HEADER_SIZE, data.data() + data.size(), codec);
+    } else {
+        plain = data;
+    }
+    return true;
+}
+
+bool BlockReader::next(std::string_view& chunk) {
+    if (codec == Codec::None) {
+        chunk = plain;
+        plain = std::string_view();
+        return !chunk.empty();
+    }
+    if (blocks.empty()) {
+        return false;
+    }
+    block.clear();
+    if (!blocks.next(block)) {
+        damagedBlock = true;
+        return false;
+    }
+    chunk = block;
+    return true;
+}
+
+bool decodeFile(const std::string& path, std::ostream& out, std::string& error) {
+    BlockReader reader;
+    if (!reader.open(path)) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::string_view chunk;
+    while (reader.next(chunk)) {
+        out.write(chunk.data(), chunk.size());
+    }
+    out.flush();
+    if (reader.damaged()) {
+        error = "damaged compressed block in " + path;
+        return false;
+    }
+    if (!out) {
+        error = "cannot write the decoded text";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,146 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "input_reader.h"
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Block compression for intermediate and output files (--compress-intermediate,
+// --compress-output). Data is cut into blocks of at most COMPRESSION_BLOCK_BYTES
+// that are compressed on their own, so a reader only ever needs one of them
+// decoded at a time:
+//
+//   block   u32 raw bytes | u32 stored bytes | stored bytes
+//
+// A block that does not get smaller is stored as is (stored == raw bytes).
+// "lz" is a built-in byte-oriented LZ77 codec in the style of LZ4, fast on
+// both ends; "zlib" trades speed for ratio and is only there when the build
+// found zlib.h. Compressed output files are a header followed by blocks:
+//
+//   header  "MRZ1" | u8 codec | 3 reserved bytes
+//
+// Intermediate files record their codec in their own header (intermediate.h).
+
+enum class Codec : std::uint8_t {
+    None = 0,
+    Lz = 1,
+    Zlib = 2
+};
+
+constexpr std::size_t COMPRESSION_BLOCK_BYTES = 256 << 10;
+constexpr std::size_t COMPRESSION_BLOCK_HEADER_SIZE = 8;
+constexpr std::size_t COMPRESSED_FILE_HEADER_SIZE = 8;
+// threads of the decode pool every reader in the process shares, and blocks
+// one reader may have decoded or queued ahead of the one it reads
+constexpr std::size_t DECODE_THREADS = 4;
+constexpr std::size_t DECODE_AHEAD_BLOCKS = 1;
+
+// Looks a codec up by name ("none", "lz", "zlib"); false if it is unknown or
+// not built in.
+bool parseCodec(const std::string& name, Codec& codec);
+// Same, for names parseArguments already checked; unknown names give None.
+Codec codecByName(const std::string& name);
+const char* codecName(Codec codec);
+
+// Appends data, at most COMPRESSION_BLOCK_BYTES of it, to out as one block.
+void appendBlock(std::string& out, Codec codec, std::string_view data);
+
+// Decodes the block at pos and appends it to out, moving pos past it. False
+// if the block is damaged or does not end before end.
+bool decodeBlock(const char*& pos, const char* end, Codec codec, std::string& out);
+
+struct AheadBlock;
+
+// Hands out the blocks between begin and end in order. While the reader works
+// on one block, the next DECODE_AHEAD_BLOCKS are decoded on the shared pool,
+// so readers decode in parallel but never hold more than a few blocks each. A
+// block the pool has not started when it is needed is decoded by the reader.
+// A copy carries on from the next block of the original, with nothing ahead.
+class BlockStream {
+public:
+    BlockStream() = default;
+    BlockStream(const char* begin, const char* end, Codec codec);
+    BlockStream(const BlockStream& other);
+    BlockStream& operator=(const BlockStream& other);
+    BlockStream(BlockStream&& other) noexcept;
+    BlockStream& operator=(BlockStream&& other) noexcept;
+    // Waits for the blocks the pool is decoding, which read from begin..end.
+    ~BlockStream();
+
+    // Whether every block was handed out.
+    bool empty() const { return pos == end; }
+    // Appends the next block to out; false if it is damaged, which ends the stream.
+    bool next(std::string& out);
+
+private:
+    // next block to hand out, and the end of those queued ahead
+    const char* pos = nullptr;
+    const char* queuedEnd = nullptr;
+    const char* end = nullptr;
+    Codec codec = Codec::None;
+    std::vector<std::shared_ptr<AheadBlock>> ahead;
+
+    void queueBlock(bool onPool);
+    void cancel();
+};
+
+// Writes a text output file, compressed into blocks unless the codec is None,
+// in which case the file is written as is.
+class BlockWriter {
+public:
+    bool open(const std::string& path, Codec codec);
+    bool write(std::string_view data);
+    // Writes out the last block; false if anything failed on the way.
+    bool close();
+    // bytes on disk so far
+    std::uint64_t bytesWritten() const { return totalBytes; }
+
+private:
+    std::ofstream out;
+    Codec codec = Codec::None;
+    std::uint64_t totalBytes = 0;
+    std::string pending;
+    std::string block;
+
+    void writeBlock(std::string_view data);
+};
+
+// The bytes BlockWriter would write for data, for files written in one go.
+std::string compressFile(std::string_view data, Codec codec);
+
+// Reads a text file BlockWriter wrote, in chunks: a plain file is one chunk
+// straight from the mapping, a compressed one a block at a time off a
+// BlockStream.
+class BlockReader {
+public:
+    bool open(const std::string& path);
+    // The next chunk, valid until the next call; false at the end of the file
+    // or at a damaged block.
+    bool next(std::string_view& chunk);
+    // Chunks of a compressed file live in a buffer the next call reuses.
+    bool compressed() const { return codec != Codec::None; }
+    bool damaged() const { return damagedBlock; }
+    // bytes on disk
+    std::size_t fileBytes() const { return storedBytes; }
+
+private:
+    MappedFile file;
+    Codec codec = Codec::None;
+    std::string_view plain;
+    BlockStream blocks;
+    std::string block;
+    std::size_t storedBytes = 0;
+    bool damagedBlock = false;
+};
+
+// Writes the text of a file BlockWriter wrote to out, for `mapreduce --decode`;
+// false, with why in error, if it cannot be read or a block is damaged.
+bool decodeFile(const std::string& path, std::ostream& out, std::string& error);
+
+#endif // CODEC_H
@@ -3,12 +3,77 @@
 
 #include <string>
 #include <vector>
+#include <cstddef>
+
+// bytes buffered per reduce partition before a mapper writes them out
+constexpr std::size_t DEFAULT_MAP_BUFFER_BYTES = 1 << 20;
+// memory a mapper's combiner may use before it emits a partial flush
+constexpr std::size_t DEFAULT_COMBINE_LIMIT_BYTES = 64 << 20;
+// memory the final merge may hold before it spills a sorted run to disk
+constexpr std::size_t DEFAULT_MEMORY_LIMIT_BYTES = 256 << 20;
+// map output --shuffle memory may hold before it spills map outputs to disk
+constexpr std::size_t DEFAULT_SHUFFLE_MEMORY_BYTES = 1ULL << 30;
+// --stream: length of a window, and how often a micro-batch is counted
+constexpr std::size_t DEFAULT_STREAM_WINDOW_MILLIS = 60000;
+constexpr std::size_t DEFAULT_STREAM_BATCH_MILLIS = 200;
 
 struct Config {
     std::string inputDir;
     std::string outputDir;
-    int nWorkers;
-    int nReduce;
+    int nWorkers = 0;
+    int nReduce = 0;
+    // input files below inputDir to take (any of includeGlobs, if given) and to leave out
+    std::vector<std::string> includeGlobs;
+    std::vector<std::string> excludeGlobs;
+    // bytes per map task; 0 picks a size from the input and worker count
+    std::size_t splitSize = 0;
+    // files smaller than packSize are packed together into map tasks of about
+    // that many bytes; 0 packs up to the split size
+    bool packFiles = true;
+    std::size_t packSize = 0;
+    std::size_t mapBufferBytes = DEFAULT_MAP_BUFFER_BYTES;
+    bool combine = false;
+    std::size_t combineLimitBytes = DEFAULT_COMBINE_LIMIT_BYTES;
+    std::string tokenizer = "auto";
+    std::size_t memoryLimitBytes = DEFAULT_MEMORY_LIMIT_BYTES;
+    // "hash" or "range"; for range the master fills in rangeBoundaries from a sample
+    std::string partitioner = "hash";
+    std::vector<std::string> rangeBoundaries;
+    // "thread" runs the workers inside this process, "process" as child processes over a Unix socket
+    std::string mode = "thread";
+    // "file" passes map output through map.part files, "memory" through a ShuffleStore (thread mode only)
+    std::string shuffle = "file";
+    std::size_t shuffleMemoryBytes = DEFAULT_SHUFFLE_MEMORY_BYTES;
+    // block codec (none|lz|zlib, see codec.h) for map output and merge spills, and for the reduce parts and output.txt
+    std::string compressIntermediate = "none";
+    std::string compressOutput = "none";
+    // set by the master once the input is split; reducers read one file per map task
+    int nMapTasks = 0;
+    // fault tolerance: failed attempts per task before the job fails, seconds before a
+    // running attempt is presumed lost, and backup copies of straggling tasks
+    int maxAttempts = 4;
+    std::size_t taskTimeoutSeconds = 600;
+    bool speculate = true;
+    // recount only what changed in the input since the last --incremental run
+    bool incremental = false;
+    // keep counting text as it arrives (see stream.h), in windows of windowMillis that
+    // advance every slideMillis (0: by a whole window), from batches every batchMillis
+    bool stream = false;
+    std::size_t windowMillis = DEFAULT_STREAM_WINDOW_MILLIS;
+    std::size_t slideMillis = 0;
+    std::size_t batchMillis = DEFAULT_STREAM_BATCH_MILLIS;
+    // continue the job recorded in <outputDir>/job.manifest instead of starting over
+    bool resume = false;
+    // Chrome trace_event file to write the task timeline to; empty for none
+    std::string traceFile;
+    // least severe message logged (debug|info|warning|error), and whether it is echoed to stdout
+    std::string logLevel = "debug";
+    bool quiet = false;
+    // when non-zero, output.txt only lists the topK most frequent words
+    std::size_t topK = 0;
+    // job to run (wordcount|inverted-index|bigrams|grep, see jobs.h) and the text grep looks for
+    std::string job = "wordcount";
+    std::string pattern;
     std::vector<std::vector<int>> reduceTasksList; 
 };
 
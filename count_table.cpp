@@ -0,0 +1,116 @@
+#include "count_table.h"
+#include <algorithm>
+
+static constexpr std::size_t ARENA_BLOCK_BYTES = 64 << 10;
+
+static std::size_t roundUpToPowerOfTwo(std::size_t n) {
+    std::size_t capacity = 16;
+    while (capacity < n) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+CountTable::CountTable(std::size_t initialCapacity) {
+    std::size_t capacity = roundUpToPowerOfTwo(initialCapacity);
+    hashes.assign(capacity, 0);
+    keys.resize(capacity);
+    counts.assign(capacity, 0);
+    mask = capacity - 1;
+}
+
+std::size_t CountTable::memoryBytes() const {
+    std::size_t slotBytes = sizeof(std::uint64_t) + sizeof(KeyRef) + sizeof(std::uint64_t) + sizeof(std::size_t);
+    return entries * slotBytes * 4 / 3 + arenaBytes;
+}
+
+void CountTable::clear() {
+    if (sparse()) {
+        for (std::size_t slot : occupied) {
+            hashes[slot] = 0;
+        }
+    } else {
+        std::fill(hashes.begin(), hashes.end(), 0);
+    }
+    occupied.clear();
+    entries = 0;
+    // keep one block around so the next round does not start by allocating
+    if (arenaBlocks.size() > 1) {
+        arenaBlocks.resize(1);
+    }
+    arenaBytes = arenaBlocks.empty() ? 0 : ARENA_BLOCK_BYTES;
+    arenaPos = arenaBlocks.empty() ? nullptr : arenaBlocks[0].get();
+    arenaLeft = arenaBlocks.empty() ? 0 : ARENA_BLOCK_BYTES;
+}
+
+void CountTable::sortedRecords(std::vector<KeyCount>& records) const {
+    std::size_t first = records.size();
+    forEach([&records](std::string_view key, std::uint64_t count) {
+        records.push_back({key, count});
+    });
+    std::sort(records.begin() + first, records.end(), [](const KeyCount& a, const KeyCount& b) {
+        return a.key < b.key;
+    });
+}
+
+void CountTable::insertAt(std::size_t slot, std::string_view key, std::uint64_t hash, std::uint64_t count) {
+    KeyRef& ref = keys[slot];
+    ref.length = static_cast<std::uint32_t>(key.size());
+    if (key.size() <= INLINE_KEY_BYTES) {
+        std::memcpy(ref.inlined, key.data(), key.size());
+    } else {
+        ref.external = intern(key);
+    }
+    hashes[slot] = hash;
+    counts[slot] = count;
+    occupied.push_back(slot);
+
+    // keep the load factor under 3/4 so probe sequences stay short
+    if (++entries * 4 > hashes.size() * 3) {
+        grow();
+    }
+}
+
+const char* CountTable::intern(std::string_view key) {
+    if (key.size() > arenaLeft) {
+        std::size_t blockBytes = std::max(ARENA_BLOCK_BYTES, key.size());
+        arenaBlocks.push_back(std::make_unique<char[]>(blockBytes));
+        arenaPos = arenaBlocks.back().get();
+        arenaLeft = blockBytes;
+        arenaBytes += blockBytes;
+    }
+    char* stored = arenaPos;
+    std::memcpy(stored, key.data(), key.size());
+    arenaPos += key.size();
+    arenaLeft -= key.size();
+    return stored;
+}
+
+void CountTable::grow() {
+    std::size_t capacity = hashes.size() * 2;
+    std::vector<std::uint64_t> oldHashes(capacity, 0);
+    std::vector<KeyRef> oldKeys(capacity);
+    std::vector<std::uint64_t> oldCounts(capacity, 0);
+    oldHashes.swap(hashes);
+    oldKeys.swap(keys);
+    oldCounts.swap(counts);
+    mask = capacity - 1;
+
+    // stored hashes spare rehashing the keys; inline keys move with their
+    // slot. The old slots are read in order, which is kinder to the cache
+    // than following occupied, and grow() is paid for by the inserts anyway.
+    occupied.clear();
+    for (std::size_t i = 0; i < oldHashes.size(); ++i) {
+        if (oldHashes[i] == 0) {
+            continue;
+        }
+        std::size_t slot = oldHashes[i] & mask;
+        while (hashes[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        hashes[slot] = oldHashes[i];
+        keys[slot] = oldKeys[i];
+        counts[slot] = oldCounts[i];
+        occupied.push_back(slot);
+    }
+}
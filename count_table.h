@@ -0,0 +1,159 @@
+#ifndef COUNT_TABLE_H
+#define COUNT_TABLE_H
+
+#include "intermediate.h"
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// 64-bit hash of a word, eight bytes per step. Never returns 0, which the
+// table uses to mark empty slots.
+inline std::uint64_t hashKey(std::string_view key) {
+    std::uint64_t h = 0x9e3779b97f4a7c15ULL ^ key.size();
+    const char* p = key.data();
+    std::size_t n = key.size();
+    while (n >= 8) {
+        std::uint64_t v;
+        std::memcpy(&v, p, 8);
+        h = (h ^ v) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+        p += 8;
+        n -= 8;
+    }
+    if (n > 0) {
+        std::uint64_t v = 0;
+        std::memcpy(&v, p, n);
+        h = (h ^ v) * 0x94d049bb133111ebULL;
+        h ^= h >> 29;
+    }
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    return h | (1ULL << 63);
+}
+
+// Reduce partition of a hashed word. Takes bits the table does not index
+// with, so one partition's words still spread over a whole table.
+inline int partitionOf(std::uint64_t hash, int nReduce) {
+    return static_cast<int>((((hash >> 31) & 0xffffffffULL) * static_cast<std::uint64_t>(nReduce)) >> 32);
+}
+
+// Word -> count table for aggregation.
+//
+// Open addressing with linear probing, kept as parallel arrays (hashes, keys,
+// counts) so a probe only walks the dense hash array. Keys of up to 12 bytes
+// are stored inline in their slot; longer keys are copied once into a
+// bump-pointer arena. Nothing is sorted until the caller asks for the records.
+// The occupied slots are listed as well, so clearing or walking a table that
+// is mostly empty costs what its entries do, not what its capacity does: a
+// table reused for small rounds after a large one does not keep paying for
+// the large one.
+class CountTable {
+public:
+    explicit CountTable(std::size_t initialCapacity = 1024);
+
+    void add(std::string_view key, std::uint64_t count = 1) {
+        add(key, hashKey(key), count);
+    }
+
+    void add(std::string_view key, std::uint64_t hash, std::uint64_t count) {
+        std::size_t slot = hash & mask;
+        while (hashes[slot] != 0) {
+            if (hashes[slot] == hash && keys[slot].equals(key)) {
+                counts[slot] += count;
+                return;
+            }
+            slot = (slot + 1) & mask;
+        }
+        insertAt(slot, key, hash, count);
+    }
+
+    // Takes count back off the entry for key, which must hold at least that
+    // much. An entry that drops to zero keeps its slot, and forEach still
+    // visits it; returns whether it did.
+    bool subtract(std::string_view key, std::uint64_t hash, std::uint64_t count) {
+        std::size_t slot = hash & mask;
+        while (hashes[slot] != 0) {
+            if (hashes[slot] == hash && keys[slot].equals(key)) {
+                counts[slot] -= count;
+                return counts[slot] == 0;
+            }
+            slot = (slot + 1) & mask;
+        }
+        return false;
+    }
+
+    std::size_t size() const { return entries; }
+    bool empty() const { return entries == 0; }
+    // Bytes the live entries take: their slots at the largest load factor,
+    // and the arena holding their keys. Slots that clear() kept from a bigger
+    // round are not counted, or a combiner would flush on every check after
+    // its first flush.
+    std::size_t memoryBytes() const;
+    void clear();
+
+    // Appends every entry to records, sorted by key. The keys point into the
+    // table and stay valid until it is modified.
+    void sortedRecords(std::vector<KeyCount>& records) const;
+
+    // Visits every entry, in no particular order.
+    template <typename F>
+    void forEach(F&& f) const {
+        if (sparse()) {
+            for (std::size_t slot : occupied) {
+                f(keys[slot].view(), counts[slot]);
+            }
+            return;
+        }
+        for (std::size_t slot = 0; slot < hashes.size(); ++slot) {
+            if (hashes[slot] != 0) {
+                f(keys[slot].view(), counts[slot]);
+            }
+        }
+    }
+
+private:
+    static constexpr std::uint32_t INLINE_KEY_BYTES = 12;
+
+    struct KeyRef {
+        std::uint32_t length;
+        union {
+            char inlined[INLINE_KEY_BYTES];
+            const char* external;
+        };
+
+        const char* data() const {
+            return length <= INLINE_KEY_BYTES ? inlined : external;
+        }
+        std::string_view view() const {
+            return std::string_view(data(), length);
+        }
+        bool equals(std::string_view key) const {
+            return length == key.size() && std::memcmp(data(), key.data(), length) == 0;
+        }
+    };
+
+    std::vector<std::uint64_t> hashes;
+    std::vector<KeyRef> keys;
+    std::vector<std::uint64_t> counts;
+    std::size_t mask;
+    std::size_t entries = 0;
+    // slots holding an entry, in the order they were filled
+    std::vector<std::size_t> occupied;
+
+    std::vector<std::unique_ptr<char[]>> arenaBlocks;
+    char* arenaPos = nullptr;
+    std::size_t arenaLeft = 0;
+    std::size_t arenaBytes = 0;
+
+    // Few enough entries that following occupied beats scanning the slots
+    // in order.
+    bool sparse() const { return entries * 8 < hashes.size(); }
+    void insertAt(std::size_t slot, std::string_view key, std::uint64_t hash, std::uint64_t count);
+    const char* intern(std::string_view key);
+    void grow();
+};
+
+#endif // COUNT_TABLE_H
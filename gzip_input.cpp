@@ -0,0 +1,182 @@
+#include "gzip_input.h"
+#include "tokenizer.h"
+#include <algorithm>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// input handed to zlib per call; its counters are 32 bits wide
+static constexpr std::size_t GZIP_INPUT_STEP = 1 << 30;
+
+bool isGzip(std::string_view data) {
+    return data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x1f && static_cast<unsigned char>(data[1]) == 0x8b;
+}
+
+bool gzipSupported() {
+#ifdef HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+GzipStream::GzipStream(std::string_view compressed) : compressed(compressed) {
+    decoder = std::thread(&GzipStream::decode, this);
+}
+
+GzipStream::~GzipStream() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    changed.notify_all();
+    decoder.join();
+}
+
+bool GzipStream::next(std::string_view& chunk) {
+    std::unique_lock<std::mutex> lock(mtx);
+    if (!current.empty()) {
+        spare.push_back(std::move(current));
+        current.clear();
+    }
+    changed.wait(lock, [this] { return !ready.empty() || finished; });
+    if (ready.empty()) {
+        return false;
+    }
+    current = std::move(ready.front());
+    ready.pop_front();
+    changed.notify_all();
+    chunk = current;
+    return true;
+}
+
+bool GzipStream::ok() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return !failed;
+}
+
+std::string GzipStream::takeBuffer() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (spare.empty()) {
+        return std::string();
+    }
+    std::string buffer = std::move(spare.back());
+    spare.pop_back();
+    buffer.clear();
+    return buffer;
+}
+
+bool GzipStream::hand(std::string chunk) {
+    std::unique_lock<std::mutex> lock(mtx);
+    changed.wait(lock, [this] { return ready.size() < GZIP_READY_CHUNKS || stopping; });
+    if (stopping) {
+        return false;
+    }
+    ready.push_back(std::move(chunk));
+    changed.notify_all();
+    return true;
+}
+
+void GzipStream::finish(const std::string& error) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        finished = true;
+        if (!error.empty()) {
+            failed = true;
+            lastError = error;
+        }
+    }
+    changed.notify_all();
+}
+
+#ifdef HAVE_ZLIB
+
+void GzipStream::decode() {
+    z_stream zs{};
+    // 15 + 32: the largest window, with the gzip header detected by zlib
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        finish("cannot start the gzip decoder");
+        return;
+    }
+    std::string error;
+    std::size_t inPos = 0;
+    std::string chunk = takeBuffer();
+    std::size_t filled = 0;
+    bool atEnd = false;
+    while (!atEnd && error.empty()) {
+        chunk.resize(filled + GZIP_CHUNK_BYTES);
+        while (filled < chunk.size()) {
+            if (zs.avail_in == 0 && inPos < compressed.size()) {
+                std::size_t step = std::min(compressed.size() - inPos, GZIP_INPUT_STEP);
+                zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data() + inPos));
+                zs.avail_in = static_cast<uInt>(step);
+                inPos += step;
+            }
+            zs.next_out = reinterpret_cast<Bytef*>(&chunk[filled]);
+            zs.avail_out = static_cast<uInt>(chunk.size() - filled);
+            int rc = inflate(&zs, Z_NO_FLUSH);
+            filled = chunk.size() - zs.avail_out;
+            if (rc == Z_STREAM_END) {
+                // another member may follow; anything else after the last member is ignored, as gzip does
+                std::size_t consumed = reinterpret_cast<const char*>(zs.next_in) - compressed.data();
+                if (!isGzip(compressed.substr(consumed))) {
+                    atEnd = true;
+                    break;
+                }
+                inflateReset(&zs);
+            } else if (rc == Z_BUF_ERROR && zs.avail_in == 0 && inPos == compressed.size()) {
+                error = "truncated gzip data";
+                break;
+            } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                error = zs.msg != nullptr ? zs.msg : "damaged gzip data";
+                break;
+            }
+        }
+        if (!error.empty()) {
+            break;
+        }
+
+        // cut after the last separator; a chunk without one grows until one turns up
+        std::size_t cut = filled;
+        if (!atEnd) {
+            while (cut > 0 && !isWordSeparator(chunk[cut - 1])) {
+                --cut;
+            }
+            if (cut == 0) {
+                continue;
+            }
+        }
+        std::string rest = takeBuffer();
+        rest.assign(chunk, cut, filled - cut);
+        chunk.resize(cut);
+        if (!chunk.empty() && !hand(std::move(chunk))) {
+            break;
+        }
+        chunk = std::move(rest);
+        filled = chunk.size();
+    }
+    inflateEnd(&zs);
+    finish(error);
+}
+
+#else
+
+void GzipStream::decode() {
+    finish("gzip input needs a build with zlib");
+}
+
+#endif
+
+bool readGzip(std::string_view compressed, std::string& out, std::string& error) {
+    GzipStream stream(compressed);
+    std::string_view chunk;
+    out.clear();
+    while (stream.next(chunk)) {
+        out.append(chunk);
+    }
+    if (!stream.ok()) {
+        error = stream.error();
+        return false;
+    }
+    return true;
+}
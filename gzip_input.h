@@ -0,0 +1,72 @@
+#ifndef GZIP_INPUT_H
+#define GZIP_INPUT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Input files that start with the gzip magic bytes are read through a decoder
+// instead of as plain text. A gzip stream can only be decoded from its start,
+// so the splitter makes one map task per compressed file; the parallelism
+// comes from compressed files being decoded side by side, and from inflating
+// on a thread of its own while the mapper tokenizes what is already decoded.
+// Files of several concatenated gzip members (as written by `cat a.gz b.gz`
+// or pigz) are decoded member after member.
+
+// decoded text handed to the mapper at a time
+constexpr std::size_t GZIP_CHUNK_BYTES = 1 << 20;
+// decoded chunks waiting for the mapper before the decoder pauses
+constexpr std::size_t GZIP_READY_CHUNKS = 4;
+
+bool isGzip(std::string_view data);
+// Whether this build can decode gzip (it needs zlib).
+bool gzipSupported();
+
+// Inflates a gzip file on its own thread and hands the text over in chunks
+// that end at a word separator, so every chunk tokenizes on its own.
+class GzipStream {
+public:
+    // Starts decoding compressed, which must outlive the stream.
+    explicit GzipStream(std::string_view compressed);
+    // Stops the decoder if the caller gave up early.
+    ~GzipStream();
+    GzipStream(const GzipStream&) = delete;
+    GzipStream& operator=(const GzipStream&) = delete;
+
+    // Waits for the next chunk, which stays valid until the next call. False
+    // once everything is decoded, or the data turned out to be damaged.
+    bool next(std::string_view& chunk);
+    // After next() returned false: whether the whole file decoded cleanly.
+    bool ok() const;
+    const std::string& error() const { return lastError; }
+
+private:
+    std::string_view compressed;
+    mutable std::mutex mtx;
+    std::condition_variable changed;
+    std::deque<std::string> ready;
+    std::vector<std::string> spare;
+    std::string current;
+    bool finished = false;
+    bool stopping = false;
+    bool failed = false;
+    std::string lastError;
+    std::thread decoder;
+
+    void decode();
+    std::string takeBuffer();
+    // false if the consumer went away
+    bool hand(std::string chunk);
+    void finish(const std::string& error);
+};
+
+// Decodes a whole gzip file into out, for callers that need all of it at once.
+bool readGzip(std::string_view compressed, std::string& out, std::string& error);
+
+#endif // GZIP_INPUT_H
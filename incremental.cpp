@@ -0,0 +1,415 @@
+#include "incremental.h"
+#include "count_table.h"
+#include "gzip_input.h"
+#include "input_files.h"
+#include "input_reader.h"
+#include "intermediate.h"
+#include "logger.h"
+#include "manifest.h"
+#include "merge.h"
+#include "parallel.h"
+#include "tokenizer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+static const char* INDEX_MAGIC = "MRSTATE 1";
+
+bool IncrementalIndex::load(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != INDEX_MAGIC) {
+        return false;
+    }
+    files.clear();
+    while (std::getline(in, line)) {
+        std::istringstream record(line);
+        std::string kind;
+        record >> kind;
+        if (kind == "generation") {
+            record >> generation;
+        } else if (kind == "nreduce") {
+            record >> nReduce;
+        } else if (kind == "nextid") {
+            record >> nextId;
+        } else if (kind == "file") {
+            IncrementalFile file;
+            record >> file.id >> file.size >> file.mtime >> file.hash;
+            record.get();
+            std::getline(record, file.path);
+            if (!record.fail()) {
+                files.push_back(file);
+            }
+        }
+    }
+    return true;
+}
+
+bool IncrementalIndex::save(const std::string& path) const {
+    std::ostringstream out;
+    out << INDEX_MAGIC << "\n";
+    out << "generation " << generation << "\n";
+    out << "nreduce " << nReduce << "\n";
+    out << "nextid " << nextId << "\n";
+    for (const auto& file : files) {
+        out << "file " << file.id << " " << file.size << " " << file.mtime << " " << file.hash << " " << file.path << "\n";
+    }
+    return writeFileAtomically(path, out.str());
+}
+
+namespace {
+
+// Counts to add to and to subtract from the totals, per reduce partition.
+struct Delta {
+    explicit Delta(int nReduce) : added(nReduce), removed(nReduce) {}
+    std::vector<CountTable> added;
+    std::vector<CountTable> removed;
+
+    void mergeFrom(const Delta& other) {
+        for (std::size_t r = 0; r < added.size(); ++r) {
+            other.added[r].forEach([this, r](std::string_view key, std::uint64_t count) {
+                added[r].add(key, count);
+            });
+            other.removed[r].forEach([this, r](std::string_view key, std::uint64_t count) {
+                removed[r].add(key, count);
+            });
+        }
+    }
+};
+
+// One input file to look at: new or modified (current set), removed (only previous set).
+struct Change {
+    IncrementalFile current;
+    const IncrementalFile* previous;
+    enum class Outcome { Unchanged, Counted, Removed, Failed } outcome = Outcome::Failed;
+};
+
+std::string fileCountsName(const std::string& stateDir, int id) {
+    return stateDir + "/file-" + std::to_string(id) + ".bin";
+}
+
+std::string totalsName(const std::string& stateDir, std::uint64_t generation, int reduceId) {
+    return stateDir + "/totals-" + std::to_string(generation) + "-" + std::to_string(reduceId) + ".bin";
+}
+
+void addToPartition(std::vector<CountTable>& tables, std::string_view key, std::uint64_t count) {
+    std::uint64_t hash = hashKey(key);
+    tables[partitionOf(hash, static_cast<int>(tables.size()))].add(key, hash, count);
+}
+
+// Reads back the counts a previous refresh stored for one input file.
+bool readFileCounts(const std::string& path, std::vector<CountTable>& tables) {
+    IntermediateReader reader;
+    if (!reader.open(path)) {
+        Logger::getInstance().log("Failed to read stored counts " + path + " (" + reader.error() + ")", LogLevel::ERROR);
+        return false;
+    }
+    for (RunCursor run : reader.runs()) {
+        while (run.next()) {
+            addToPartition(tables, run.key(), run.count());
+        }
+    }
+    return true;
+}
+
+// Tokenizes one input file, stores its counts and adds them to tables.
+bool countFile(std::string_view text, const std::string& countsPath, std::vector<CountTable>& tables, std::string& scratch) {
+    CountTable table;
+    forEachWord(text, scratch, [&table](const std::string& word) {
+        table.add(word);
+    });
+    std::vector<KeyCount> records;
+    table.sortedRecords(records);
+    IntermediateWriter writer(countsPath);
+    if (!writer.appendRun(records) || !writer.finish()) {
+        Logger::getInstance().log("Failed to store word counts in " + countsPath, LogLevel::ERROR);
+        return false;
+    }
+    for (const auto& record : records) {
+        addToPartition(tables, record.key, record.count);
+    }
+    return true;
+}
+
+void inspectChange(Change& change, const std::string& stateDir, Delta& delta, std::string& scratch) {
+    Logger& logger = Logger::getInstance();
+    if (change.current.path.empty()) {
+        bool read = readFileCounts(fileCountsName(stateDir, change.previous->id), delta.removed);
+        change.outcome = read ? Change::Outcome::Removed : Change::Outcome::Failed;
+        return;
+    }
+
+    MappedFile input;
+    if (!input.open(change.current.path)) {
+        logger.log("Could not open input file: " + change.current.path, LogLevel::ERROR);
+        return;
+    }
+    change.current.hash = hashKey(input.view());
+    // only touched: keep the stored counts under the new metadata
+    if (change.previous != nullptr && change.previous->hash == change.current.hash) {
+        change.current.id = change.previous->id;
+        change.outcome = Change::Outcome::Unchanged;
+        return;
+    }
+    std::string_view text = input.view();
+    std::string decoded;
+    if (isGzip(text)) {
+        std::string error;
+        if (!readGzip(text, decoded, error)) {
+            logger.log("Could not decompress input file: " + change.current.path + " (" + error + ")", LogLevel::ERROR);
+            return;
+        }
+        text = decoded;
+    }
+    if (!countFile(text, fileCountsName(stateDir, change.current.id), delta.added, scratch)) {
+        return;
+    }
+    if (change.previous != nullptr && !readFileCounts(fileCountsName(stateDir, change.previous->id), delta.removed)) {
+        return;
+    }
+    change.outcome = Change::Outcome::Counted;
+}
+
+// Merges the totals of one partition with the delta, into the next totals
+// (when writeTotals) and into reduce.part-<r>.bin.
+bool rewritePartition(const Config& config, const std::string& stateDir, std::uint64_t from, std::uint64_t to,
+                      bool writeTotals, Delta& delta, int r) {
+    Logger& logger = Logger::getInstance();
+    IntermediateReader totals;
+    RunCursor old;
+    bool oldLive = false;
+    if (from > 0) {
+        std::string totalsPath = totalsName(stateDir, from, r);
+        if (!totals.open(totalsPath)) {
+            logger.log("Failed to read partition totals " + totalsPath + " (" + totals.error() + ")", LogLevel::ERROR);
+            return false;
+        }
+        if (!totals.runs().empty()) {
+            old = totals.runs()[0];
+            oldLive = old.next();
+        }
+    }
+
+    std::vector<KeyCount> added;
+    std::vector<KeyCount> removed;
+    delta.added[r].sortedRecords(added);
+    delta.removed[r].sortedRecords(removed);
+
+    std::vector<KeyCount> records;
+    std::size_t a = 0;
+    std::size_t d = 0;
+    std::uint64_t inconsistent = 0;
+    while (oldLive || a < added.size() || d < removed.size()) {
+        std::string_view key;
+        bool first = true;
+        auto consider = [&key, &first](std::string_view candidate) {
+            if (first || candidate < key) {
+                key = candidate;
+                first = false;
+            }
+        };
+        if (oldLive) {
+            consider(old.key());
+        }
+        if (a < added.size()) {
+            consider(added[a].key);
+        }
+        if (d < removed.size()) {
+            consider(removed[d].key);
+        }
+
+        std::uint64_t count = 0;
+        if (oldLive && old.key() == key) {
+            count += old.count();
+            oldLive = old.next();
+        }
+        if (a < added.size() && added[a].key == key) {
+            count += added[a++].count;
+        }
+        if (d < removed.size() && removed[d].key == key) {
+            std::uint64_t minus = removed[d++].count;
+            if (minus > count) {
+                ++inconsistent;
+                minus = count;
+            }
+            count -= minus;
+        }
+        if (count > 0) {
+            records.push_back({key, count});
+        }
+    }
+    if (inconsistent > 0) {
+        logger.log("Partition " + std::to_string(r) + ": " + std::to_string(inconsistent) + " words had more removed occurrences than stored", LogLevel::WARNING);
+    }
+
+    if (writeTotals) {
+        IntermediateWriter next(totalsName(stateDir, to, r));
+        if (!next.appendRun(records) || !next.finish()) {
+            logger.log("Failed to write partition totals " + next.path(), LogLevel::ERROR);
+            return false;
+        }
+    }
+
+    // the part a reduce task would have written: key order, and with --topk
+    // only the partition's best K
+    std::vector<std::pair<std::uint64_t, std::string>> top;
+    if (config.topK > 0) {
+        TopKHeap best(config.topK);
+        for (const auto& record : records) {
+            best.offer(record.key, record.count);
+        }
+        top = best.take();
+        std::sort(top.begin(), top.end(), [](const auto& a, const auto& b) {
+            return a.second < b.second;
+        });
+        records.clear();
+        for (const auto& [count, word] : top) {
+            records.push_back({word, count});
+        }
+    }
+    std::string part = config.outputDir + "/reduce.part-" + std::to_string(r) + ".bin";
+    IntermediateWriter writer(part + ".tmp", false, codecByName(config.compressOutput));
+    if (!writer.appendRun(records) || !writer.finish() || std::rename((part + ".tmp").c_str(), part.c_str()) != 0) {
+        logger.log("Failed to write " + part, LogLevel::ERROR);
+        std::remove((part + ".tmp").c_str());
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+bool refreshIncremental(const Config& config) {
+    Logger& logger = Logger::getInstance();
+    auto start = std::chrono::steady_clock::now();
+    std::string stateDir = config.outputDir + "/incremental";
+    std::string indexPath = stateDir + "/index";
+    std::error_code ec;
+    fs::create_directories(stateDir, ec);
+
+    IncrementalIndex previous;
+    if (!previous.load(indexPath)) {
+        previous = IncrementalIndex();
+        logger.log("No incremental state in " + stateDir + ", counting every input file", LogLevel::INFO);
+    } else if (previous.nReduce != config.nReduce) {
+        logger.log("Incremental state was built for " + std::to_string(previous.nReduce) + " reduce partitions, counting every input file again", LogLevel::WARNING);
+        previous = IncrementalIndex();
+    }
+
+    std::unordered_map<std::string, const IncrementalFile*> known;
+    for (const auto& file : previous.files) {
+        known[file.path] = &file;
+    }
+
+    IncrementalIndex next;
+    next.nReduce = config.nReduce;
+    next.nextId = previous.nextId;
+    std::vector<Change> changes;
+    std::vector<ManifestInput> inputs;
+    if (!findInputFiles(config.inputDir, config.includeGlobs, config.excludeGlobs, inputs)) {
+        return false;
+    }
+    for (const auto& input : inputs) {
+        auto it = known.find(input.path);
+        const IncrementalFile* before = it == known.end() ? nullptr : it->second;
+        if (before != nullptr) {
+            known.erase(it);
+            if (before->size == input.size && before->mtime == input.mtime) {
+                next.files.push_back(*before);
+                continue;
+            }
+        }
+        changes.push_back({{next.nextId++, input.size, input.mtime, 0, input.path}, before});
+    }
+    for (const auto& [path, before] : known) {
+        changes.push_back({{-1, 0, 0, 0, std::string()}, before});
+    }
+
+    // every thread collects its own delta; they are combined once at the end
+    Delta delta(config.nReduce);
+    std::mutex deltaMutex;
+    std::atomic<std::size_t> nextChange(0);
+    std::vector<std::thread> threads;
+    std::size_t nThreads = std::min<std::size_t>(std::max(config.nWorkers, 1), changes.size());
+    for (std::size_t t = 0; t < nThreads; ++t) {
+        threads.emplace_back([&]() {
+            Delta local(config.nReduce);
+            std::string scratch;
+            for (std::size_t i = nextChange++; i < changes.size(); i = nextChange++) {
+                inspectChange(changes[i], stateDir, local, scratch);
+            }
+            std::lock_guard<std::mutex> lock(deltaMutex);
+            delta.mergeFrom(local);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::size_t counted = 0;
+    std::size_t removed = 0;
+    std::vector<int> obsolete;
+    for (const auto& change : changes) {
+        switch (change.outcome) {
+            case Change::Outcome::Failed:
+                logger.log("Incremental refresh failed, state left at generation " + std::to_string(previous.generation), LogLevel::ERROR);
+                return false;
+            case Change::Outcome::Unchanged:
+                next.files.push_back(change.current);
+                break;
+            case Change::Outcome::Counted:
+                next.files.push_back(change.current);
+                ++counted;
+                if (change.previous != nullptr) {
+                    obsolete.push_back(change.previous->id);
+                }
+                break;
+            case Change::Outcome::Removed:
+                obsolete.push_back(change.previous->id);
+                ++removed;
+                break;
+        }
+    }
+    std::sort(next.files.begin(), next.files.end(), [](const IncrementalFile& a, const IncrementalFile& b) {
+        return a.path < b.path;
+    });
+    logger.log("Incremental refresh: " + std::to_string(counted) + " new or changed files counted, " + std::to_string(removed) + " removed, "
+               + std::to_string(next.files.size() - counted) + " unchanged", LogLevel::INFO);
+
+    // with nothing to apply the reduce parts are only rewritten from the current totals
+    bool changed = counted > 0 || removed > 0;
+    next.generation = changed ? previous.generation + 1 : previous.generation;
+    std::atomic<bool> ok(true);
+    parallelFor(config.nReduce, config.nWorkers, [&](std::size_t r) {
+        if (!rewritePartition(config, stateDir, previous.generation, next.generation, changed, delta, static_cast<int>(r))) {
+            ok = false;
+        }
+    });
+    if (!ok || !next.save(indexPath)) {
+        logger.log("Incremental refresh failed, state left at generation " + std::to_string(previous.generation), LogLevel::ERROR);
+        return false;
+    }
+
+    // the new index is committed; what the old one referenced can go
+    if (changed) {
+        for (int r = 0; r < config.nReduce && previous.generation > 0; ++r) {
+            fs::remove(totalsName(stateDir, previous.generation, r), ec);
+        }
+        for (int id : obsolete) {
+            fs::remove(fileCountsName(stateDir, id), ec);
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    logger.log("Incremental state at generation " + std::to_string(next.generation) + ", refreshed in " + std::to_string(elapsed.count()) + " seconds", LogLevel::INFO);
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "config.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Incremental word count (--incremental). The state lives in
+// <outputdir>/incremental:
+//
+//   index                 MRSTATE 1 | generation | nreduce | next file id |
+//                         one `file <id> <size> <mtime> <hash> <path>` per input
+//   file-<id>.bin         word counts of one input file, a single sorted run
+//   totals-<gen>-<r>.bin  word counts of reduce partition r, a single sorted run
+//
+// A refresh fingerprints the input directory against the index. Files with the
+// same size and mtime are not read at all; files whose metadata changed are
+// hashed, and only new or really changed files are tokenized. The counts of
+// removed and changed files are read back from their file-<id>.bin and
+// subtracted. Every partition's totals are then merged with that delta into the
+// next generation and into reduce.part-<r>.bin, and the index is replaced last,
+// so a refresh that dies halfway is simply redone from the previous
+// generation.
+
+struct IncrementalFile {
+    int id;
+    std::uint64_t size;
+    std::int64_t mtime;
+    std::uint64_t hash;
+    std::string path;
+};
+
+struct IncrementalIndex {
+    std::uint64_t generation = 0;
+    int nReduce = 0;
+    int nextId = 0;
+    std::vector<IncrementalFile> files;
+
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+};
+
+// Brings reduce.part-<r>.bin up to date with the input directory; the caller
+// then runs the usual final merge.
+bool refreshIncremental(const Config& config);
+
+#endif // INCREMENTAL_H
@@ -0,0 +1,119 @@
+#include "input_files.h"
+#include "logger.h"
+#include <algorithm>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+bool matchesGlob(const std::string& glob, const std::string& relative, const std::string& name) {
+    if (glob.find('/') == std::string::npos) {
+        return ::fnmatch(glob.c_str(), name.c_str(), 0) == 0;
+    }
+    return ::fnmatch(glob.c_str(), relative.c_str(), FNM_PATHNAME) == 0;
+}
+
+bool matchesAny(const std::vector<std::string>& globs, const std::string& relative, const std::string& name) {
+    return std::any_of(globs.begin(), globs.end(), [&](const std::string& glob) {
+        return matchesGlob(glob, relative, name);
+    });
+}
+
+// A directory still to be listed: its path, and its path below the input directory.
+struct PendingDirectory {
+    fs::path path;
+    std::string relative;
+};
+
+} // namespace
+
+bool findInputFiles(const std::string& dir, const std::vector<std::string>& include,
+                    const std::vector<std::string>& exclude, std::vector<ManifestInput>& inputs) {
+    std::mutex mtx;
+    std::condition_variable changed;
+    std::vector<PendingDirectory> pending{{fs::path(dir), std::string()}};
+    int busy = 0;
+    bool rootListed = true;
+    inputs.clear();
+
+    // a thread lists one directory at a time, and hands its subdirectories to whichever thread is free
+    auto scan = [&]() {
+        std::vector<PendingDirectory> subdirectories;
+        std::vector<ManifestInput> found;
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            changed.wait(lock, [&] { return !pending.empty() || busy == 0; });
+            if (pending.empty()) {
+                break;
+            }
+            PendingDirectory current = std::move(pending.back());
+            pending.pop_back();
+            ++busy;
+            lock.unlock();
+
+            std::error_code ec;
+            for (fs::directory_iterator it(current.path, ec), end; !ec && it != end; it.increment(ec)) {
+                const fs::directory_entry& entry = *it;
+                std::string name = entry.path().filename().string();
+                std::string relative = current.relative.empty() ? name : current.relative + "/" + name;
+                if (matchesAny(exclude, relative, name)) {
+                    continue;
+                }
+                std::error_code typeError;
+                if (entry.is_directory(typeError) && !entry.is_symlink(typeError)) {
+                    subdirectories.push_back({entry.path(), relative});
+                    continue;
+                }
+                if (!entry.is_regular_file(typeError) || (!include.empty() && !matchesAny(include, relative, name))) {
+                    continue;
+                }
+                std::string path = entry.path().string();
+                struct stat info {};
+                if (::stat(path.c_str(), &info) != 0) {
+                    continue;
+                }
+                std::int64_t mtime = static_cast<std::int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+                found.push_back({std::move(path), static_cast<std::uint64_t>(info.st_size), mtime});
+            }
+            bool isRoot = current.relative.empty();
+            if (ec && isRoot) {
+                Logger::getInstance().log("Cannot list input directory " + current.path.string() + ": " + ec.message(), LogLevel::ERROR);
+            } else if (ec) {
+                Logger::getInstance().log("Could not list input directory " + current.path.string() + ": " + ec.message(), LogLevel::WARNING);
+            }
+
+            lock.lock();
+            if (ec && isRoot) {
+                rootListed = false;
+            }
+            for (auto& subdirectory : subdirectories) {
+                pending.push_back(std::move(subdirectory));
+            }
+            subdirectories.clear();
+            --busy;
+            changed.notify_all();
+        }
+        inputs.insert(inputs.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < INPUT_SCAN_THREADS; ++t) {
+        threads.emplace_back(scan);
+    }
+    scan();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // directory listings come in no particular order
+    std::sort(inputs.begin(), inputs.end(), [](const ManifestInput& a, const ManifestInput& b) {
+        return a.path < b.path;
+    });
+    return rootListed;
+}
@@ -0,0 +1,27 @@
+#ifndef INPUT_FILES_H
+#define INPUT_FILES_H
+
+#include "manifest.h"
+#include <string>
+#include <vector>
+
+// Input discovery: every regular file under the input directory, in
+// subdirectories too, that the --include and --exclude globs let through.
+//
+// A glob without a '/' is matched against the file name, one with a '/'
+// against the path below the input directory, where '*' stops at a '/'.
+// With any --include a file has to match one of them; a file or directory
+// that matches an --exclude is left out, a directory with everything below it.
+// Symbolic links to files are followed, links to directories are not, so a
+// link cycle cannot make the walk go on forever.
+
+// directories listed and files stat'ed at once while looking for input
+constexpr int INPUT_SCAN_THREADS = 8;
+
+// Lists and fingerprints the input files into inputs, sorted by path. False
+// if dir itself cannot be listed; a subdirectory that cannot be is only
+// warned about and left out.
+bool findInputFiles(const std::string& dir, const std::vector<std::string>& include,
+                    const std::vector<std::string>& exclude, std::vector<ManifestInput>& inputs);
+
+#endif // INPUT_FILES_H
@@ -0,0 +1,121 @@
+#include "input_reader.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        close();
+        filePath = std::move(other.filePath);
+        mappedData = other.mappedData;
+        mappedSize = other.mappedSize;
+        opened = other.opened;
+        other.mappedData = nullptr;
+        other.mappedSize = 0;
+        other.opened = false;
+    }
+    return *this;
+}
+
+bool MappedFile::open(const std::string& path, Access access) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    std::size_t size = static_cast<std::size_t>(st.st_size);
+    if (size > 0) {
+        void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        madvise(addr, size, access == Access::Sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        mappedData = static_cast<const char*>(addr);
+    }
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+
+    filePath = path;
+    mappedSize = size;
+    opened = true;
+    return true;
+}
+
+void MappedFile::close() {
+    if (mappedData != nullptr) {
+        munmap(const_cast<char*>(mappedData), mappedSize);
+    }
+    filePath.clear();
+    mappedData = nullptr;
+    mappedSize = 0;
+    opened = false;
+}
+
+std::string_view MappedFile::view(std::size_t offset, std::size_t length) const {
+    if (offset >= mappedSize) {
+        return std::string_view();
+    }
+    return std::string_view(mappedData + offset, std::min(length, mappedSize - offset));
+}
+
+void MappedFile::adviseSequential(std::size_t offset, std::size_t length) const {
+    if (mappedData == nullptr || offset >= mappedSize) {
+        return;
+    }
+    // madvise wants a page-aligned start address
+    static const std::uintptr_t pageSize = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+    std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(mappedData + offset);
+    std::uintptr_t aligned = begin & ~(pageSize - 1);
+    std::size_t span = std::min(length, mappedSize - offset) + (begin - aligned);
+    madvise(reinterpret_cast<void*>(aligned), span, MADV_SEQUENTIAL);
+    madvise(reinterpret_cast<void*>(aligned), span, MADV_WILLNEED);
+}
+
+bool readFileInto(const std::string& path, std::string& buffer) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+    buffer.resize(static_cast<std::size_t>(info.st_size));
+    std::size_t filled = 0;
+    while (filled < buffer.size()) {
+        ssize_t n = ::read(fd, &buffer[filled], buffer.size() - filled);
+        if (n < 0) {
+            ::close(fd);
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        filled += static_cast<std::size_t>(n);
+    }
+    // a file that shrank since the stat is read as it is now
+    buffer.resize(filled);
+    ::close(fd);
+    return true;
+}
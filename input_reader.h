@@ -0,0 +1,51 @@
+#ifndef INPUT_READER_H
+#define INPUT_READER_H
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+// Read-only memory mapping of an input file. The splitter and the mappers look
+// at file contents through string_views into the mapping instead of copying
+// chunks into their own buffers.
+class MappedFile {
+public:
+    enum class Access {
+        Sequential,   // the whole range is about to be scanned front to back
+        Random        // only a few scattered bytes will be touched
+    };
+
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Maps the file, replacing any current mapping. Returns false on failure.
+    bool open(const std::string& path, Access access = Access::Sequential);
+    void close();
+
+    bool isOpen() const { return opened; }
+    const std::string& path() const { return filePath; }
+    std::size_t size() const { return mappedSize; }
+
+    std::string_view view() const { return std::string_view(mappedData, mappedSize); }
+    // The part of [offset, offset + length) that lies inside the file.
+    std::string_view view(std::size_t offset, std::size_t length) const;
+
+    // Tells the kernel a range is about to be read front to back.
+    void adviseSequential(std::size_t offset, std::size_t length) const;
+
+private:
+    std::string filePath;
+    const char* mappedData = nullptr;
+    std::size_t mappedSize = 0;
+    bool opened = false;
+};
+
+// Reads a whole file into buffer, reusing its capacity. For files of a few
+// KiB this is cheaper than setting up and tearing down a mapping.
+bool readFileInto(const std::string& path, std::string& buffer);
+
+#endif // INPUT_READER_H
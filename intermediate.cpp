@@ -0,0 +1,340 @@
+#include "intermediate.h"
+#include <cstring>
+#include <fstream>
+
+static const char MAGIC[4] = {'M', 'R', 'I', '1'};
+static constexpr std::uint32_t VERSION = 1;
+static constexpr std::uint32_t COMPRESSED_VERSION = 2;
+static constexpr std::uint64_t FNV_OFFSET = 1469598103934665603ULL;
+static constexpr std::uint64_t FNV_PRIME = 1099511628211ULL;
+
+static std::uint64_t fnv1a(std::uint64_t hash, const char* data, std::size_t size) {
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+template <typename T>
+static void putFixed(char* out, T value) {
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+template <typename T>
+static T getFixed(const char* in) {
+    T value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value |= static_cast<T>(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+std::string intermediateFileName(const std::string& dir, int mapId, int reduceId) {
+    return dir + "/map.part-" + std::to_string(mapId) + "-" + std::to_string(reduceId) + ".bin";
+}
+
+IntermediateWriter::IntermediateWriter(std::string path, bool inMemory, Codec codec)
+    : filePath(std::move(path)), inMemory(inMemory), codec(codec) {}
+
+static std::size_t headerSize(Codec codec) {
+    return codec == Codec::None ? INTERMEDIATE_HEADER_SIZE : COMPRESSED_INTERMEDIATE_HEADER_SIZE;
+}
+
+static void putHeader(char* header, Codec codec, std::uint64_t records, std::uint32_t runs, std::uint64_t sum) {
+    std::memcpy(header, MAGIC, sizeof(MAGIC));
+    putFixed<std::uint32_t>(header + 4, codec == Codec::None ? VERSION : COMPRESSED_VERSION);
+    putFixed<std::uint64_t>(header + 8, records);
+    putFixed<std::uint32_t>(header + 16, runs);
+    putFixed<std::uint64_t>(header + 20, sum);
+    if (codec != Codec::None) {
+        putFixed<std::uint32_t>(header + 28, static_cast<std::uint32_t>(codec));
+    }
+}
+
+// Cuts data into compressed blocks.
+static void compressBlocks(Codec codec, std::string_view data, std::string& out) {
+    out.clear();
+    for (std::size_t pos = 0; pos < data.size(); pos += COMPRESSION_BLOCK_BYTES) {
+        appendBlock(out, codec, data.substr(pos, COMPRESSION_BLOCK_BYTES));
+    }
+}
+
+bool IntermediateWriter::start() {
+    started = true;
+    recordCount = 0;
+    runCount = 0;
+    checksum = FNV_OFFSET;
+    // placeholder header, rewritten by finish(); a file is only created by
+    // its first run or by finish()
+    if (inMemory) {
+        totalBytes = INTERMEDIATE_HEADER_SIZE;
+        image.assign(INTERMEDIATE_HEADER_SIZE, '\0');
+        return true;
+    }
+    totalBytes = headerSize(codec);
+    return true;
+}
+
+bool IntermediateWriter::appendRun(const std::vector<KeyCount>& records) {
+    encoded.clear();
+    for (const auto& record : records) {
+        putVarint(encoded, record.key.size());
+        encoded.append(record.key);
+        putVarint(encoded, record.count);
+    }
+    return appendEncodedRun(encoded, records.size());
+}
+
+bool IntermediateWriter::appendEncodedRun(std::string_view records, std::uint64_t count) {
+    if (count == 0) {
+        return true;
+    }
+    if (!started && !start()) {
+        return false;
+    }
+
+    if (inMemory) {
+        std::string runHeader;
+        putVarint(runHeader, count);
+        putVarint(runHeader, records.size());
+        image.append(runHeader);
+        image.append(records);
+        totalBytes += runHeader.size() + records.size();
+    } else {
+        std::ofstream out(filePath, std::ios::binary | (runCount == 0 ? std::ios::trunc : std::ios::app));
+        if (runCount == 0) {
+            char header[COMPRESSED_INTERMEDIATE_HEADER_SIZE] = {};
+            out.write(header, headerSize(codec));
+        }
+        if (!writeRun(out, records, count)) {
+            return false;
+        }
+    }
+    recordCount += count;
+    ++runCount;
+    return true;
+}
+
+// Writes one run as the file's version lays it out and adds it to the checksum.
+bool IntermediateWriter::writeRun(std::ofstream& out, std::string_view records, std::uint64_t count) {
+    std::string runHeader;
+    putVarint(runHeader, count);
+    std::string_view body = records;
+    if (codec != Codec::None) {
+        // every run starts a new block, so a reader can seek to any run and a
+        // writer holds no half-filled block between runs
+        compressBlocks(codec, records, blocks);
+        body = blocks;
+    }
+    putVarint(runHeader, body.size());
+    checksum = fnv1a(checksum, runHeader.data(), runHeader.size());
+    checksum = fnv1a(checksum, body.data(), body.size());
+    out.write(runHeader.data(), runHeader.size());
+    out.write(body.data(), body.size());
+    totalBytes += runHeader.size() + body.size();
+    return static_cast<bool>(out);
+}
+
+bool IntermediateWriter::finish() {
+    // a writer that never received a record still leaves a valid, empty file
+    if (!started && !start()) {
+        return false;
+    }
+    started = false;
+
+    if (inMemory) {
+        char header[INTERMEDIATE_HEADER_SIZE];
+        putHeader(header, Codec::None, recordCount, runCount, 0);
+        image.replace(0, sizeof(header), header, sizeof(header));
+        return true;
+    }
+    char header[COMPRESSED_INTERMEDIATE_HEADER_SIZE] = {};
+    putHeader(header, codec, recordCount, runCount, checksum);
+    if (runCount == 0) {
+        std::ofstream out(filePath, std::ios::binary | std::ios::trunc);
+        out.write(header, headerSize(codec));
+        return static_cast<bool>(out);
+    }
+    std::fstream out(filePath, std::ios::binary | std::ios::in | std::ios::out);
+    out.seekp(0);
+    out.write(header, headerSize(codec));
+    return static_cast<bool>(out);
+}
+
+bool IntermediateWriter::spill() {
+    char header[COMPRESSED_INTERMEDIATE_HEADER_SIZE] = {};
+    std::ofstream out(filePath, std::ios::binary | std::ios::trunc);
+    out.write(header, headerSize(codec));
+    checksum = FNV_OFFSET;
+    totalBytes = headerSize(codec);
+    // the image holds plain runs, which are written out one by one
+    const char* pos = image.data() + INTERMEDIATE_HEADER_SIZE;
+    const char* end = image.data() + image.size();
+    std::uint64_t runRecords;
+    std::uint64_t runBytes;
+    while (pos < end && getVarint(pos, end, runRecords) && getVarint(pos, end, runBytes)) {
+        writeRun(out, std::string_view(pos, runBytes), runRecords);
+        pos += runBytes;
+    }
+    putHeader(header, codec, recordCount, runCount, checksum);
+    out.seekp(0);
+    out.write(header, headerSize(codec));
+    out.flush();
+    image.clear();
+    image.shrink_to_fit();
+    blocks.clear();
+    blocks.shrink_to_fit();
+    return static_cast<bool>(out);
+}
+
+RunBytes::RunBytes(const RunExtent& run) {
+    if (run.codec == Codec::None) {
+        start = run.begin;
+        pos = run.begin;
+        end = run.end;
+    } else {
+        blocks = BlockStream(run.begin, run.end, run.codec);
+    }
+}
+
+RunBytes& RunBytes::operator=(const RunBytes& other) {
+    if (this == &other) {
+        return *this;
+    }
+    start = other.start;
+    pos = other.pos;
+    end = other.end;
+    blocks = other.blocks;
+    buffer.reset();
+    if (other.buffer) {
+        buffer = std::make_unique<std::string>(*other.buffer);
+        start = buffer->data();
+        pos = start + (other.pos - other.start);
+        end = start + buffer->size();
+    }
+    return *this;
+}
+
+bool RunBytes::refill() {
+    if (blocks.empty()) {
+        // the run is done, its buffer is not needed any more
+        buffer.reset();
+        start = pos = end = nullptr;
+        return false;
+    }
+    if (!buffer) {
+        buffer = std::make_unique<std::string>();
+    }
+    // a record cut off by the end of the block moves in front of the next one
+    buffer->erase(0, buffer->size() - (end - pos));
+    bool decoded = blocks.next(*buffer);
+    start = pos = buffer->data();
+    end = start + buffer->size();
+    return decoded;
+}
+
+bool RunCursor::next() {
+    if (remaining == 0) {
+        return false;
+    }
+    bool read = bytes.read([this](const char*& pos, const char* end) {
+        std::uint64_t length;
+        if (!getVarint(pos, end, length) || length > static_cast<std::uint64_t>(end - pos)) {
+            return false;
+        }
+        keyOffset = pos - bytes.base();
+        keyLength = length;
+        pos += length;
+        return getVarint(pos, end, currentCount);
+    });
+    if (!read) {
+        remaining = 0;
+        return false;
+    }
+    --remaining;
+    return true;
+}
+
+bool IntermediateReader::open(const std::string& path) {
+    memoryImage.reset();
+    if (!file.open(path)) {
+        runCursors.clear();
+        runExtents.clear();
+        records = 0;
+        storedBytes = 0;
+        lastError = "cannot open";
+        return false;
+    }
+    storedBytes = file.size();
+    return parse(file.view(), true);
+}
+
+bool IntermediateReader::open(std::shared_ptr<const std::string> image) {
+    file.close();
+    memoryImage = std::move(image);
+    storedBytes = memoryImage->size();
+    return parse(*memoryImage, false);
+}
+
+bool IntermediateReader::parse(std::string_view data, bool verifyChecksum) {
+    runCursors.clear();
+    runExtents.clear();
+    records = 0;
+
+    if (data.size() < INTERMEDIATE_HEADER_SIZE || std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+        lastError = "not an intermediate file";
+        return false;
+    }
+    std::uint32_t version = getFixed<std::uint32_t>(data.data() + 4);
+    if (version != VERSION && (version != COMPRESSED_VERSION || data.size() < COMPRESSED_INTERMEDIATE_HEADER_SIZE)) {
+        lastError = "unsupported version";
+        return false;
+    }
+
+    std::uint64_t expectedRecords = getFixed<std::uint64_t>(data.data() + 8);
+    std::uint32_t expectedRuns = getFixed<std::uint32_t>(data.data() + 16);
+    std::uint64_t expectedChecksum = getFixed<std::uint64_t>(data.data() + 20);
+
+    std::size_t headerBytes = INTERMEDIATE_HEADER_SIZE;
+    Codec codec = Codec::None;
+    if (version == COMPRESSED_VERSION) {
+        headerBytes = COMPRESSED_INTERMEDIATE_HEADER_SIZE;
+        codec = static_cast<Codec>(getFixed<std::uint32_t>(data.data() + INTERMEDIATE_HEADER_SIZE));
+        if (codec != Codec::Lz && codec != Codec::Zlib) {
+            lastError = "unknown codec";
+            return false;
+        }
+    }
+    const char* pos = data.data() + headerBytes;
+    const char* end = data.data() + data.size();
+    if (verifyChecksum && fnv1a(FNV_OFFSET, pos, end - pos) != expectedChecksum) {
+        lastError = "checksum mismatch";
+        return false;
+    }
+
+    while (pos < end) {
+        std::uint64_t runRecords;
+        std::uint64_t runBytes;
+        if (!getVarint(pos, end, runRecords) || !getVarint(pos, end, runBytes) || runBytes > static_cast<std::uint64_t>(end - pos)) {
+            lastError = "truncated run";
+            runCursors.clear();
+            runExtents.clear();
+            return false;
+        }
+        runExtents.push_back({pos, pos + runBytes, runRecords, codec});
+        runCursors.emplace_back(runExtents.back());
+        records += runRecords;
+        pos += runBytes;
+    }
+
+    if (runCursors.size() != expectedRuns || records != expectedRecords) {
+        lastError = "header does not match contents";
+        runCursors.clear();
+        runExtents.clear();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,216 @@
+#ifndef INTERMEDIATE_H
+#define INTERMEDIATE_H
+
+#include "codec.h"
+#include "input_reader.h"
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Binary format of the map.part-<map>-<reduce>.bin files.
+//
+//   header  "MRI1" | u32 version | u64 record count | u32 run count | u64 checksum
+//           version 2 adds: u32 codec
+//   run     varint record count | varint payload bytes | records
+//           version 2: varint record count | varint stored bytes | blocks
+//   record  varint key length | key bytes | varint count
+//
+// Integers in the header are little-endian, the checksum is FNV-1a over
+// everything after the header. Every run of map output holds distinct keys in
+// ascending byte order, so a reducer can merge runs as streams. The reduce
+// parts use the format too, with runs that continue each other's key order,
+// and the final merge for its spill runs, which are ordered by count.
+// Jobs other than the word count (job.h) store their own value encoding in
+// place of the count.
+//
+// Files written with --compress-intermediate are version 2: the records of
+// each run are cut into compressed blocks (codec.h) of their own, so a reader
+// finds the runs without decoding anything and each cursor decodes its run a
+// block at a time. The checksum covers the bytes as stored.
+
+constexpr std::size_t INTERMEDIATE_HEADER_SIZE = 28;
+constexpr std::size_t COMPRESSED_INTERMEDIATE_HEADER_SIZE = 32;
+
+struct KeyCount {
+    std::string_view key;
+    std::uint64_t count;
+};
+
+// output.txt order: most frequent first, ties alphabetically
+inline bool byCountThenWord(const KeyCount& a, const KeyCount& b) {
+    return (a.count > b.count) || (a.count == b.count && a.key < b.key);
+}
+
+std::string intermediateFileName(const std::string& dir, int mapId, int reduceId);
+
+inline void putVarint(std::string& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline bool getVarint(const char*& pos, const char* end, std::uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(*pos++);
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Builds one intermediate file out of runs. The file is reopened for every run
+// so a mapper does not hold a descriptor per partition, and the header is
+// written by finish() once the totals are known.
+//
+// An in-memory writer builds the same bytes in a string instead, for the
+// in-memory shuffle (shuffle.h). It skips the checksum, which only guards
+// against damage on disk, until the image is spilled to its path. A codec
+// other than None applies to what goes to disk, the image stays uncompressed.
+class IntermediateWriter {
+public:
+    IntermediateWriter() = default;
+    explicit IntermediateWriter(std::string path, bool inMemory = false, Codec codec = Codec::None);
+
+    // Appends one run; records must already be in the order readers expect.
+    bool appendRun(const std::vector<KeyCount>& records);
+    // Appends one run of records the caller has already encoded.
+    bool appendEncodedRun(std::string_view records, std::uint64_t recordCount);
+    bool finish();
+
+    // After finish(), for an in-memory writer: writes the image to path()
+    // with its checksum, or hands the image over.
+    bool spill();
+    std::string takeImage() { return std::move(image); }
+
+    const std::string& path() const { return filePath; }
+    std::uint64_t bytesWritten() const { return totalBytes; }
+    // no record appended yet; a map task writes no file for such a partition
+    bool empty() const { return recordCount == 0; }
+
+private:
+    std::string filePath;
+    bool inMemory = false;
+    Codec codec = Codec::None;
+    std::string image;
+    std::uint64_t recordCount = 0;
+    std::uint32_t runCount = 0;
+    std::uint64_t checksum = 0;
+    std::uint64_t totalBytes = 0;
+    bool started = false;
+    std::string encoded;
+    std::string blocks;
+
+    bool start();
+    bool writeRun(std::ofstream& out, std::string_view records, std::uint64_t count);
+};
+
+// Where one run lies inside a mapped file: its records, or for a compressed
+// file the blocks they were cut into.
+struct RunExtent {
+    const char* begin;
+    const char* end;
+    std::uint64_t records;
+    Codec codec = Codec::None;
+};
+
+// The bytes of one run as a cursor walks it. A plain run is read in place, a
+// compressed one block by block into a buffer of the cursor's own, with the
+// next few blocks decoded ahead on the shared pool (BlockStream), so a
+// reducer holds a few blocks per run rather than whole partitions.
+class RunBytes {
+public:
+    RunBytes() = default;
+    explicit RunBytes(const RunExtent& run);
+    RunBytes(const RunBytes& other) { *this = other; }
+    RunBytes& operator=(const RunBytes& other);
+    RunBytes(RunBytes&&) noexcept = default;
+    RunBytes& operator=(RunBytes&&) noexcept = default;
+
+    // Reads one record with get(pos, end), which moves pos past the record
+    // and returns false if the bytes end before it does; then the next block
+    // is decoded behind the rest and get tries again. False once the run has
+    // no more bytes. A record read from a compressed run is only there until
+    // the next read, so cursors keep it as offsets from base().
+    template <typename Get>
+    bool read(Get&& get) {
+        for (;;) {
+            const char* at = pos;
+            if (get(at, end)) {
+                pos = at;
+                return true;
+            }
+            if (!refill()) {
+                return false;
+            }
+        }
+    }
+    const char* base() const { return start; }
+
+private:
+    const char* start = nullptr;
+    const char* pos = nullptr;
+    const char* end = nullptr;
+    // blocks of a compressed run that are still to be read
+    BlockStream blocks;
+    std::unique_ptr<std::string> buffer;
+
+    bool refill();
+};
+
+// Iterates over the records of one run inside a mapped file.
+class RunCursor {
+public:
+    RunCursor() = default;
+    explicit RunCursor(const RunExtent& run) : bytes(run), remaining(run.records) {}
+
+    // Moves to the next record; false when the run is exhausted. The key of
+    // a compressed run only lasts until then.
+    bool next();
+    std::string_view key() const { return std::string_view(bytes.base() + keyOffset, keyLength); }
+    std::uint64_t count() const { return currentCount; }
+
+private:
+    RunBytes bytes;
+    std::uint64_t remaining = 0;
+    std::size_t keyOffset = 0;
+    std::size_t keyLength = 0;
+    std::uint64_t currentCount = 0;
+};
+
+class IntermediateReader {
+public:
+    // Maps the file and checks its header and checksum.
+    bool open(const std::string& path);
+    // Reads the image of an in-memory writer, which has no checksum to check.
+    bool open(std::shared_ptr<const std::string> image);
+    const std::string& error() const { return lastError; }
+
+    std::uint64_t recordCount() const { return records; }
+    // bytes on disk or in the image, before decoding
+    std::uint64_t fileBytes() const { return storedBytes; }
+    // Cursors over every run, each positioned before its first record.
+    const std::vector<RunCursor>& runs() const { return runCursors; }
+    const std::vector<RunExtent>& extents() const { return runExtents; }
+
+private:
+    MappedFile file;
+    std::shared_ptr<const std::string> memoryImage;
+    std::uint64_t storedBytes = 0;
+    std::uint64_t records = 0;
+    std::vector<RunCursor> runCursors;
+    std::vector<RunExtent> runExtents;
+    std::string lastError;
+
+    bool parse(std::string_view data, bool verifyChecksum);
+};
+
+#endif // INTERMEDIATE_H
@@ -0,0 +1,174 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include "intermediate.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// A MapReduce job over text input, run by JobWorker (job_worker.h) on the
+// splits, scheduler and intermediate files every job shares.
+//
+//   Job<Value, Mapper, Combiner, Reducer, Options>
+//
+// Keys are byte strings: the shuffle hashes them to pick a reduce partition
+// and sorts them bytewise. Everything else is a type parameter, so the map
+// loop, the combine step and the (de)serialization are compiled for the job
+// and nothing goes through a virtual call or a type-erased record:
+//
+//   Mapper     constructed once per worker from the Config;
+//              operator()(const MapInput&, emit) calls emit(key, Value&&)
+//   Combiner   operator()(Value& into, Value&& from) folds two values of the
+//              same key; it must be associative, as it runs in the mapper and
+//              again in the reducer
+//   Reducer    operator()(key, const Value&, std::string& out) appends the
+//              output of one key, one or more whole lines, as the final merge
+//              writes output.txt
+//   Options    what the job supports beyond the defaults, see JobOptions
+//   ValueCodec<Value> writes and reads the value in intermediate files
+//
+// The value of a uint64_t job with SumCombiner is combined in a CountTable
+// and stored as a varint.
+
+// Features a job turns on by passing an Options type derived from this one.
+// JobWorker and the final merge compile in only what the job has, and the
+// command line rejects the options of the rest.
+struct JobOptions {
+    // --partitioner range: keys are words, so the partitions can be cut at
+    // boundaries sampled from the words of the input
+    static constexpr bool RANGE_PARTITIONER = false;
+    // without --combine a map task only folds the repeats within each
+    // --map-buffer of a partition's output; otherwise it always combines
+    static constexpr bool OPTIONAL_COMBINE = false;
+    // the value is a count: output.txt lists the keys by count, highest
+    // first and ties by key, and --topk cuts it after K
+    static constexpr bool BY_COUNT = false;
+};
+
+template <typename V, typename M, typename C, typename R, typename O = JobOptions>
+struct Job {
+    using Value = V;
+    using Mapper = M;
+    using Combiner = C;
+    using Reducer = R;
+    using Options = O;
+};
+
+// One map task: the split [begin, end) of a mapped input file. Mappers that
+// need context around the split, like the line a split starts in, can look
+// at the rest of file. A gzip file is mapped while it decodes, so there file
+// is a window of the decoded text: it starts at offset in the whole file and
+// holds the text mapped just before the split, and the split ends at a line.
+struct MapInput {
+    const std::string& fileName;
+    std::string_view file;
+    std::size_t begin;
+    std::size_t end;
+    std::size_t offset = 0;
+
+    std::string_view chunk() const { return file.substr(begin, end - begin); }
+};
+
+struct SumCombiner {
+    void operator()(std::uint64_t& into, std::uint64_t from) const {
+        into += from;
+    }
+};
+
+template <typename Value>
+struct ValueCodec;
+
+template <>
+struct ValueCodec<std::uint64_t> {
+    static void put(std::string& out, std::uint64_t value) {
+        putVarint(out, value);
+    }
+    static bool get(const char*& pos, const char* end, std::uint64_t& value) {
+        return getVarint(pos, end, value);
+    }
+};
+
+template <>
+struct ValueCodec<std::string> {
+    static void put(std::string& out, const std::string& value) {
+        putVarint(out, value.size());
+        out.append(value);
+    }
+    static bool get(const char*& pos, const char* end, std::string& value) {
+        std::uint64_t length;
+        if (!getVarint(pos, end, length) || length > static_cast<std::uint64_t>(end - pos)) {
+            return false;
+        }
+        value.assign(pos, length);
+        pos += length;
+        return true;
+    }
+};
+
+template <>
+struct ValueCodec<std::vector<std::string>> {
+    static void put(std::string& out, const std::vector<std::string>& value) {
+        putVarint(out, value.size());
+        for (const auto& item : value) {
+            ValueCodec<std::string>::put(out, item);
+        }
+    }
+    static bool get(const char*& pos, const char* end, std::vector<std::string>& value) {
+        std::uint64_t items;
+        if (!getVarint(pos, end, items)) {
+            return false;
+        }
+        value.resize(items);
+        for (auto& item : value) {
+            if (!ValueCodec<std::string>::get(pos, end, item)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// RunCursor for records whose value is encoded with ValueCodec<Value>.
+template <typename Value>
+class JobRunCursor {
+public:
+    explicit JobRunCursor(const RunExtent& run) : bytes(run), remaining(run.records) {}
+
+    // Moves to the next record; false when the run is exhausted. The key of
+    // a compressed run only lasts until then.
+    bool next() {
+        if (remaining == 0) {
+            return false;
+        }
+        bool read = bytes.read([this](const char*& pos, const char* end) {
+            std::uint64_t length;
+            if (!getVarint(pos, end, length) || length > static_cast<std::uint64_t>(end - pos)) {
+                return false;
+            }
+            keyOffset = pos - bytes.base();
+            keyLength = length;
+            pos += length;
+            return ValueCodec<Value>::get(pos, end, currentValue);
+        });
+        if (!read) {
+            remaining = 0;
+            return false;
+        }
+        --remaining;
+        return true;
+    }
+
+    std::string_view key() const { return std::string_view(bytes.base() + keyOffset, keyLength); }
+    Value& value() { return currentValue; }
+
+private:
+    RunBytes bytes;
+    std::uint64_t remaining;
+    std::size_t keyOffset = 0;
+    std::size_t keyLength = 0;
+    Value currentValue{};
+};
+
+#endif // JOB_H
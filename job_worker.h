@@ -0,0 +1,602 @@
+#ifndef JOB_WORKER_H
+#define JOB_WORKER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "config.h"
+#include "count_table.h"
+#include "gzip_input.h"
+#include "input_reader.h"
+#include "intermediate.h"
+#include "job.h"
+#include "logger.h"
+#include "master.h"
+#include "merge.h"
+#include "metrics.h"
+#include "partitioner.h"
+#include "scheduler.h"
+#include "shuffle.h"
+#include "tokenizer.h"
+#include "worker.h"
+
+// Runs the map and reduce tasks of a Job (job.h). Every map task writes its
+// own map.part-<task>-<r>.bin files, so a failed or duplicated attempt never
+// touches the output of another task, and commits them through the task
+// source. Map output is combined per task and partition; each reduce task
+// writes the combined value of every key of its partition, in key order, to
+// reduce.part-<r>.bin, which Master::merge() turns into output.txt.
+template <typename JobT>
+class JobWorker {
+public:
+    using Value = typename JobT::Value;
+    using Options = typename JobT::Options;
+    static_assert(!Options::BY_COUNT || std::is_same_v<Value, std::uint64_t>, "a job ordered by count has a count for its value");
+
+    // shuffle is the store of --shuffle memory, null for intermediate files
+    JobWorker(int id, const Config& config, ShuffleStore* shuffle = nullptr)
+        : workerId(id), config(config), shuffle(shuffle), mapper(config),
+          rangePartitioning(Options::RANGE_PARTITIONER && config.partitioner == "range"),
+          combining(!Options::OPTIONAL_COMBINE || config.combine) {
+        Logger::getInstance().log("Worker " + std::to_string(workerId) + " created", LogLevel::INFO);
+    }
+
+    void processMapTasks(TaskSource<FileMetaData>& tasks) {
+        tables.clear();
+        for (int r = 0; r < config.nReduce; ++r) {
+            tables.emplace_back();
+        }
+        bufferedBytes.assign(config.nReduce, 0);
+        FileMetaData task;
+        std::vector<std::string> outputs;
+        std::vector<std::string> written;
+        std::vector<std::string> empty;
+        std::vector<int> partitions;
+        while (tasks.next(workerId, task)) {
+            outputs.clear();
+            partitionWriters.clear();
+            for (int r = 0; r < config.nReduce; ++r) {
+                outputs.push_back(intermediateFileName(config.outputDir, task.taskId, r));
+                partitionWriters.emplace_back(attemptFileName(outputs.back(), workerId), shuffle != nullptr, codecByName(config.compressIntermediate));
+            }
+            writeFailed = false;
+            tableBytes = 0;
+            emits = 0;
+            metrics = startTaskMetrics("map", task.taskId, workerId);
+
+            bool ok = map(task, tasks);
+            flushTables();
+            metrics.tokens = emits;
+            // no file for a partition the task emitted nothing to
+            written.clear();
+            empty.clear();
+            partitions.clear();
+            for (int r = 0; r < config.nReduce; ++r) {
+                if (partitionWriters[r].empty()) {
+                    empty.push_back(outputs[r]);
+                    continue;
+                }
+                written.push_back(outputs[r]);
+                partitions.push_back(r);
+                ScopedTimer io(metrics.ioMicros);
+                if (!partitionWriters[r].finish()) {
+                    Logger::getInstance().log("Worker " + std::to_string(workerId) + " could not write intermediate file: " + partitionWriters[r].path(), LogLevel::ERROR);
+                    writeFailed = true;
+                }
+                metrics.bytesWritten += partitionWriters[r].bytesWritten();
+            }
+            if (shuffle) {
+                metrics.committed = commitShuffleAttempt(*shuffle, tasks, workerId, task.taskId, partitionWriters, outputs, ok && !writeFailed);
+            } else {
+                metrics.committed = commitAttempt(tasks, workerId, task.taskId, written, ok && !writeFailed, empty, partitions);
+            }
+            metrics.endMicros = metricsClockMicros();
+            tasks.report(metrics);
+        }
+        input.close();
+    }
+
+    void processReduceTasks(TaskSource<ReduceTask>& tasks) {
+        ReduceTask task;
+        std::vector<std::string> outputs;
+        while (tasks.next(workerId, task)) {
+            int reduceTaskId = task.partition;
+            outputs.assign(1, config.outputDir + "/reduce.part-" + std::to_string(reduceTaskId) + ".bin");
+            metrics = startTaskMetrics("reduce", reduceTaskId, workerId);
+            bool ok = reduce(task, outputs[0], tasks);
+            metrics.committed = commitAttempt(tasks, workerId, reduceTaskId, outputs, ok);
+            if (shuffle && metrics.committed) {
+                shuffle->release(reduceTaskId);
+            }
+            metrics.endMicros = metricsClockMicros();
+            tasks.report(metrics);
+        }
+    }
+
+private:
+    // A uint64_t value summed by its combiner is what CountTable is built for;
+    // anything else is combined in a hash map of owned keys.
+    static constexpr bool COUNTING = std::is_same_v<Value, std::uint64_t> && std::is_same_v<typename JobT::Combiner, SumCombiner>;
+    using Table = std::conditional_t<COUNTING, CountTable, std::unordered_map<std::string, Value>>;
+    // how many emits pass between checks of the tables' memory use
+    static constexpr std::size_t COMBINE_CHECK_INTERVAL = 4096;
+    // estimated hash map cost of an entry beyond its key and value bytes
+    static constexpr std::size_t ENTRY_OVERHEAD_BYTES = 64;
+
+    int workerId;
+    Config config;
+    ShuffleStore* shuffle;
+    typename JobT::Mapper mapper;
+    typename JobT::Combiner combiner;
+    bool rangePartitioning;
+    bool combining;
+    MappedFile input;
+    // decoded gzip input: what a gzip task has not mapped yet behind the text
+    // it mapped last, or a whole compressed file of a packed task
+    std::string decoded;
+    // contents of the current file of a packed task
+    std::string packBuffer;
+    // per-partition combined map output of the current task
+    std::vector<Table> tables;
+    std::size_t tableBytes = 0;
+    // without combining: key bytes emitted to each table since it was last written
+    std::vector<std::size_t> bufferedBytes;
+    std::size_t emits = 0;
+    std::string keyBuffer;
+    std::vector<IntermediateWriter> partitionWriters;
+    bool writeFailed = false;
+    // reused while turning a table into a sorted run
+    std::vector<KeyCount> runRecords;
+    std::vector<const std::pair<const std::string, Value>*> runEntries;
+    std::string encoded;
+    TaskMetrics metrics;
+
+    static std::size_t valueBytes(std::uint64_t) { return sizeof(std::uint64_t); }
+    static std::size_t valueBytes(const std::string& value) { return sizeof(std::string) + value.size(); }
+    static std::size_t valueBytes(const std::vector<std::string>& value) {
+        std::size_t bytes = sizeof(value);
+        for (const auto& item : value) {
+            bytes += valueBytes(item);
+        }
+        return bytes;
+    }
+
+    void emit(std::string_view key, Value&& value) {
+        std::uint64_t hash = hashKey(key);
+        int reduceIndex;
+        if constexpr (Options::RANGE_PARTITIONER) {
+            reduceIndex = rangePartitioning ? rangePartitionOf(config.rangeBoundaries, key) : partitionOf(hash, config.nReduce);
+        } else {
+            reduceIndex = partitionOf(hash, config.nReduce);
+        }
+        if constexpr (COUNTING) {
+            tables[reduceIndex].add(key, hash, value);
+        } else {
+            keyBuffer.assign(key);
+            auto found = tables[reduceIndex].find(keyBuffer);
+            if (found != tables[reduceIndex].end()) {
+                combiner(found->second, std::move(value));
+            } else {
+                tableBytes += key.size() + valueBytes(value) + ENTRY_OVERHEAD_BYTES;
+                tables[reduceIndex].emplace(keyBuffer, std::move(value));
+            }
+        }
+
+        ++emits;
+
+        // a table that only stands in for a buffer is written once the buffer would be full
+        if constexpr (Options::OPTIONAL_COMBINE) {
+            if (!combining) {
+                bufferedBytes[reduceIndex] += key.size() + 1;
+                if (bufferedBytes[reduceIndex] >= config.mapBufferBytes) {
+                    flushTable(reduceIndex);
+                }
+                return;
+            }
+        }
+        if (emits % COMBINE_CHECK_INTERVAL == 0) {
+            if constexpr (COUNTING) {
+                tableBytes = 0;
+                for (const auto& table : tables) {
+                    tableBytes += table.memoryBytes();
+                }
+            }
+            if (tableBytes >= config.combineLimitBytes) {
+                Logger::getInstance().log("Worker " + std::to_string(workerId) + " combiner reached its memory limit, flushing partial results", LogLevel::DEBUG);
+                flushTables();
+            }
+        }
+    }
+
+    // Writes every table as one sorted run of its partition and empties it.
+    void flushTables() {
+        for (int r = 0; r < config.nReduce; ++r) {
+            flushTable(r);
+        }
+        tableBytes = 0;
+    }
+
+    void flushTable(int r) {
+        Table& table = tables[r];
+        bufferedBytes[r] = 0;
+        if (table.empty()) {
+            return;
+        }
+        metrics.tableEntries = std::max<std::uint64_t>(metrics.tableEntries, table.size());
+        metrics.records += table.size();
+        ++metrics.runs;
+        bool written;
+        if constexpr (COUNTING) {
+            runRecords.clear();
+            table.sortedRecords(runRecords);
+            ScopedTimer io(metrics.ioMicros);
+            written = partitionWriters[r].appendRun(runRecords);
+        } else {
+            runEntries.clear();
+            for (const auto& entry : table) {
+                runEntries.push_back(&entry);
+            }
+            std::sort(runEntries.begin(), runEntries.end(), [](const auto* a, const auto* b) {
+                return a->first < b->first;
+            });
+            encoded.clear();
+            for (const auto* entry : runEntries) {
+                putVarint(encoded, entry->first.size());
+                encoded.append(entry->first);
+                ValueCodec<Value>::put(encoded, entry->second);
+            }
+            ScopedTimer io(metrics.ioMicros);
+            written = partitionWriters[r].appendEncodedRun(encoded, runEntries.size());
+        }
+        if (!written) {
+            Logger::getInstance().log("Worker " + std::to_string(workerId) + " could not write intermediate file: " + partitionWriters[r].path(), LogLevel::ERROR);
+            writeFailed = true;
+        }
+        table.clear();
+    }
+
+    bool map(const FileMetaData& task, const TaskSource<FileMetaData>& tasks) {
+        Logger& logger = Logger::getInstance();
+        if (!task.packedFiles.empty()) {
+            return mapPacked(task, tasks);
+        }
+        if (!input.isOpen() || input.path() != task.fileName) {
+            ScopedTimer io(metrics.ioMicros);
+            if (!input.open(task.fileName)) {
+                logger.log("Worker " + std::to_string(workerId) + " could not open file: " + task.fileName, LogLevel::ERROR);
+                return false;
+            }
+        }
+        std::string_view file = input.view();
+        if (isGzip(file)) {
+            return mapGzip(task, tasks);
+        }
+        if (task.offset + task.fileSize > file.size()) {
+            logger.log("Worker " + std::to_string(workerId) + " could not read from file: " + task.fileName, LogLevel::ERROR);
+            return false;
+        }
+        if (task.fileSize >= (1 << 20)) {
+            input.adviseSequential(task.offset, task.fileSize);
+        }
+
+        mapText(task.fileName, file, 0, task.offset, task.offset + task.fileSize, task.taskId, tasks);
+        return true;
+    }
+
+    // A gzip file is always a task of its own. It is inflated on a second
+    // thread and mapped while it decodes, up to the last complete line of
+    // what arrived; the rest waits for the next chunk. The text mapped last
+    // stays in front of it, so a mapper that looks back before its split,
+    // like the bigrams, still sees the words before it, and memory stays at
+    // a few chunks instead of the decoded file.
+    bool mapGzip(const FileMetaData& task, const TaskSource<FileMetaData>& tasks) {
+        GzipStream stream(input.view());
+        std::string_view chunk;
+        decoded.clear();
+        // offset of decoded[0] in the decoded file, and how much of decoded was mapped
+        std::size_t decodedOffset = 0;
+        std::size_t mapped = 0;
+        bool more = true;
+        while (more && !tasks.superseded(task.taskId)) {
+            {
+                ScopedTimer io(metrics.ioMicros);
+                more = stream.next(chunk);
+            }
+            std::size_t end = decoded.size();
+            if (more) {
+                std::size_t lastLine = chunk.rfind('\n');
+                decoded.append(chunk);
+                if (lastLine == std::string_view::npos) {
+                    continue;
+                }
+                end += lastLine + 1;
+            }
+            mapText(task.fileName, decoded, decodedOffset, mapped, end, task.taskId, tasks);
+            decoded.erase(0, mapped);
+            decodedOffset += mapped;
+            mapped = end - mapped;
+        }
+        if (!stream.ok()) {
+            Logger::getInstance().log("Worker " + std::to_string(workerId) + " could not decompress " + task.fileName + ": " + stream.error(), LogLevel::ERROR);
+            return false;
+        }
+        return true;
+    }
+
+    // A task packed from small files reads them one after another into the
+    // same buffer instead of mapping each of them.
+    bool mapPacked(const FileMetaData& task, const TaskSource<FileMetaData>& tasks) {
+        Logger& logger = Logger::getInstance();
+        for (std::size_t i = 0; i <= task.packedFiles.size() && !tasks.superseded(task.taskId); ++i) {
+            const std::string& fileName = i == 0 ? task.fileName : task.packedFiles[i - 1].fileName;
+            {
+                ScopedTimer io(metrics.ioMicros);
+                if (!readFileInto(fileName, packBuffer)) {
+                    logger.log("Worker " + std::to_string(workerId) + " could not read file: " + fileName, LogLevel::ERROR);
+                    return false;
+                }
+            }
+            std::string_view text = packBuffer;
+            if (isGzip(text)) {
+                std::string error;
+                ScopedTimer io(metrics.ioMicros);
+                if (!readGzip(text, decoded, error)) {
+                    logger.log("Worker " + std::to_string(workerId) + " could not decompress " + fileName + ": " + error, LogLevel::ERROR);
+                    return false;
+                }
+                text = decoded;
+            }
+            mapText(fileName, text, 0, 0, text.size(), task.taskId, tasks);
+        }
+        return true;
+    }
+
+    // Maps [start, chunkEnd) of file, which begins at fileOffset of the input
+    // file. Slices end at a separator like the splits themselves, so a mapper
+    // sees the same split boundaries it would for a smaller --split-size.
+    void mapText(const std::string& fileName, std::string_view file, std::size_t fileOffset, std::size_t start, std::size_t chunkEnd,
+                 int taskId, const TaskSource<FileMetaData>& tasks) {
+        auto emitTo = [this](std::string_view key, Value&& value) {
+            emit(key, std::move(value));
+        };
+        while (start < chunkEnd && !tasks.superseded(taskId)) {
+            std::size_t end = std::min(start + TASK_SLICE_BYTES, chunkEnd);
+            while (end < chunkEnd && !isWordSeparator(file[end])) {
+                ++end;
+            }
+            mapper(MapInput{fileName, file, start, end, fileOffset}, emitTo);
+            metrics.bytesRead += end - start;
+            start = end;
+        }
+    }
+
+    // The intermediate files of the map tasks the master listed for the
+    // partition, which must all be there, or its batches in the shuffle store
+    // once every map task is in, folded as they arrive. Files past
+    // REDUCE_MERGE_FANIN are merged down first.
+    bool openPartition(const ReduceTask& task, std::vector<IntermediateReader>& readers) {
+        Logger& logger = Logger::getInstance();
+        int reduceTaskId = task.partition;
+        std::vector<std::string> files;
+        std::vector<std::shared_ptr<const std::string>> images;
+        if (!shuffle) {
+            for (int m : task.mapOutputs) {
+                std::string fileName = intermediateFileName(config.outputDir, m, reduceTaskId);
+                if (!std::filesystem::exists(fileName)) {
+                    logger.log("Worker " + std::to_string(workerId) + " is missing intermediate file " + fileName + " that map task " + std::to_string(m) + " committed", LogLevel::ERROR);
+                    return false;
+                }
+                files.push_back(fileName);
+            }
+        } else {
+            ShuffleBatches batches;
+            bool collected = collectPartition(*shuffle, reduceTaskId, batches, [&](const ShuffleBatches& partial) {
+                mergeShuffleBatches(reduceTaskId, partial);
+            });
+            if (!collected) {
+                logger.log("Worker " + std::to_string(workerId) + " gave up reduce task " + std::to_string(reduceTaskId) + ", the map phase failed", LogLevel::ERROR);
+                return false;
+            }
+            for (const auto& batch : batches) {
+                if (batch->image) {
+                    images.push_back(batch->image);
+                } else {
+                    files.push_back(batch->path);
+                }
+            }
+        }
+
+        std::vector<std::string> merged;
+        std::size_t mapOutputs = files.size();
+        std::string mergePrefix = config.outputDir + "/reduce.merge-" + std::to_string(reduceTaskId) + "-";
+        if (!mergeToFanIn(files, mergePrefix, workerId, merged, [this](const std::vector<std::string>& inputs, const std::string& output) {
+                return mergeIntermediateFiles<Value>(inputs, output, config, workerId, combiner, metrics);
+            })) {
+            return false;
+        }
+        if (!merged.empty()) {
+            logger.log("Worker " + std::to_string(workerId) + " merged the " + std::to_string(mapOutputs) + " intermediate files of partition " + std::to_string(reduceTaskId) + " down to " + std::to_string(files.size()), LogLevel::INFO);
+        }
+
+        readers.resize(files.size() + images.size());
+        bool opened = true;
+        for (std::size_t i = 0; opened && i < files.size(); ++i) {
+            ScopedTimer io(metrics.ioMicros);
+            if (!readers[i].open(files[i])) {
+                logger.log("Worker " + std::to_string(workerId) + " failed to read intermediate file: " + files[i] + " (" + readers[i].error() + ")", LogLevel::ERROR);
+                opened = false;
+            }
+        }
+        for (std::size_t i = 0; opened && i < images.size(); ++i) {
+            readers[files.size() + i].open(images[i]);
+        }
+        // the mappings outlive the names of the merged files
+        for (const auto& file : merged) {
+            std::remove(file.c_str());
+        }
+        return opened;
+    }
+
+    // Folds the in-memory batches of a partition into one as soon as there
+    // are SHUFFLE_MERGE_FANIN of them, so the reducer works while map tasks
+    // still run and the final merge has few runs left.
+    void mergeShuffleBatches(int reduceTaskId, const ShuffleBatches& batches) {
+        ShuffleBatches inMemory;
+        for (const auto& batch : batches) {
+            if (batch->image) {
+                inMemory.push_back(batch);
+            }
+        }
+        if (inMemory.size() < SHUFFLE_MERGE_FANIN) {
+            return;
+        }
+
+        std::vector<IntermediateReader> readers(inMemory.size());
+        std::vector<JobRunCursor<Value>> cursors;
+        std::vector<bool> live;
+        for (std::size_t i = 0; i < inMemory.size(); ++i) {
+            if (!openBatch(readers[i], *inMemory[i])) {
+                return;
+            }
+            for (const RunExtent& run : readers[i].extents()) {
+                cursors.emplace_back(run);
+                live.push_back(cursors.back().next());
+            }
+        }
+        auto byKey = [](const JobRunCursor<Value>& a, const JobRunCursor<Value>& b) {
+            return a.key() < b.key();
+        };
+        LoserTree<JobRunCursor<Value>, decltype(byKey)> runs(cursors, std::move(live), byKey);
+        std::string key;
+        std::string merged;
+        std::uint64_t records = 0;
+        while (!runs.empty()) {
+            key.assign(runs.top().key());
+            Value value = std::move(runs.top().value());
+            runs.advance();
+            while (!runs.empty() && runs.top().key() == key) {
+                combiner(value, std::move(runs.top().value()));
+                runs.advance();
+            }
+            putVarint(merged, key.size());
+            merged.append(key);
+            ValueCodec<Value>::put(merged, value);
+            ++records;
+        }
+
+        IntermediateWriter writer(std::string(), true);
+        writer.appendEncodedRun(merged, records);
+        writer.finish();
+        if (shuffle->replace(reduceTaskId, inMemory, {std::make_shared<const std::string>(writer.takeImage()), std::string()})) {
+            Logger::getInstance().log("Worker " + std::to_string(workerId) + " merged " + std::to_string(inMemory.size()) + " shuffle batches of partition " + std::to_string(reduceTaskId), LogLevel::DEBUG);
+        }
+    }
+
+    bool reduce(const ReduceTask& task, const std::string& output, const TaskSource<ReduceTask>& tasks) {
+        Logger& logger = Logger::getInstance();
+        int reduceTaskId = task.partition;
+        logger.log("Worker " + std::to_string(workerId) + " starts reduce task ID: " + std::to_string(reduceTaskId), LogLevel::INFO);
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<IntermediateReader> readers;
+        if (!openPartition(task, readers)) {
+            return false;
+        }
+        std::vector<JobRunCursor<Value>> cursors;
+        std::vector<bool> live;
+        for (const auto& reader : readers) {
+            metrics.bytesRead += reader.fileBytes();
+            for (const RunExtent& run : reader.extents()) {
+                cursors.emplace_back(run);
+                live.push_back(cursors.back().next());
+            }
+        }
+        auto byKey = [](const JobRunCursor<Value>& a, const JobRunCursor<Value>& b) {
+            return a.key() < b.key();
+        };
+        metrics.runs = cursors.size();
+        LoserTree<JobRunCursor<Value>, decltype(byKey)> runs(cursors, std::move(live), byKey);
+
+        // written in runs of about --map-buffer bytes; every run continues the
+        // key order of the one before. With --topk only the partition's best K
+        // are written, once every key is in.
+        IntermediateWriter writer(attemptFileName(output, workerId), false, codecByName(config.compressOutput));
+        bool topOnly = Options::BY_COUNT && config.topK > 0;
+        TopKHeap best(topOnly ? config.topK : 0);
+        std::string key;
+        std::uint64_t runRecordCount = 0;
+        encoded.clear();
+        auto append = [&](std::string_view recordKey, const Value& value) {
+            putVarint(encoded, recordKey.size());
+            encoded.append(recordKey);
+            ValueCodec<Value>::put(encoded, value);
+            ++runRecordCount;
+        };
+        auto writeRun = [&]() {
+            ScopedTimer io(metrics.ioMicros);
+            bool written = writer.appendEncodedRun(encoded, runRecordCount);
+            encoded.clear();
+            runRecordCount = 0;
+            return written;
+        };
+        bool ok = true;
+        while (ok && !runs.empty()) {
+            key.assign(runs.top().key());
+            Value value = std::move(runs.top().value());
+            runs.advance();
+            while (!runs.empty() && runs.top().key() == key) {
+                combiner(value, std::move(runs.top().value()));
+                runs.advance();
+            }
+            ++metrics.records;
+
+            if constexpr (Options::BY_COUNT) {
+                if (topOnly) {
+                    best.offer(key, value);
+                    continue;
+                }
+            }
+            append(key, value);
+            if (encoded.size() >= config.mapBufferBytes) {
+                ok = writeRun();
+                if (ok && tasks.superseded(reduceTaskId)) {
+                    return true;
+                }
+            }
+        }
+        if constexpr (Options::BY_COUNT) {
+            if (topOnly) {
+                std::vector<std::pair<std::uint64_t, std::string>> top = best.take();
+                std::sort(top.begin(), top.end(), [](const auto& a, const auto& b) {
+                    return a.second < b.second;
+                });
+                for (const auto& [count, word] : top) {
+                    append(word, count);
+                }
+            }
+        }
+        ok = ok && writeRun();
+        {
+            ScopedTimer io(metrics.ioMicros);
+            ok = writer.finish() && ok;
+        }
+        metrics.bytesWritten = writer.bytesWritten();
+        if (!ok) {
+            logger.log("Worker " + std::to_string(workerId) + " failed to write output file: " + writer.path(), LogLevel::ERROR);
+            return false;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        logger.log("Worker " + std::to_string(workerId) + " completed reduce task ID: " + std::to_string(reduceTaskId) + " in " + std::to_string(elapsed.count()) + " seconds", LogLevel::INFO);
+        return true;
+    }
+};
+
+#endif // JOB_WORKER_H
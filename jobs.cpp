@@ -0,0 +1,38 @@
+#include "jobs.h"
+#include <cstdio>
+
+std::string BigramMapper::lastWordBefore(const MapInput& input) {
+    // walk back one token at a time until one of them is a word
+    std::string last;
+    std::size_t pos = input.begin;
+    while (pos > 0 && last.empty()) {
+        while (pos > 0 && isWordSeparator(input.file[pos - 1])) {
+            --pos;
+        }
+        std::size_t tokenEnd = pos;
+        while (pos > 0 && !isWordSeparator(input.file[pos - 1])) {
+            --pos;
+        }
+        forEachWord(input.file.substr(pos, tokenEnd - pos), word, [&last](const std::string& w) {
+            last = w;
+        });
+    }
+    return last;
+}
+
+std::string GrepMapper::lineKey(const std::string& fileName, std::size_t offset) {
+    char digits[24];
+    std::snprintf(digits, sizeof(digits), ":%016zu", offset);
+    return fileName + digits;
+}
+
+void GrepReducer::operator()(std::string_view key, const std::string& line, std::string& out) const {
+    std::size_t colon = key.rfind(':');
+    std::string_view offset = key.substr(colon + 1);
+    std::size_t firstDigit = std::min(offset.find_first_not_of('0'), offset.size() - 1);
+    out.append(key.substr(0, colon + 1));
+    out.append(offset.substr(firstDigit));
+    out.push_back(':');
+    out.append(line);
+    out.push_back('\n');
+}
@@ -0,0 +1,196 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "config.h"
+#include "count_table.h"
+#include "job.h"
+#include "tokenizer.h"
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Word count, the job the engine was built for: `word,count` for every word,
+// most frequent first. It is the one job with every JobOptions feature, and
+// the one --incremental and --stream recount.
+class WordMapper {
+public:
+    explicit WordMapper(const Config&) {}
+
+    template <typename Emit>
+    void operator()(const MapInput& input, Emit&& emit) {
+        forEachWord(input.chunk(), word, [&emit](const std::string& w) {
+            emit(w, std::uint64_t{1});
+        });
+    }
+
+private:
+    std::string word;
+};
+
+// Writes `key,count`.
+struct CountReducer {
+    void operator()(std::string_view key, std::uint64_t count, std::string& out) const {
+        out.append(key);
+        out.push_back(',');
+        out.append(std::to_string(count));
+        out.push_back('\n');
+    }
+};
+
+struct WordCountOptions : JobOptions {
+    static constexpr bool RANGE_PARTITIONER = true;
+    static constexpr bool OPTIONAL_COMBINE = true;
+    static constexpr bool BY_COUNT = true;
+};
+
+using WordCountJob = Job<std::uint64_t, WordMapper, SumCombiner, CountReducer, WordCountOptions>;
+
+// Inverted index: every word with the input files it occurs in, as
+// `word<TAB>file<TAB>file...` with the files sorted.
+class DocumentMapper {
+public:
+    explicit DocumentMapper(const Config&) {}
+
+    template <typename Emit>
+    void operator()(const MapInput& input, Emit&& emit) {
+        // every word of a split comes from the same file, so each is emitted once
+        seen.clear();
+        forEachWord(input.chunk(), word, [this](const std::string& w) {
+            seen.add(w);
+        });
+        seen.forEach([&](std::string_view w, std::uint64_t) {
+            emit(w, std::vector<std::string>{input.fileName});
+        });
+    }
+
+private:
+    std::string word;
+    CountTable seen;
+};
+
+// Union of two sorted file lists.
+struct DocumentListCombiner {
+    void operator()(std::vector<std::string>& into, std::vector<std::string>&& from) const {
+        if (from.size() == 1 && std::binary_search(into.begin(), into.end(), from[0])) {
+            return;
+        }
+        std::vector<std::string> merged;
+        merged.reserve(into.size() + from.size());
+        std::merge(std::make_move_iterator(into.begin()), std::make_move_iterator(into.end()),
+                   std::make_move_iterator(from.begin()), std::make_move_iterator(from.end()), std::back_inserter(merged));
+        merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+        into.swap(merged);
+    }
+};
+
+struct DocumentListReducer {
+    void operator()(std::string_view key, const std::vector<std::string>& files, std::string& out) const {
+        out.append(key);
+        for (const auto& file : files) {
+            out.push_back('\t');
+            out.append(file);
+        }
+        out.push_back('\n');
+    }
+};
+
+using InvertedIndexJob = Job<std::vector<std::string>, DocumentMapper, DocumentListCombiner, DocumentListReducer>;
+
+// Bigram counts: every pair of consecutive words as `first second,count`.
+// Tokens that are not words are skipped as in the word count, so they do not
+// break a pair. Pairs run across splits but not across files.
+class BigramMapper {
+public:
+    explicit BigramMapper(const Config&) {}
+
+    template <typename Emit>
+    void operator()(const MapInput& input, Emit&& emit) {
+        previous = lastWordBefore(input);
+        forEachWord(input.chunk(), word, [&](const std::string& w) {
+            if (!previous.empty()) {
+                pair.assign(previous);
+                pair.push_back(' ');
+                pair.append(w);
+                emit(pair, std::uint64_t{1});
+            }
+            previous.assign(w);
+        });
+    }
+
+private:
+    std::string word;
+    std::string previous;
+    std::string pair;
+
+    // The last word of the file before the split, or "" if there is none.
+    std::string lastWordBefore(const MapInput& input);
+};
+
+using BigramJob = Job<std::uint64_t, BigramMapper, SumCombiner, CountReducer>;
+
+// Grep: every input line containing --pattern, as `file:offset:line`, sorted
+// by file and then by the byte offset the line starts at. A line belongs to
+// the split its first byte is in.
+class GrepMapper {
+public:
+    explicit GrepMapper(const Config& config) : pattern(config.pattern) {}
+
+    template <typename Emit>
+    void operator()(const MapInput& input, Emit&& emit) {
+        std::size_t start = input.begin;
+        if (start > 0 && input.file[start - 1] != '\n') {
+            start = input.file.find('\n', start);
+            start = start == std::string_view::npos ? input.file.size() : start + 1;
+        }
+        while (start < input.end) {
+            std::size_t end = input.file.find('\n', start);
+            if (end == std::string_view::npos) {
+                end = input.file.size();
+            }
+            std::string_view line = input.file.substr(start, end - start);
+            if (line.find(pattern) != std::string_view::npos) {
+                emit(lineKey(input.fileName, input.offset + start), std::string(line));
+            }
+            start = end + 1;
+        }
+    }
+
+private:
+    std::string pattern;
+
+    // file name and zero-padded offset, so keys sort by position
+    static std::string lineKey(const std::string& fileName, std::size_t offset);
+};
+
+// Every key is one line, so there is nothing to combine.
+struct KeepFirst {
+    void operator()(std::string&, std::string&&) const {}
+};
+
+struct GrepReducer {
+    void operator()(std::string_view key, const std::string& line, std::string& out) const;
+};
+
+using GrepJob = Job<std::string, GrepMapper, KeepFirst, GrepReducer>;
+
+// Calls f with a (stateless) instance of the job --job names; false for an
+// unknown name.
+template <typename F>
+bool withJob(const std::string& name, F&& f) {
+    if (name == "wordcount") {
+        f(WordCountJob{});
+    } else if (name == "inverted-index") {
+        f(InvertedIndexJob{});
+    } else if (name == "bigrams") {
+        f(BigramJob{});
+    } else if (name == "grep") {
+        f(GrepJob{});
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#endif // JOBS_H
@@ -0,0 +1,188 @@
+#include "logger.h"
+#include <cstdint>
+#include <iostream>
+
+static int severity(LogLevel level) {
+    switch (level) {
+        case LogLevel::DEBUG:
+            return 0;
+        case LogLevel::INFO:
+            return 1;
+        case LogLevel::WARNING:
+            return 2;
+        case LogLevel::ERROR:
+            return 3;
+    }
+    return 3;
+}
+
+bool parseLogLevel(const std::string& name, LogLevel& level) {
+    if (name == "debug") {
+        level = LogLevel::DEBUG;
+    } else if (name == "info") {
+        level = LogLevel::INFO;
+    } else if (name == "warning") {
+        level = LogLevel::WARNING;
+    } else if (name == "error") {
+        level = LogLevel::ERROR;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* logLevelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::INFO:
+            return "INFO";
+        case LogLevel::DEBUG:
+            return "DEBUG";
+        case LogLevel::ERROR:
+            return "ERROR";
+        case LogLevel::WARNING:
+            return "WARNING";
+    }
+    return "";
+}
+
+Logger::Logger() : slots(new Slot[LOG_RING_CAPACITY]), minSeverity(severity(LogLevel::DEBUG)) {
+    // slot i is free for the producer that claims position i
+    for (std::size_t i = 0; i < LOG_RING_CAPACITY; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    flusher = std::thread(&Logger::run, this);
+}
+
+Logger::~Logger() {
+    running.store(false, std::memory_order_release);
+    flusher.join();
+    if (logFile.is_open()) {
+        logFile.close();
+    }
+}
+
+void Logger::setLogFile(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(sinkMtx);
+    if (logFile.is_open()) {
+        logFile.close();
+    }
+    logFile.open(filename, std::ios::app);
+}
+
+void Logger::setMinLevel(LogLevel level) {
+    minSeverity.store(severity(level), std::memory_order_relaxed);
+}
+
+void Logger::setConsoleEcho(bool enabled) {
+    consoleEcho.store(enabled, std::memory_order_relaxed);
+}
+
+void Logger::log(std::string message, LogLevel level) {
+    if (severity(level) < minSeverity.load(std::memory_order_relaxed)) {
+        return;
+    }
+    auto now = std::chrono::system_clock::now();
+    while (!tryPush(message, level, now)) {
+        if (level != LogLevel::ERROR) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+// Bounded MPMC queue after Vyukov, used with a single consumer: a slot's
+// sequence equals the position that may fill it next, and position + 1 once it
+// holds a message for the consumer.
+bool Logger::tryPush(std::string& message, LogLevel level, std::chrono::system_clock::time_point time) {
+    std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot& slot = slots[pos & (LOG_RING_CAPACITY - 1)];
+        std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        std::intptr_t diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+        if (diff == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.level = level;
+                slot.time = time;
+                slot.message = std::move(message);
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // the consumer has not freed this slot yet: the ring is full
+            return false;
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::flush() {
+    std::size_t target = enqueuePos.load(std::memory_order_acquire);
+    while (written.load(std::memory_order_acquire) < target) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+const std::string& Logger::stamp(std::chrono::system_clock::time_point time) {
+    std::time_t second = std::chrono::system_clock::to_time_t(time);
+    if (second != cachedSecond) {
+        std::tm local {};
+        localtime_r(&second, &local);
+        char buffer[32];
+        std::size_t length = std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &local);
+        cachedStamp.assign(buffer, length);
+        cachedSecond = second;
+    }
+    return cachedStamp;
+}
+
+// Writes out every message published so far and returns how many there were.
+std::size_t Logger::drain() {
+    std::string batch;
+    std::size_t count = 0;
+    for (;;) {
+        Slot& slot = slots[dequeuePos & (LOG_RING_CAPACITY - 1)];
+        std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != dequeuePos + 1) {
+            break;
+        }
+        batch += stamp(slot.time);
+        batch += " - ";
+        batch += logLevelName(slot.level);
+        batch += ": ";
+        batch += slot.message;
+        batch += '\n';
+        slot.message.clear();
+        slot.sequence.store(dequeuePos + LOG_RING_CAPACITY, std::memory_order_release);
+        ++dequeuePos;
+        ++count;
+    }
+
+    std::uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost > 0) {
+        batch += stamp(std::chrono::system_clock::now());
+        batch += " - WARNING: " + std::to_string(lost) + " log messages dropped, the log ring was full\n";
+    }
+    if (!batch.empty()) {
+        std::lock_guard<std::mutex> lock(sinkMtx);
+        if (consoleEcho.load(std::memory_order_relaxed)) {
+            std::cout << batch << std::flush;
+        }
+        if (logFile.is_open()) {
+            logFile << batch << std::flush;
+        }
+    }
+    written.store(dequeuePos, std::memory_order_release);
+    return count;
+}
+
+void Logger::run() {
+    while (running.load(std::memory_order_acquire)) {
+        if (drain() == 0) {
+            std::this_thread::sleep_for(LOG_FLUSH_INTERVAL);
+        }
+    }
+    // whatever was logged before shutdown
+    drain();
+}
@@ -1,12 +1,16 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
-#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
 #include <fstream>
-#include <string>
+#include <memory>
 #include <mutex>
-#include <iomanip>
-#include <sstream>
+#include <string>
+#include <thread>
 
 enum class LogLevel {
     INFO,
@@ -15,6 +19,24 @@ enum class LogLevel {
     WARNING
 };
 
+// messages the ring holds before log() starts dropping them; a power of two
+constexpr std::size_t LOG_RING_CAPACITY = 1 << 14;
+// how long the flusher sleeps when the ring is empty
+constexpr std::chrono::milliseconds LOG_FLUSH_INTERVAL(20);
+
+// Parses debug|info|warning|error.
+bool parseLogLevel(const std::string& name, LogLevel& level);
+const char* logLevelName(LogLevel level);
+
+// Asynchronous logger. log() filters by level, moves the message into a
+// bounded lock-free ring (many producers, one consumer) and returns; a
+// background thread drains the ring in batches and writes them to the log file
+// and, unless console echo is off, to stdout. Timestamps are taken with the
+// clock in log() but only formatted by the flusher, once per second.
+//
+// When the ring is full log() drops the message and the flusher reports how
+// many were lost, except for ERROR messages, which wait for room. The ring is
+// drained on flush() and when the process exits normally.
 class Logger {
 public:
     static Logger& getInstance() {
@@ -22,53 +44,50 @@ public:
         return instance;
     }
 
-    void setLogFile(const std::string& filename) {
-        logFile.open(filename, std::ios::app);
-    }
-
-    void log(const std::string& message, LogLevel level) {
-        auto now = std::chrono::system_clock::now();
-        auto time= std::chrono::system_clock::to_time_t(now);
+    void setLogFile(const std::string& filename);
+    void setMinLevel(LogLevel level);
+    void setConsoleEcho(bool enabled);
 
-        std::stringstream time_stream;
-        time_stream << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S");
-        std::string time_str = time_stream.str();
+    void log(std::string message, LogLevel level);
 
-        std::lock_guard<std::mutex> lock(mtx);
-        std::cout << time_str << " - ";
-        logFile << time_str << " - ";
+    // Blocks until everything logged before the call has been written.
+    void flush();
 
+private:
+    struct Slot {
+        std::atomic<std::size_t> sequence;
+        LogLevel level;
+        std::chrono::system_clock::time_point time;
+        std::string message;
+    };
 
-        switch (level) {
-            case LogLevel::INFO:
-                std::cout << "INFO: " << message << std::endl;
-                logFile << "INFO: " << message << std::endl;
-                break;
-            case LogLevel::DEBUG:
-                std::cout << "DEBUG: " << message << std::endl;
-                logFile << "DEBUG: " << message << std::endl;
-                break;
-            case LogLevel::ERROR:
-                std::cout << "ERROR: " << message << std::endl;
-                logFile << "ERROR: " << message << std::endl;
-                break;
-            case LogLevel::WARNING:
-                std::cout << "WARNING: " << message << std::endl;
-                logFile << "WARNING: " << message << std::endl;
-                break;
-        }
-    }
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<std::size_t> enqueuePos{0};
+    // owned by the flusher thread
+    alignas(64) std::size_t dequeuePos = 0;
+    std::atomic<std::size_t> written{0};
+    std::atomic<std::uint64_t> dropped{0};
+    std::atomic<int> minSeverity;
+    std::atomic<bool> consoleEcho{true};
+    std::atomic<bool> running{true};
 
-private:
+    // the sinks are only touched by the flusher and setLogFile
+    std::mutex sinkMtx;
     std::ofstream logFile;
-    std::mutex mtx;
+    std::time_t cachedSecond = -1;
+    std::string cachedStamp;
 
-    Logger() {}
-    ~Logger() {
-        if (logFile.is_open()) {
-            logFile.close();
-        }
-    }
+    std::thread flusher;
+
+    Logger();
+    ~Logger();
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    bool tryPush(std::string& message, LogLevel level, std::chrono::system_clock::time_point time);
+    void run();
+    std::size_t drain();
+    const std::string& stamp(std::chrono::system_clock::time_point time);
 };
 
-#endif // LOGGER_H
\ No newline at end of file
+#endif // LOGGER_H
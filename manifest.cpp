@@ -0,0 +1,185 @@
+#include "manifest.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char* MANIFEST_MAGIC = "MRJOB 2";
+
+// Writes all of data and syncs it; the descriptor is closed either way.
+static bool writeAndSync(int fd, const std::string& data) {
+    const char* p = data.data();
+    std::size_t left = data.size();
+    bool ok = true;
+    while (ok && left > 0) {
+        ssize_t n = ::write(fd, p, left);
+        if (n <= 0) {
+            ok = false;
+            break;
+        }
+        p += n;
+        left -= static_cast<std::size_t>(n);
+    }
+    ok = ok && ::fdatasync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+bool writeFileAtomically(const std::string& path, const std::string& data) {
+    std::string temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return fd >= 0 && writeAndSync(fd, data) && std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+bool JobManifest::load(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != MANIFEST_MAGIC) {
+        return false;
+    }
+
+    job = "wordcount";
+    pattern.clear();
+    inputs.clear();
+    rangeBoundaries.clear();
+    splits.clear();
+    committedMaps.clear();
+    committedReduces.clear();
+    bool planComplete = false;
+    while (std::getline(in, line)) {
+        // a record cut short by a crash has no newline; getline cannot tell, eof can
+        if (in.eof()) {
+            break;
+        }
+        std::istringstream record(line);
+        std::string kind;
+        record >> kind;
+        if (kind == "end") {
+            planComplete = true;
+        } else if (!planComplete) {
+            std::string rest;
+            if (kind == "input") {
+                record.get();
+                std::getline(record, inputDir);
+            } else if (kind == "nreduce") {
+                record >> nReduce;
+            } else if (kind == "partitioner") {
+                record >> partitioner;
+            } else if (kind == "topk") {
+                record >> topK;
+            } else if (kind == "job") {
+                record >> job;
+            } else if (kind == "pattern") {
+                record.get();
+                std::getline(record, pattern);
+            } else if (kind == "file") {
+                ManifestInput input;
+                record >> input.size >> input.mtime;
+                record.get();
+                std::getline(record, input.path);
+                inputs.push_back(input);
+            } else if (kind == "boundary") {
+                record >> rest;
+                rangeBoundaries.push_back(rest);
+            } else if (kind == "split") {
+                ManifestSplit split;
+                record >> split.offset >> split.size;
+                record.get();
+                std::getline(record, split.path);
+                splits.push_back(split);
+            } else if (kind == "pack" && !splits.empty()) {
+                ManifestPackedFile file;
+                record >> file.size;
+                record.get();
+                std::getline(record, file.path);
+                splits.back().packed.push_back(file);
+            }
+        } else if (kind == "commit") {
+            std::string phase;
+            int taskId = -1;
+            record >> phase >> taskId;
+            if (record && phase == "map") {
+                // a task run again after losing a file is recorded again
+                std::vector<int>& partitions = committedMaps[taskId];
+                partitions.clear();
+                for (int r; record >> r;) {
+                    partitions.push_back(r);
+                }
+            } else if (record && phase == "reduce") {
+                committedReduces.push_back(taskId);
+            }
+        }
+    }
+    if (!planComplete) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    filePath = path;
+    return true;
+}
+
+bool JobManifest::save(const std::string& path) {
+    std::ostringstream out;
+    out << MANIFEST_MAGIC << "\n";
+    out << "input " << inputDir << "\n";
+    out << "nreduce " << nReduce << "\n";
+    out << "partitioner " << partitioner << "\n";
+    out << "topk " << topK << "\n";
+    out << "job " << job << "\n";
+    if (!pattern.empty()) {
+        out << "pattern " << pattern << "\n";
+    }
+    for (const auto& input : inputs) {
+        out << "file " << input.size << " " << input.mtime << " " << input.path << "\n";
+    }
+    for (const auto& boundary : rangeBoundaries) {
+        out << "boundary " << boundary << "\n";
+    }
+    for (const auto& split : splits) {
+        out << "split " << split.offset << " " << split.size << " " << split.path << "\n";
+        for (const auto& file : split.packed) {
+            out << "pack " << file.size << " " << file.path << "\n";
+        }
+    }
+    out << "end\n";
+
+    if (!writeFileAtomically(path, out.str())) {
+        Logger::getInstance().log("Failed to write job manifest: " + path + " (" + std::strerror(errno) + ")", LogLevel::ERROR);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    filePath = path;
+    return true;
+}
+
+bool JobManifest::recordCommit(const std::string& phase, int taskId, const std::vector<int>& partitions) {
+    std::string line = "commit " + phase + " " + std::to_string(taskId);
+    for (int r : partitions) {
+        line += " " + std::to_string(r);
+    }
+    line += "\n";
+    std::lock_guard<std::mutex> lock(mtx);
+    if (filePath.empty()) {
+        return false;
+    }
+    int fd = ::open(filePath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0 || !writeAndSync(fd, line)) {
+        Logger::getInstance().log("Failed to record commit of " + phase + " task " + std::to_string(taskId) + " in " + filePath, LogLevel::WARNING);
+        return false;
+    }
+    return true;
+}
+
+bool JobManifest::sameJob(const JobManifest& other) const {
+    auto sameInput = [](const ManifestInput& a, const ManifestInput& b) {
+        return a.path == b.path && a.size == b.size && a.mtime == b.mtime;
+    };
+    return inputDir == other.inputDir && nReduce == other.nReduce && partitioner == other.partitioner
+           && topK == other.topK && job == other.job && pattern == other.pattern
+           && std::equal(inputs.begin(), inputs.end(), other.inputs.begin(), other.inputs.end(), sameInput);
+}
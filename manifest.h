@@ -0,0 +1,81 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Durable record of a job in <outputdir>/job.manifest, so --resume can skip
+// the tasks an earlier run already committed. A text file of one record per
+// line:
+//
+//   MRJOB 2
+//   input <dir>                          job settings the output depends on
+//   nreduce <n> | partitioner <name> | topk <k>
+//   job <name> | pattern <text>          absent job means wordcount
+//   file <size> <mtime> <path>           input fingerprint, one per file
+//   boundary <word>                      range partitioner boundaries
+//   split <offset> <size> <path>         map task plan, in task id order
+//   pack <size> <path>                   a whole file the split before it also reads
+//   end
+//   commit map <task id> <partition>...  appended as tasks commit, with the
+//   commit reduce <task id>              partitions a map task wrote a file for
+//
+// The part up to `end` is written to a temporary file and renamed into place;
+// commits are appended and synced one by one, and a torn last line is ignored.
+
+// Replaces path with data through a synced temporary file and a rename, so
+// readers see either the old or the new contents.
+bool writeFileAtomically(const std::string& path, const std::string& data);
+
+struct ManifestInput {
+    std::string path;
+    std::uint64_t size;
+    std::int64_t mtime;
+};
+
+struct ManifestPackedFile {
+    std::string path;
+    std::uint64_t size;
+};
+
+struct ManifestSplit {
+    std::string path;
+    std::uint64_t offset;
+    std::uint64_t size;
+    std::vector<ManifestPackedFile> packed;
+};
+
+class JobManifest {
+public:
+    std::string inputDir;
+    int nReduce = 0;
+    std::string partitioner;
+    std::uint64_t topK = 0;
+    std::string job = "wordcount";
+    std::string pattern;
+    std::vector<ManifestInput> inputs;
+    std::vector<std::string> rangeBoundaries;
+    std::vector<ManifestSplit> splits;
+    // filled in by load(); the partitions each committed map task wrote, by task id
+    std::map<int, std::vector<int>> committedMaps;
+    std::vector<int> committedReduces;
+
+    bool load(const std::string& path);
+    // Replaces the manifest at path with this plan and no commits.
+    bool save(const std::string& path);
+    // Appends a commit record to the manifest last saved or loaded; partitions
+    // are the ones a map task wrote a file for.
+    bool recordCommit(const std::string& phase, int taskId, const std::vector<int>& partitions = {});
+
+    // Whether another manifest describes the same job over the same input.
+    bool sameJob(const JobManifest& other) const;
+
+private:
+    std::string filePath;
+    std::mutex mtx;
+};
+
+#endif // MANIFEST_H
@@ -3,31 +3,227 @@
 #include "master.h"
 #include "worker.h"
 #include "logger.h"
+#include "tokenizer.h"
+#include "incremental.h"
+#include "stream.h"
+#include "metrics.h"
+#include "jobs.h"
+#include "codec.h"
 #include <sstream>
+#include <algorithm>
+#include <charconv>
 #include <chrono>
+#include <cmath>
+
+// Parses the whole of value as a number; false for anything else, or a number out of range.
+template <typename T>
+static bool parseNumber(const std::string& value, T& out) {
+    const char* end = value.data() + value.size();
+    auto [stop, error] = std::from_chars(value.data(), end, out);
+    return error == std::errc() && stop == end;
+}
+
+// A number of seconds, fractions allowed, in milliseconds; at most a year.
+static bool parseSeconds(const std::string& value, std::size_t& millis) {
+    double seconds;
+    if (!parseNumber(value, seconds) || !std::isfinite(seconds) || seconds < 0 || seconds > 365.0 * 24 * 3600) {
+        return false;
+    }
+    millis = static_cast<std::size_t>(std::llround(seconds * 1000));
+    return true;
+}
 
 bool parseArguments(int argc, char* argv[], Config& config) {
     Logger& logger = Logger::getInstance();
 
     if (argc < 9) {
-        logger.log("Usage: " + std::string(argv[0]) + " --input <inputdir> --output <outputdir> --nworkers <nWorkers> --nreduce <nReduce>", LogLevel::ERROR);
+        logger.log("Usage: " + std::string(argv[0]) + " --input <inputdir> --output <outputdir> --nworkers <nWorkers> --nreduce <nReduce> [--include <glob>] [--exclude <glob>] [--split-size <bytes>] [--pack-size <bytes>] [--no-packing] [--map-buffer <bytes>] [--combine] [--combine-limit <bytes>] [--tokenizer auto|scalar|sse2|avx2] [--memory-limit <bytes>] [--topk <K>] [--partitioner hash|range] [--mode thread|process] [--shuffle file|memory] [--shuffle-memory <bytes>] [--compress-intermediate none|lz|zlib] [--compress-output none|lz|zlib] [--max-attempts <n>] [--task-timeout <seconds>] [--no-speculation] [--resume] [--incremental] [--stream] [--window <seconds>] [--slide <seconds>] [--batch-interval <ms>] [--log-level debug|info|warning|error] [--quiet] [--trace <file>] [--job wordcount|inverted-index|bigrams|grep] [--pattern <text>], or " + std::string(argv[0]) + " --decode <file>", LogLevel::ERROR);
         return false;
     }
 
-    for (int i = 1; i < argc; i += 2) {
+    for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
+        if (arg == "--combine") {
+            config.combine = true;
+            continue;
+        }
+        if (arg == "--incremental") {
+            config.incremental = true;
+            continue;
+        }
+        if (arg == "--stream") {
+            config.stream = true;
+            continue;
+        }
+        if (arg == "--resume") {
+            config.resume = true;
+            continue;
+        }
+        if (arg == "--no-packing") {
+            config.packFiles = false;
+            continue;
+        }
+        if (arg == "--no-speculation") {
+            config.speculate = false;
+            continue;
+        }
+        if (arg == "--quiet") {
+            config.quiet = true;
+            logger.setConsoleEcho(false);
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            logger.log("Missing value for argument: " + arg, LogLevel::ERROR);
+            return false;
+        }
+        std::string value = argv[++i];
+        bool valid = true;
+
         if (arg == "--input") {
-            config.inputDir = argv[i + 1];
+            config.inputDir = value;
         } else if (arg == "--output") {
-            config.outputDir = argv[i + 1];
+            config.outputDir = value;
         } else if (arg == "--nworkers") {
-            config.nWorkers = std::stoi(argv[i + 1]);
+            valid = parseNumber(value, config.nWorkers) && config.nWorkers > 0;
         } else if (arg == "--nreduce") {
-            config.nReduce = std::stoi(argv[i + 1]);
+            valid = parseNumber(value, config.nReduce) && config.nReduce > 0;
+        } else if (arg == "--include") {
+            config.includeGlobs.push_back(value);
+        } else if (arg == "--exclude") {
+            config.excludeGlobs.push_back(value);
+        } else if (arg == "--split-size") {
+            valid = parseNumber(value, config.splitSize);
+        } else if (arg == "--pack-size") {
+            valid = parseNumber(value, config.packSize);
+        } else if (arg == "--map-buffer") {
+            valid = parseNumber(value, config.mapBufferBytes);
+        } else if (arg == "--combine-limit") {
+            valid = parseNumber(value, config.combineLimitBytes);
+        } else if (arg == "--memory-limit") {
+            valid = parseNumber(value, config.memoryLimitBytes);
+        } else if (arg == "--topk") {
+            valid = parseNumber(value, config.topK);
+        } else if (arg == "--partitioner") {
+            if (value != "hash" && value != "range") {
+                logger.log("Unknown partitioner: " + value, LogLevel::ERROR);
+                return false;
+            }
+            config.partitioner = value;
+        } else if (arg == "--shuffle") {
+            if (value != "file" && value != "memory") {
+                logger.log("Unknown shuffle: " + value, LogLevel::ERROR);
+                return false;
+            }
+            config.shuffle = value;
+        } else if (arg == "--shuffle-memory") {
+            valid = parseNumber(value, config.shuffleMemoryBytes);
+        } else if (arg == "--compress-intermediate" || arg == "--compress-output") {
+            Codec codec;
+            if (!parseCodec(value, codec)) {
+                logger.log("Unknown or unavailable codec: " + value, LogLevel::ERROR);
+                return false;
+            }
+            (arg == "--compress-output" ? config.compressOutput : config.compressIntermediate) = value;
+        } else if (arg == "--window") {
+            valid = parseSeconds(value, config.windowMillis);
+        } else if (arg == "--slide") {
+            valid = parseSeconds(value, config.slideMillis);
+        } else if (arg == "--batch-interval") {
+            valid = parseNumber(value, config.batchMillis);
+        } else if (arg == "--max-attempts") {
+            valid = parseNumber(value, config.maxAttempts) && config.maxAttempts > 0;
+        } else if (arg == "--task-timeout") {
+            valid = parseNumber(value, config.taskTimeoutSeconds);
+        } else if (arg == "--mode") {
+            if (value != "thread" && value != "process") {
+                logger.log("Unknown worker mode: " + value, LogLevel::ERROR);
+                return false;
+            }
+            config.mode = value;
+        } else if (arg == "--log-level") {
+            LogLevel level;
+            if (!parseLogLevel(value, level)) {
+                logger.log("Unknown log level: " + value, LogLevel::ERROR);
+                return false;
+            }
+            config.logLevel = value;
+            logger.setMinLevel(level);
+        } else if (arg == "--trace") {
+            config.traceFile = value;
+        } else if (arg == "--job") {
+            config.job = value;
+        } else if (arg == "--pattern") {
+            config.pattern = value;
+        } else if (arg == "--tokenizer") {
+            config.tokenizer = value;
         } else {
             logger.log("Unknown argument: " + arg, LogLevel::ERROR);
             return false;
         }
+        if (!valid) {
+            logger.log("Invalid value for " + arg + ": " + value, LogLevel::ERROR);
+            return false;
+        }
+    }
+
+    if (config.inputDir.empty() || config.outputDir.empty() || config.nWorkers <= 0 || config.nReduce <= 0) {
+        logger.log("--input, --output, --nworkers and --nreduce are required, and the counts have to be positive", LogLevel::ERROR);
+        return false;
+    }
+
+    // stored per-file counts are split by hash, and range boundaries would move with the input
+    if (config.incremental && config.partitioner != "hash") {
+        logger.log("--incremental only works with the hash partitioner", LogLevel::ERROR);
+        return false;
+    }
+
+    // worker processes share no memory, and --resume needs every committed map output on disk
+    if (config.shuffle == "memory" && (config.mode != "thread" || config.resume)) {
+        logger.log("--shuffle memory does not work with --mode process or --resume", LogLevel::ERROR);
+        return false;
+    }
+
+    // the stream counts words in this process, and a window is a whole number of slides
+    if (config.stream) {
+        if (config.job != "wordcount" || config.mode != "thread" || config.partitioner != "hash" || config.incremental || config.resume) {
+            logger.log("--stream only runs the word count in thread mode with the hash partitioner, without --incremental or --resume", LogLevel::ERROR);
+            return false;
+        }
+        std::size_t slideMillis = config.slideMillis == 0 ? config.windowMillis : config.slideMillis;
+        if (config.windowMillis == 0 || config.batchMillis == 0 || slideMillis > config.windowMillis || config.windowMillis % slideMillis != 0) {
+            logger.log("--window has to be a positive multiple of --slide, and --batch-interval positive", LogLevel::ERROR);
+            return false;
+        }
+    }
+
+    // the range partitioner and --topk only make sense for jobs built for them (job.h)
+    bool rangePartitioner = false;
+    bool byCount = false;
+    if (!withJob(config.job, [&](auto job) {
+            rangePartitioner = decltype(job)::Options::RANGE_PARTITIONER;
+            byCount = decltype(job)::Options::BY_COUNT;
+        })) {
+        logger.log("Unknown job: " + config.job, LogLevel::ERROR);
+        return false;
+    }
+    if ((config.partitioner != "hash" && !rangePartitioner) || (config.topK > 0 && !byCount)) {
+        logger.log("--job " + config.job + " does not support --partitioner range or --topk", LogLevel::ERROR);
+        return false;
+    }
+    // the per-file state is word counts
+    if (config.incremental && config.job != "wordcount") {
+        logger.log("--incremental only runs the word count", LogLevel::ERROR);
+        return false;
+    }
+    if (config.job == "grep" && config.pattern.empty()) {
+        logger.log("--job grep needs a --pattern", LogLevel::ERROR);
+        return false;
+    }
+
+    if (!setTokenizerImplementation(config.tokenizer)) {
+        logger.log("Tokenizer not available on this machine: " + config.tokenizer, LogLevel::ERROR);
+        return false;
     }
 
     // Initialize the reduceTasksList based on nReduce and nWorkers
@@ -46,9 +242,41 @@ void printConfig(const Config& config) {
 
     oss << "Configuration:\n";
     oss << "Input Directory: " << config.inputDir << "\n";
+    for (const auto& glob : config.includeGlobs) {
+        oss << "Include: " << glob << "\n";
+    }
+    for (const auto& glob : config.excludeGlobs) {
+        oss << "Exclude: " << glob << "\n";
+    }
     oss << "Output Directory: " << config.outputDir << "\n";
     oss << "Number of Workers: " << config.nWorkers << "\n";
     oss << "Number of Reduce Tasks: " << config.nReduce << "\n";
+    oss << "Job: " << config.job << (config.pattern.empty() ? "" : " (pattern \"" + config.pattern + "\")") << "\n";
+    oss << "Split Size: " << (config.splitSize == 0 ? std::string("auto") : std::to_string(config.splitSize) + " bytes") << "\n";
+    oss << "Small File Packing: " << (!config.packFiles ? std::string("off") : config.packSize == 0 ? std::string("up to the split size") : "up to " + std::to_string(config.packSize) + " bytes") << "\n";
+    oss << "Map Buffer per Partition: " << config.mapBufferBytes << " bytes\n";
+    oss << "Memory Limit: " << config.memoryLimitBytes << " bytes\n";
+    if (config.topK > 0) {
+        oss << "Top-K: " << config.topK << "\n";
+    }
+    if (config.resume) {
+        oss << "Resume: on\n";
+    }
+    if (config.incremental) {
+        oss << "Incremental: on\n";
+    }
+    if (config.stream) {
+        oss << "Stream: window " << config.windowMillis / 1000.0 << " s, slide " << (config.slideMillis == 0 ? config.windowMillis : config.slideMillis) / 1000.0
+            << " s, batches every " << config.batchMillis << " ms\n";
+    }
+    oss << "Worker Mode: " << config.mode << "\n";
+    oss << "Shuffle: " << (config.shuffle == "memory" ? "memory (limit " + std::to_string(config.shuffleMemoryBytes) + " bytes)" : config.shuffle) << "\n";
+    oss << "Compression: intermediate " << config.compressIntermediate << ", output " << config.compressOutput << "\n";
+    oss << "Task Attempts: up to " << config.maxAttempts << " failures, timeout " << config.taskTimeoutSeconds << " s, speculation " << (config.speculate ? "on" : "off") << "\n";
+    oss << "Log Level: " << config.logLevel << (config.quiet ? " (log file only)" : "") << "\n";
+    oss << "Partitioner: " << config.partitioner << "\n";
+    oss << "Tokenizer: " << tokenizerImplementation() << "\n";
+    oss << "Combiner: " << (config.combine ? "on (limit " + std::to_string(config.combineLimitBytes) + " bytes)" : "off") << "\n";
     oss << "Reduce Tasks List per Worker:\n";
     
     for (int i = 0; i < config.nWorkers; i++) {
@@ -62,13 +290,39 @@ void printConfig(const Config& config) {
     logger.log(oss.str(), LogLevel::INFO);
 }
 
+// Writes <outputdir>/metrics.json and, with --trace, the task timeline.
+static void writeMetrics(const Config& config) {
+    Metrics& metrics = Metrics::getInstance();
+    metrics.writeSummary(config.outputDir + "/metrics.json", config);
+    if (!config.traceFile.empty() && metrics.writeTrace(config.traceFile)) {
+        Logger::getInstance().log("Wrote task timeline to " + config.traceFile, LogLevel::INFO);
+    }
+}
+
 int main(int argc, char* argv[]) {
     /* Initiate Logging */
     Logger::getInstance().setLogFile("mapreduce.log");
     Logger& logger = Logger::getInstance();
     
-    logger.log("Starting MapReduce program", LogLevel::INFO);
 
+    // worker processes launched by --mode process get their configuration from the master
+    if (argc == 3 && std::string(argv[1]) == "--worker") {
+        return runWorkerProcess(argv[2]);
+    }
+
+    // the text of a --compress-output file goes to stdout, so the log stays off the console
+    if (argc == 3 && std::string(argv[1]) == "--decode") {
+        logger.setConsoleEcho(false);
+        std::string error;
+        if (!decodeFile(argv[2], std::cout, error)) {
+            logger.log("Failed to decode " + std::string(argv[2]) + ": " + error, LogLevel::ERROR);
+            std::cerr << "mapreduce --decode: " << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    logger.log("Starting MapReduce program", LogLevel::INFO);
 
     Config config;
     if (!parseArguments(argc, argv, config)) {
@@ -77,26 +331,49 @@ int main(int argc, char* argv[]) {
 
     printConfig(config);
 
+    // a stream has no map and reduce phases; it runs until its input ends or it is interrupted
+    if (config.stream) {
+        return runStream(config) ? 0 : 1;
+    }
+
     Master master(config);
     auto start_time = std::chrono::high_resolution_clock::now();
-    master.distributeWork();
-    master.printWorkLoad();
+    if (config.incremental) {
+        PhaseTimer phase("incremental");
+        if (!refreshIncremental(config)) {
+            return 1;
+        }
+    } else {
+        if (!master.distributeWork()) {
+            logger.log("The input could not be read, no work was started", LogLevel::ERROR);
+            writeMetrics(config);
+            return 1;
+        }
+        master.printWorkLoad();
 
-    logger.log("Workers are being started", LogLevel::INFO);
-    master.startWorkers();
+        logger.log("Workers are being started", LogLevel::INFO);
+        if (!master.startWorkers()) {
+            logger.log("Workers did not finish, no output was merged", LogLevel::ERROR);
+            writeMetrics(config);
+            return 1;
+        }
 
-    logger.log("All Map Tasks and Reduce Tasks have finished", LogLevel::INFO);
+        logger.log("All Map Tasks and Reduce Tasks have finished", LogLevel::INFO);
+    }
     logger.log("======== Start Merging =========== ", LogLevel::INFO);
     
-    master.merge();
-
-    auto end_merge = std::chrono::high_resolution_clock::now();
+    if (!master.merge()) {
+        logger.log("The final merge failed", LogLevel::ERROR);
+        writeMetrics(config);
+        return 1;
+    }
 
     logger.log("======== Merging Complete =========== ", LogLevel::INFO);
 
     auto end_time = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end_time - start_time;
     logger.log("MapReduce process completed in " + std::to_string(elapsed.count()) + " seconds", LogLevel::INFO);
+    writeMetrics(config);
     
     return 0;
 }
\ No newline at end of file
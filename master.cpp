@@ -1,231 +1,1027 @@
 #include "master.h"
 #include "worker.h"
+#include "job_worker.h"
+#include "jobs.h"
 #include "config.h"
+#include "input_reader.h"
+#include "intermediate.h"
+#include "merge.h"
+#include "tokenizer.h"
+#include "partitioner.h"
+#include "rpc.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "shuffle.h"
+#include "gzip_input.h"
+#include "input_files.h"
 #include <iostream>
 #include <filesystem>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <sstream>
 #include <algorithm>
+#include <cstdio>
 #include <numeric>
 #include <iomanip>
 #include <thread>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "logger.h"
 #include <chrono>
 
-std::mutex mtx;
-std::condition_variable cv;
-bool readyForMap = false;
-bool readyForReduce = false;
-
 namespace fs = std::filesystem;
 
+// output.txt is written in blocks of this size
+static constexpr std::size_t MERGE_WRITE_BUFFER_BYTES = 4 << 20;
+
+static TaskPolicy taskPolicy(const Config& config) {
+    TaskPolicy policy;
+    policy.maxAttempts = config.maxAttempts;
+    policy.timeout = std::chrono::seconds(config.taskTimeoutSeconds);
+    policy.speculate = config.speculate;
+    return policy;
+}
+
 Master::Master(const Config& config)
-    : config(config), inputDirectory(config.inputDir), numberOfWorkers(config.nWorkers), reduceTasksList(config.reduceTasksList) {
-    mapperAssignments.resize(config.nWorkers);
+    : config(config), inputDirectory(config.inputDir), numberOfWorkers(config.nWorkers),
+      mapTasks("map", config.nWorkers, taskPolicy(config)), reduceTasks("reduce", config.nWorkers, taskPolicy(config)),
+      reduceTasksList(config.reduceTasksList) {
     workerLoad.resize(config.nWorkers, 0);
+    // reduce task ids are partition numbers, so add them in that order
+    std::vector<int> owner(config.nReduce, 0);
+    for (int i = 0; i < config.nWorkers; ++i) {
+        for (int taskId : reduceTasksList[i]) {
+            owner[taskId] = i;
+        }
+    }
+    for (int r = 0; r < config.nReduce; ++r) {
+        reduceTasks.add(owner[r], ReduceTask{r, {}});
+    }
     Logger::getInstance().log("Master initialized", LogLevel::INFO);
 }
 
-std::vector<FileMetaData> Master::readFileMetadata() {
+// Lists the input files, and fingerprints them for the manifest on the way.
+bool Master::readFileMetadata(std::vector<FileMetaData>& metadata) {
     Logger& logger = Logger::getInstance();
-    std::vector<FileMetaData> metadata;
-    for (const auto& entry : fs::directory_iterator(inputDirectory)) {
-        if (entry.is_regular_file()) {
-            metadata.push_back({entry.path().string(), fs::file_size(entry)});
+    if (!findInputFiles(inputDirectory, config.includeGlobs, config.excludeGlobs, manifest.inputs)) {
+        return false;
+    }
+    for (const auto& input : manifest.inputs) {
+        metadata.push_back({input.path, input.size, 0});
+    }
+    logger.log("Read file metadata for input directory: " + inputDirectory + " (" + std::to_string(metadata.size()) + " files)", LogLevel::INFO);
+    return true;
+}
+
+std::size_t Master::chooseSplitSize(const std::vector<FileMetaData>& files) const {
+    if (config.splitSize > 0) {
+        return config.splitSize;
+    }
+    std::size_t totalBytes = 0;
+    for (const auto& file : files) {
+        totalBytes += file.fileSize;
+    }
+    // a few tasks per worker leaves room for stealing without drowning in tiny tasks
+    std::size_t target = totalBytes / (static_cast<std::size_t>(numberOfWorkers) * SPLITS_PER_WORKER);
+    return std::clamp(target, MIN_SPLIT_SIZE, MAX_SPLIT_SIZE);
+}
+
+// Cuts a file into pieces of about splitSize bytes. Each cut is moved forward
+// to the next separator so no word is split; only the bytes after each cut
+// point are read. A gzip file can only be decoded from its start and stays
+// in one piece.
+std::vector<FileMetaData> Master::splitFile(const FileMetaData& file, std::size_t splitSize) const {
+    std::vector<FileMetaData> splits;
+    if (file.fileSize <= splitSize) {
+        if (file.fileSize > 0) {
+            splits.push_back({file.fileName, file.fileSize, 0});
+        }
+        return splits;
+    }
+
+    MappedFile input;
+    if (!input.open(file.fileName, MappedFile::Access::Random)) {
+        Logger::getInstance().log("Error opening file: " + file.fileName, LogLevel::ERROR);
+        return splits;
+    }
+
+    std::string_view data = input.view();
+    if (isGzip(data)) {
+        splits.push_back({file.fileName, file.fileSize, 0});
+        return splits;
+    }
+    std::size_t currentOffset = 0;
+    while (currentOffset < data.size()) {
+        std::size_t end = std::min(currentOffset + splitSize, data.size());
+        while (end < data.size() && !isWordSeparator(data[end])) {
+            ++end;
+        }
+        splits.push_back({file.fileName, end - currentOffset, currentOffset});
+        currentOffset = end;
+    }
+    return splits;
+}
+
+// Packs whole files, in the given order, into tasks of up to packSize bytes.
+// A task holds its first file like a split of the whole file, and the rest
+// in packedFiles.
+std::vector<FileMetaData> Master::packFiles(const std::vector<FileMetaData>& files, std::size_t packSize) const {
+    std::vector<FileMetaData> tasks;
+    std::size_t packedBytes = 0;
+    for (const auto& file : files) {
+        if (tasks.empty() || packedBytes + file.fileSize > packSize) {
+            tasks.push_back({file.fileName, file.fileSize, 0});
+            packedBytes = file.fileSize;
+            continue;
+        }
+        tasks.back().packedFiles.push_back({file.fileName, file.fileSize});
+        packedBytes += file.fileSize;
+    }
+    return tasks;
+}
+
+// Counts the words of a few windows spread evenly over a file.
+void Master::sampleFile(const FileMetaData& file, std::size_t sampleBytes, CountTable& sample) const {
+    MappedFile input;
+    if (file.fileSize == 0 || !input.open(file.fileName, MappedFile::Access::Random)) {
+        return;
+    }
+
+    std::string_view data = input.view();
+    std::string word;
+    // only the start of a gzip file can be read without decoding all of it
+    if (isGzip(data)) {
+        GzipStream stream(data);
+        std::string_view chunk;
+        for (std::size_t seen = 0; seen < sampleBytes && stream.next(chunk); seen += chunk.size()) {
+            forEachWord(chunk, word, [&sample](const std::string& w) {
+                sample.add(w);
+            });
         }
+        return;
+    }
+    std::size_t windows = std::max<std::size_t>(1, sampleBytes / SAMPLE_WINDOW_BYTES);
+    std::size_t stride = data.size() / windows;
+    for (std::size_t w = 0; w < windows; ++w) {
+        std::size_t start = w * stride;
+        // skip the tail of a word cut by the window start
+        while (start > 0 && start < data.size() && !isWordSeparator(data[start - 1])) {
+            ++start;
+        }
+        std::size_t end = std::min(start + SAMPLE_WINDOW_BYTES, data.size());
+        while (end < data.size() && !isWordSeparator(data[end])) {
+            ++end;
+        }
+        if (start >= end) {
+            continue;
+        }
+        forEachWord(data.substr(start, end - start), word, [&sample](const std::string& w) {
+            sample.add(w);
+        });
     }
-    logger.log("Read file metadata for input directory: " + inputDirectory, LogLevel::INFO);
-    return metadata;
 }
 
-void Master::distributeWork() {
+bool Master::distributeWork() {
     Logger& logger = Logger::getInstance();
-    auto files = readFileMetadata();
-    std::size_t chunkSize = CHUNK_SIZE;
+    PhaseTimer phase("split");
+    std::vector<FileMetaData> files;
+    if (!readFileMetadata(files)) {
+        return false;
+    }
+    std::string manifestPath = config.outputDir + "/job.manifest";
 
-    logger.log("Distributing work among workers", LogLevel::INFO);
+    manifest.inputDir = config.inputDir;
+    manifest.nReduce = config.nReduce;
+    manifest.partitioner = config.partitioner;
+    manifest.topK = config.topK;
+    manifest.job = config.job;
+    manifest.pattern = config.pattern;
+    mapTasks.setCommitListener([this](int taskId, const std::vector<int>& partitions) {
+        addMapOutputs(taskId, partitions);
+        manifest.recordCommit("map", taskId, partitions);
+    });
+    reduceTasks.setCommitListener([this](int taskId, const std::vector<int>&) { manifest.recordCommit("reduce", taskId); });
 
-    for (const auto& file : files) {
-        std::ifstream ifs(file.fileName, std::ifstream::binary);
-        if (!ifs) {
-            logger.log("Error opening file: " + file.fileName, LogLevel::ERROR);
-            continue; 
+    if (config.resume) {
+        JobManifest previous;
+        if (previous.load(manifestPath) && previous.sameJob(manifest)) {
+            resumeWork(previous, manifestPath);
+            return true;
         }
+        logger.log("No job manifest for this input and settings in " + config.outputDir + ", starting from scratch", LogLevel::WARNING);
+    }
 
-        std::size_t currentOffset = 0;
-        while (currentOffset < file.fileSize) {
-            std::size_t remainingSize = file.fileSize - currentOffset;
-            std::size_t actualChunkSize = std::min(chunkSize, remainingSize);
-            std::vector<char> buffer(actualChunkSize + 64); 
+    std::size_t splitSize = chooseSplitSize(files);
+    std::size_t packSize = config.packFiles ? (config.packSize > 0 ? config.packSize : splitSize) : 0;
 
-            ifs.seekg(currentOffset);
-            ifs.read(buffer.data(), buffer.size());
-            std::streamsize bytesRead = ifs.gcount();
+    logger.log("Distributing work among workers with split size " + std::to_string(splitSize) + " bytes", LogLevel::INFO);
 
-            if (bytesRead <= 0) {
-                break;
-            }
+    // boundaries of different files are independent, so look for them in parallel;
+    // the range partitioner samples words from the same threads
+    bool rangePartitioning = config.partitioner == "range";
+    std::size_t totalBytes = 0;
+    for (const auto& file : files) {
+        totalBytes += file.fileSize;
+    }
+    CountTable sample;
+    std::mutex sampleMutex;
 
-            std::size_t endOfChunk = actualChunkSize - 1;
-            for (std::streamsize i = endOfChunk; i < bytesRead; ++i) {
-                if (buffer[i] == ' ' || buffer[i] == '\n' || ispunct(buffer[i])) {
-                    endOfChunk = i + 1;
-                    break;
+    std::vector<std::vector<FileMetaData>> splits(files.size());
+    std::atomic<std::size_t> nextFile(0);
+    std::vector<std::thread> threads;
+    std::size_t nThreads = std::min<std::size_t>(numberOfWorkers, files.size());
+    for (std::size_t t = 0; t < nThreads; ++t) {
+        threads.emplace_back([&]() {
+            CountTable localSample;
+            for (std::size_t i = nextFile++; i < files.size(); i = nextFile++) {
+                // files to be packed are never split, and need not be opened here
+                if (files[i].fileSize >= packSize) {
+                    splits[i] = splitFile(files[i], splitSize);
                 }
-                if (i == bytesRead - 1) {
-                    endOfChunk = bytesRead;
+                if (rangePartitioning) {
+                    // every file gets its share of the sample budget, at least one window
+                    std::size_t share = static_cast<std::size_t>(static_cast<double>(files[i].fileSize) / std::max<std::size_t>(totalBytes, 1) * RANGE_SAMPLE_BYTES);
+                    sampleFile(files[i], share, localSample);
                 }
             }
-
-            if (endOfChunk > remainingSize) {
-                endOfChunk = remainingSize;
+            if (rangePartitioning) {
+                std::lock_guard<std::mutex> lock(sampleMutex);
+                localSample.forEach([&sample](std::string_view word, std::uint64_t count) {
+                    sample.add(word, count);
+                });
             }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
 
-            std::size_t workerIndex = std::distance(workerLoad.begin(), std::min_element(workerLoad.begin(), workerLoad.end()));
-            mapperAssignments[workerIndex].push_back({file.fileName, endOfChunk, currentOffset});
-            workerLoad[workerIndex] += endOfChunk;
-            currentOffset += endOfChunk;
+    if (rangePartitioning) {
+        RangePlan plan = computeRangeBoundaries(sample, config.nReduce);
+        config.rangeBoundaries = plan.boundaries;
+        logger.log("Range partitioner sampled " + std::to_string(sample.size()) + " distinct words: "
+                   + std::to_string(plan.boundaries.size()) + " boundaries, " + std::to_string(plan.heavyKeys) + " heavy words isolated", LogLevel::INFO);
+    }
 
-            if (currentOffset >= file.fileSize) {
-                break;
-            }
+    std::vector<FileMetaData> plan;
+    std::vector<FileMetaData> smallFiles;
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        if (files[i].fileSize >= packSize) {
+            plan.insert(plan.end(), splits[i].begin(), splits[i].end());
+        } else if (files[i].fileSize > 0) {
+            smallFiles.push_back(files[i]);
         }
     }
-    logger.log("Work distribution complete", LogLevel::INFO);
+    if (!smallFiles.empty()) {
+        std::vector<FileMetaData> packed = packFiles(smallFiles, packSize);
+        logger.log("Packed " + std::to_string(smallFiles.size()) + " small files into " + std::to_string(packed.size()) + " map tasks", LogLevel::INFO);
+        plan.insert(plan.end(), packed.begin(), packed.end());
+    }
+    seedMapTasks(plan);
+
+    // the plan is on disk before any task can commit against it
+    manifest.rangeBoundaries = config.rangeBoundaries;
+    for (const auto& split : plan) {
+        manifest.splits.push_back({split.fileName, split.offset, split.fileSize, {}});
+        for (const auto& file : split.packedFiles) {
+            manifest.splits.back().packed.push_back({file.fileName, file.fileSize});
+        }
+    }
+    if (!manifest.save(manifestPath)) {
+        logger.log("Continuing without a job manifest; this run cannot be resumed", LogLevel::WARNING);
+    }
+    return true;
+}
+
+void Master::seedMapTasks(const std::vector<FileMetaData>& splits) {
+    for (const auto& split : splits) {
+        std::size_t workerIndex = std::distance(workerLoad.begin(), std::min_element(workerLoad.begin(), workerLoad.end()));
+        FileMetaData task = split;
+        task.taskId = static_cast<int>(mapTasks.size());
+        mapTasks.add(workerIndex, task);
+        workerLoad[workerIndex] += taskBytes(split);
+    }
+    config.nMapTasks = static_cast<int>(mapTasks.size());
+    Logger::getInstance().log("Work distribution complete: " + std::to_string(mapTasks.size()) + " map tasks", LogLevel::INFO);
+}
+
+// Lists a committed map task with the reduce tasks of the partitions it wrote.
+void Master::addMapOutputs(int mapTaskId, const std::vector<int>& partitions) {
+    for (int r : partitions) {
+        if (r >= 0 && r < config.nReduce) {
+            reduceTasks.update(r, [mapTaskId](ReduceTask& task) { task.mapOutputs.push_back(mapTaskId); });
+        }
+    }
+}
+
+// Takes over the split plan of an earlier run of the same job, and every map
+// or reduce task it committed whose output files are still there.
+void Master::resumeWork(JobManifest& previous, const std::string& manifestPath) {
+    config.rangeBoundaries = previous.rangeBoundaries;
+    std::vector<FileMetaData> plan;
+    for (const auto& split : previous.splits) {
+        plan.push_back({split.path, split.size, split.offset});
+        for (const auto& file : split.packed) {
+            plan.back().packedFiles.push_back({file.path, file.size});
+        }
+    }
+    seedMapTasks(plan);
+
+    std::size_t mapsDone = 0;
+    // a map task writes no file for a partition it had nothing for, so which
+    // of its files should be there is only known to the manifest
+    for (const auto& [taskId, partitions] : previous.committedMaps) {
+        if (taskId < 0 || taskId >= config.nMapTasks) {
+            continue;
+        }
+        auto lost = std::find_if(partitions.begin(), partitions.end(), [&](int r) {
+            return r < 0 || r >= config.nReduce || !fs::exists(intermediateFileName(config.outputDir, taskId, r));
+        });
+        if (lost != partitions.end()) {
+            Logger::getInstance().log("Map task " + std::to_string(taskId) + " lost its intermediate file for partition " + std::to_string(*lost) + ", running it again", LogLevel::WARNING);
+            continue;
+        }
+        mapTasks.markDone(taskId);
+        addMapOutputs(taskId, partitions);
+        ++mapsDone;
+    }
+    std::size_t reducesDone = 0;
+    for (int taskId : previous.committedReduces) {
+        if (taskId >= 0 && taskId < config.nReduce && fs::exists(config.outputDir + "/reduce.part-" + std::to_string(taskId) + ".bin")) {
+            reduceTasks.markDone(taskId);
+            ++reducesDone;
+        }
+    }
+
+    // later commits are appended to the same manifest
+    manifest.load(manifestPath);
+    Logger::getInstance().log("Resuming job from " + manifestPath + ": " + std::to_string(mapsDone) + " of " + std::to_string(config.nMapTasks)
+                              + " map tasks and " + std::to_string(reducesDone) + " of " + std::to_string(config.nReduce) + " reduce tasks already committed", LogLevel::INFO);
 }
 
 void Master::printWorkLoad() const {
     Logger& logger = Logger::getInstance();
     std::ostringstream logStream;
     logStream << "\n";
-    for (size_t i = 0; i < mapperAssignments.size(); ++i) {
+    for (int i = 0; i < numberOfWorkers; ++i) {
         logStream << "Worker " << i << " will process files:\n";
-        for (const auto& file : mapperAssignments[i]) {
-            logStream << "\t" << file.fileName << " (" << file.fileSize << " bytes)\n";
+        for (const auto& file : mapTasks.tasksOf(i)) {
+            if (file.packedFiles.empty()) {
+                logStream << "\t" << file.fileName << " (" << file.fileSize << " bytes)\n";
+            } else {
+                logStream << "\t" << file.fileName << " and " << file.packedFiles.size() << " more files (" << taskBytes(file) << " bytes)\n";
+            }
         }
     }
     logger.log(logStream.str(), LogLevel::INFO);
 }
 
 void Master::printChunkContent() const {
-    for (size_t workerIndex = 0; workerIndex < mapperAssignments.size(); ++workerIndex) {
+    for (int workerIndex = 0; workerIndex < numberOfWorkers; ++workerIndex) {
         std::cout << "Worker " << workerIndex << " will process the following chunk content:\n";
-        for (const auto& file : mapperAssignments[workerIndex]) {
-            std::ifstream ifs(file.fileName, std::ifstream::binary);
-            if (!ifs) {
+        for (const auto& file : mapTasks.tasksOf(workerIndex)) {
+            MappedFile input;
+            if (!input.open(file.fileName)) {
                 std::cerr << "Failed to open file: " << file.fileName << std::endl;
                 continue;
             }
-            std::vector<char> buffer(file.fileSize);
-            ifs.seekg(file.offset);
-            ifs.read(buffer.data(), buffer.size());
 
             std::cout << "File: " << file.fileName << " Chunk starting at " << file.offset << " for " << file.fileSize << " bytes\n";
-            std::cout << "Content:\n" << std::string(buffer.begin(), buffer.end()) << "\n\n";
+            std::cout << "Content:\n" << input.view(file.offset, file.fileSize) << "\n\n";
         }
     }
 }
 
-void Master::startWorkers() {
+bool Master::startWorkers() {
+    if (config.mode == "process") {
+        return startWorkerProcesses();
+    }
+    bool ok = false;
+    if (!withJob(config.job, [&](auto job) { ok = runWorkerThreads<JobWorker<decltype(job)>>(); })) {
+        Logger::getInstance().log("Unknown job: " + config.job, LogLevel::ERROR);
+    }
+    return ok;
+}
+
+// Runs both phases on worker threads of type W, the JobWorker of the job.
+template <typename W>
+bool Master::runWorkerThreads() {
     Logger& logger = Logger::getInstance();
     std::vector<std::thread> threads;
-    std::vector<Worker> workers;
+    std::vector<std::thread> reduceThreads;
+    std::vector<W> workers;
 
     logger.log("Initializing worker threads", LogLevel::INFO);
 
+    // with --shuffle memory the reduce tasks get workers of their own and run
+    // alongside the map tasks, taking map output from the store as it commits
+    std::unique_ptr<ShuffleStore> shuffle;
+    std::vector<W> reducers;
+    if (config.shuffle == "memory") {
+        shuffle = std::make_unique<ShuffleStore>(config.nMapTasks, config.nReduce, config.shuffleMemoryBytes);
+        for (int i = 0; i < numberOfWorkers; ++i) {
+            reducers.emplace_back(i, config, shuffle.get());
+        }
+    }
     for (int i = 0; i < numberOfWorkers; ++i) {
-        workers.emplace_back(i, config);
+        workers.emplace_back(i, config, shuffle.get());
     }
+    std::vector<W>& reduceWorkers = shuffle ? reducers : workers;
 
-    {
-        std::unique_lock<std::mutex> lck(mtx);
-        logger.log("====================== Map phase starting ====================", LogLevel::INFO);
+    std::int64_t reducePhaseStart = 0;
+    auto startReducePhase = [&]() {
+        logger.log("====================== Reduce phase starting ====================", LogLevel::INFO);
+        reducePhaseStart = metricsClockMicros();
         for (int i = 0; i < numberOfWorkers; ++i) {
-            threads.emplace_back([i, &workers, this, &logger](){
-                std::unique_lock<std::mutex> lk(mtx);
-                cv.wait(lk, [this]{ return readyForMap; });
+            reduceThreads.emplace_back([i, &reduceWorkers, this, &logger](){
                 auto start = std::chrono::high_resolution_clock::now();
-                logger.log("Worker " + std::to_string(i) + " starts map tasks", LogLevel::INFO);
-
-                workers[i].processMapTasks(mapperAssignments[i]);
+                reduceWorkers[i].processReduceTasks(reduceTasks);
 
                 auto end = std::chrono::high_resolution_clock::now();
                 std::chrono::duration<double> elapsed = end - start;
-                logger.log("Worker " + std::to_string(i) + " completed map tasks in " + std::to_string(elapsed.count()) + " seconds", LogLevel::INFO);
+                logger.log("Worker " + std::to_string(i) + " completed reduce tasks in " + std::to_string(elapsed.count()) + " seconds", LogLevel::INFO);
             });
         }
+    };
+
+    // workers take chunks from their own deque first and steal from others once it is empty,
+    // so no lock is held while a worker maps or reduces
+    logger.log("====================== Map phase starting ====================", LogLevel::INFO);
+    std::int64_t phaseStart = metricsClockMicros();
+    for (int i = 0; i < numberOfWorkers; ++i) {
+        threads.emplace_back([i, &workers, this, &logger](){
+            auto start = std::chrono::high_resolution_clock::now();
+            logger.log("Worker " + std::to_string(i) + " starts map tasks", LogLevel::INFO);
 
-        readyForMap = true;
-        cv.notify_all();
-        lck.unlock();
+            workers[i].processMapTasks(mapTasks);
+
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> elapsed = end - start;
+            logger.log("Worker " + std::to_string(i) + " completed map tasks in " + std::to_string(elapsed.count()) + " seconds", LogLevel::INFO);
+        });
+    }
+    if (shuffle) {
+        startReducePhase();
     }
 
     for (auto& thread : threads) {
         thread.join();
     }
-    threads.clear();
+    Metrics::getInstance().recordPhase("map", phaseStart, metricsClockMicros());
+    if (mapTasks.failed()) {
+        logger.log("Map phase failed", LogLevel::ERROR);
+        if (shuffle) {
+            shuffle->abort();
+            for (auto& thread : reduceThreads) {
+                thread.join();
+            }
+        }
+        return false;
+    }
     logger.log("====================== Map phase complete ====================", LogLevel::INFO);
-    logger.log("====================== Reduce phase starting ====================", LogLevel::INFO);
-    
-    {
-        std::unique_lock<std::mutex> lck(mtx);
-        for (int i = 0; i < numberOfWorkers; ++i) {
-            threads.emplace_back([i, &workers, this, &logger](){
-                std::unique_lock<std::mutex> lk(mtx);
-                cv.wait(lk, [this]{ return readyForReduce; });
-                auto start = std::chrono::high_resolution_clock::now();
-                workers[i].processReduceTasks(reduceTasksList[i]);
+    if (!shuffle) {
+        startReducePhase();
+    }
 
-                auto end = std::chrono::high_resolution_clock::now();
-                std::chrono::duration<double> elapsed = end - start;
-                logger.log("Worker " + std::to_string(i) + " completed reduce tasks in " + std::to_string(elapsed.count()) + " seconds", LogLevel::INFO);
+    for (auto& thread : reduceThreads) {
+        thread.join();
+    }
+    Metrics::getInstance().recordPhase("reduce", reducePhaseStart, metricsClockMicros());
+    if (shuffle) {
+        logger.log("In-memory shuffle held at most " + std::to_string(shuffle->peakBytes()) + " bytes and spilled "
+                   + std::to_string(shuffle->spilledBatches()) + " map outputs to disk", LogLevel::INFO);
+    }
+    if (reduceTasks.failed()) {
+        logger.log("Reduce phase failed", LogLevel::ERROR);
+        return false;
+    }
+    logger.log("====================== Reduce phase complete ======================", LogLevel::INFO);
+    return true;
+}
+
+// Runs the workers as child processes that talk to the master over a Unix
+// socket in the output directory. Every connection is served by a thread here
+// that answers from the same task trackers the worker threads would use. A
+// worker that goes away only loses its running attempts; the job goes on as
+// long as some worker is left.
+bool Master::startWorkerProcesses() {
+    Logger& logger = Logger::getInstance();
+    std::string socketPath = config.outputDir + "/master.sock";
+    int listenFd = listenUnixSocket(socketPath, numberOfWorkers);
+    if (listenFd < 0) {
+        return false;
+    }
 
+    logger.log("Launching " + std::to_string(numberOfWorkers) + " worker processes on " + socketPath, LogLevel::INFO);
+    std::vector<pid_t> children;
+    for (int i = 0; i < numberOfWorkers; ++i) {
+        char* argv[] = {const_cast<char*>("mapreduce"), const_cast<char*>("--worker"),
+                        const_cast<char*>(socketPath.c_str()), nullptr};
+        pid_t pid;
+        int err = posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, argv, environ);
+        if (err != 0) {
+            logger.log("Failed to launch worker process: " + std::string(std::strerror(err)), LogLevel::ERROR);
+            break;
+        }
+        children.push_back(pid);
+    }
+
+    std::vector<int> connections;
+    while (connections.size() < children.size()) {
+        pollfd waiting{listenFd, POLLIN, 0};
+        int ready = poll(&waiting, 1, WORKER_CONNECT_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            logger.log("Timed out waiting for worker processes to connect", LogLevel::WARNING);
+            break;
+        }
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            connections.push_back(fd);
+        }
+    }
+    close(listenFd);
+    unlink(socketPath.c_str());
+
+    bool ok = !connections.empty();
+    if (!ok) {
+        logger.log("No worker process connected", LogLevel::ERROR);
+    } else {
+        int serving = static_cast<int>(connections.size());
+        std::mutex servingMutex;
+        std::condition_variable servingChanged;
+        std::vector<std::thread> threads;
+        logger.log("====================== Map phase starting ====================", LogLevel::INFO);
+        std::int64_t phaseStart = metricsClockMicros();
+        for (std::size_t i = 0; i < connections.size(); ++i) {
+            threads.emplace_back([this, i, &connections, &serving, &servingMutex, &servingChanged]() {
+                serveWorkerProcess(connections[i], static_cast<int>(i));
+                std::lock_guard<std::mutex> lock(servingMutex);
+                // nobody is left to run what remains
+                if (--serving == 0) {
+                    mapTasks.abort();
+                    reduceTasks.abort();
+                }
+                servingChanged.notify_all();
             });
         }
 
-        readyForReduce = true;
-        cv.notify_all();
-        lck.unlock();
+        ok = mapTasks.wait();
+        std::int64_t mapEnd = metricsClockMicros();
+        Metrics::getInstance().recordPhase("map", phaseStart, mapEnd);
+        if (ok) {
+            ok = reduceTasks.wait();
+            Metrics::getInstance().recordPhase("reduce", mapEnd, metricsClockMicros());
+        }
+        if (ok) {
+            logger.log("====================== Reduce phase complete ======================", LogLevel::INFO);
+        }
+        // workers still busy now are running copies nobody needs any more
+        {
+            std::unique_lock<std::mutex> lock(servingMutex);
+            servingChanged.wait_for(lock, std::chrono::milliseconds(WORKER_EXIT_GRACE_MS), [&serving]() { return serving == 0; });
+        }
+        for (int fd : connections) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (int fd : connections) {
+            close(fd);
+        }
     }
 
-    for (auto& thread : threads) {
-        thread.join();
+    for (pid_t pid : children) {
+        int status = 0;
+        if (waitpid(pid, &status, WNOHANG) == 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            continue;
+        }
+        if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            logger.log("Worker process " + std::to_string(pid) + " exited abnormally (status " + std::to_string(status) + ")", LogLevel::WARNING);
+        }
     }
-    logger.log("====================== Reduce phase complete ======================", LogLevel::INFO);
+
+    // uncommitted attempt files of workers that were lost or killed
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(config.outputDir, ec)) {
+        if (entry.path().extension() == ".tmp") {
+            fs::remove(entry.path(), ec);
+        }
+    }
+    return ok;
+}
+
+// Answers one worker process until it says Bye or goes away; in the latter
+// case its running attempts are handed to other workers.
+bool Master::serveWorkerProcess(int fd, int workerId) {
+    Logger& logger = Logger::getInstance();
+    bool reducing = false;
+    bool finished = false;
+    bool connected = true;
+    Message message;
+    while (connected && !finished && receiveMessage(fd, message)) {
+        PayloadWriter reply;
+        PayloadReader request(message.payload);
+        switch (message.type) {
+            case MessageType::Register:
+                logger.log("Worker process " + std::to_string(request.getU64()) + " registered as worker " + std::to_string(workerId), LogLevel::INFO);
+                reply.putU64(static_cast<std::uint64_t>(workerId));
+                connected = sendMessage(fd, MessageType::Welcome, reply.data() + encodeConfig(config));
+                break;
+            case MessageType::RequestMapTask: {
+                FileMetaData task;
+                if (mapTasks.next(workerId, task)) {
+                    encodeTask(reply, task);
+                    connected = sendMessage(fd, MessageType::MapTask, reply.data());
+                } else {
+                    connected = sendMessage(fd, MessageType::NoTask);
+                }
+                break;
+            }
+            case MessageType::RequestReduceTask: {
+                reducing = true;
+                if (!mapTasks.wait()) {
+                    sendMessage(fd, MessageType::Abort);
+                    connected = false;
+                    break;
+                }
+                ReduceTask task;
+                if (reduceTasks.next(workerId, task)) {
+                    encodeTask(reply, task);
+                    connected = sendMessage(fd, MessageType::ReduceTask, reply.data());
+                } else {
+                    connected = sendMessage(fd, MessageType::NoTask);
+                }
+                break;
+            }
+            case MessageType::CommitTask: {
+                int taskId = static_cast<int>(request.getU64());
+                bool granted = reducing ? reduceTasks.commit(workerId, taskId) : mapTasks.commit(workerId, taskId);
+                connected = sendMessage(fd, granted ? MessageType::CommitGranted : MessageType::CommitDenied);
+                break;
+            }
+            case MessageType::TaskDone:
+            case MessageType::TaskFailed: {
+                int taskId = static_cast<int>(request.getU64());
+                bool done = message.type == MessageType::TaskDone;
+                std::vector<int> partitions;
+                if (done) {
+                    decodeIds(request, partitions);
+                }
+                if (reducing) {
+                    done ? reduceTasks.finish(workerId, taskId, partitions) : reduceTasks.abandon(workerId, taskId);
+                } else {
+                    done ? mapTasks.finish(workerId, taskId, partitions) : mapTasks.abandon(workerId, taskId);
+                }
+                break;
+            }
+            case MessageType::TaskMetrics: {
+                TaskMetrics metrics;
+                if (decodeMetrics(request, metrics)) {
+                    // the worker id is the master's, whatever the process claims
+                    metrics.workerId = workerId;
+                    Metrics::getInstance().recordTask(metrics);
+                }
+                break;
+            }
+            case MessageType::Bye:
+                logger.log("Worker " + std::to_string(workerId) + " completed its tasks", LogLevel::INFO);
+                finished = true;
+                break;
+            default:
+                logger.log("Unexpected message from worker " + std::to_string(workerId), LogLevel::ERROR);
+                connected = false;
+                break;
+        }
+    }
+
+    if (!finished) {
+        logger.log("Worker " + std::to_string(workerId) + " disconnected before finishing its tasks", LogLevel::WARNING);
+        mapTasks.workerLost(workerId);
+        reduceTasks.workerLost(workerId);
+    }
+    return finished;
 }
 
-void Master::merge() {
-    std::map<std::string, int> wordCounts;
-    std::vector<std::pair<std::string, int>> sortedWords;
+namespace {
+
+// copies of compressed keys are kept in blocks of up to this size
+constexpr std::size_t KEY_ARENA_BLOCK_BYTES = 1 << 20;
+
+// Keeps copies of keys that would not outlive their cursor, in blocks that
+// never move.
+class KeyArena {
+public:
+    explicit KeyArena(std::size_t blockBytes = KEY_ARENA_BLOCK_BYTES) : blockBytes(blockBytes) {}
+
+    std::string_view keep(std::string_view key) {
+        if (blocks.empty() || blocks.back().capacity() - blocks.back().size() < key.size()) {
+            blocks.emplace_back();
+            blocks.back().reserve(std::max(blockBytes, key.size()));
+            reserved += blocks.back().capacity();
+        }
+        std::string& block = blocks.back();
+        block.append(key);
+        return std::string_view(block.data() + block.size() - key.size(), key.size());
+    }
+    std::size_t bytes() const { return reserved; }
+    void clear() {
+        blocks.clear();
+        reserved = 0;
+    }
 
-    for (int i = 0; i < config.nReduce; ++i) {
-        std::string filename = config.outputDir + "/reduce.part-" + std::to_string(i) + ".txt";
-        std::ifstream file(filename);
-        std::string line;
+private:
+    std::size_t blockBytes;
+    std::deque<std::string> blocks;
+    std::size_t reserved = 0;
+};
 
-        while (std::getline(file, line)) {
-            std::istringstream lineStream(line);
-            std::string word;
-            int count;
-            if (std::getline(lineStream, word, ',') && lineStream >> count) {
-                wordCounts[word] += count;
+// One reduce part prepared for the final merge: its records sorted by (count
+// desc, key asc), with whatever did not fit in its share of --memory-limit
+// spilled as sorted runs. The keys of a plain part are used in place in its
+// mapping; a compressed part is decoded a block at a time, so its keys are
+// copied until the records pointing at them are spilled.
+struct SortedPartition {
+    IntermediateReader file;
+    KeyArena keys;
+    std::vector<KeyCount> records;
+    std::string spillFile;
+    IntermediateWriter spill;
+    IntermediateReader spillReader;
+    int spilledRuns = 0;
+    bool ok = true;
+    // records sorted and runs spilled, reported as a merge task
+    TaskMetrics metrics;
+};
+
+void sortPartition(SortedPartition& part, const std::string& fileName, std::size_t memoryBudget) {
+    Logger& logger = Logger::getInstance();
+    {
+        ScopedTimer io(part.metrics.ioMicros);
+        if (!part.file.open(fileName)) {
+            logger.log("Failed to read reduce output: " + fileName + " (" + part.file.error() + ")", LogLevel::ERROR);
+            part.ok = false;
+            return;
+        }
+    }
+    part.metrics.bytesRead = part.file.fileBytes();
+    // a block is a small part of the share, or the share goes to spilling
+    part.keys = KeyArena(std::clamp<std::size_t>(memoryBudget / 8, 1, KEY_ARENA_BLOCK_BYTES));
+
+    for (const RunExtent& extent : part.file.extents()) {
+        bool copyKeys = extent.codec != Codec::None;
+        RunCursor run(extent);
+        while (run.next()) {
+            part.records.push_back({copyKeys ? part.keys.keep(run.key()) : run.key(), run.count()});
+            ++part.metrics.records;
+
+            if (part.records.size() * sizeof(KeyCount) + part.keys.bytes() >= memoryBudget) {
+                std::sort(part.records.begin(), part.records.end(), byCountThenWord);
+                ScopedTimer io(part.metrics.ioMicros);
+                if (!part.spill.appendRun(part.records)) {
+                    logger.log("Failed to write merge spill file: " + part.spillFile, LogLevel::ERROR);
+                    part.ok = false;
+                }
+                ++part.spilledRuns;
+                part.records.clear();
+                part.keys.clear();
             }
         }
     }
+    // a run that ends early has a block that did not decode
+    if (part.metrics.records != part.file.recordCount()) {
+        logger.log("Damaged compressed block in reduce output: " + fileName, LogLevel::ERROR);
+        part.ok = false;
+        return;
+    }
+    std::sort(part.records.begin(), part.records.end(), byCountThenWord);
 
-    for (const auto& pair : wordCounts) {
-        sortedWords.push_back(pair);
+    if (part.spilledRuns > 0) {
+        ScopedTimer io(part.metrics.ioMicros);
+        if (!part.spill.finish() || !part.spillReader.open(part.spillFile)) {
+            logger.log("Failed to read back merge spill file: " + part.spillFile, LogLevel::ERROR);
+            part.ok = false;
+        }
+        part.metrics.bytesWritten = part.spill.bytesWritten();
+        part.metrics.runs = part.spilledRuns;
     }
+}
 
-    std::sort(sortedWords.begin(), sortedWords.end(), [](const auto& a, const auto& b) {
-        return (a.second > b.second) || (a.second == b.second && a.first < b.first);
-    });
+// Walks either the in-memory records of a partition or one of its spilled runs.
+class MergeCursor {
+public:
+    explicit MergeCursor(const std::vector<KeyCount>& records)
+        : pos(records.data()), end(records.data() + records.size()), inMemory(true) {}
+    explicit MergeCursor(const RunCursor& run) : run(run), inMemory(false) {}
 
-    std::ofstream outputFile(config.outputDir + "/output.txt");
-    for (const auto& [word, count] : sortedWords) {
-        outputFile << word << "," << count << std::endl;
+    bool next() {
+        if (!inMemory) {
+            if (!run.next()) {
+                return false;
+            }
+            current = {run.key(), run.count()};
+            return true;
+        }
+        if (pos == end) {
+            return false;
+        }
+        current = *pos++;
+        return true;
+    }
+
+    const KeyCount& record() const { return current; }
+
+private:
+    const KeyCount* pos = nullptr;
+    const KeyCount* end = nullptr;
+    RunCursor run;
+    bool inMemory;
+    KeyCount current{};
+};
+
+} // namespace
+
+// A job ordered by count: a word only ever lands in one reduce partition, so
+// nothing has to be re-aggregated. Every part is sorted on its own, in
+// parallel, and the sorted parts are k-way merged into output.txt. With
+// --topk the parts are the reducers' top-K lists, and the merge stops after
+// K words.
+template <typename JobT>
+bool Master::mergeByCount() {
+    Logger& logger = Logger::getInstance();
+    std::vector<SortedPartition> parts(config.nReduce);
+    std::size_t memoryBudget = std::max<std::size_t>(config.memoryLimitBytes / std::max(config.nReduce, 1), sizeof(KeyCount));
+    std::atomic<int> nextPart(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < std::min(numberOfWorkers, config.nReduce); ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = nextPart++; i < config.nReduce; i = nextPart++) {
+                parts[i].spillFile = config.outputDir + "/merge.spill-" + std::to_string(i) + ".bin";
+                parts[i].spill = IntermediateWriter(parts[i].spillFile, false, codecByName(config.compressIntermediate));
+                parts[i].metrics = startTaskMetrics("merge", i, t);
+                sortPartition(parts[i], config.outputDir + "/reduce.part-" + std::to_string(i) + ".bin", memoryBudget);
+                parts[i].metrics.committed = parts[i].ok;
+                parts[i].metrics.endMicros = metricsClockMicros();
+                Metrics::getInstance().recordTask(parts[i].metrics);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    auto removeSpills = [&parts]() {
+        for (const auto& part : parts) {
+            if (part.spilledRuns > 0) {
+                fs::remove(part.spillFile);
+            }
+        }
+    };
+    // a part that is missing or lost a spilled run would leave words out of output.txt
+    int failedParts = std::count_if(parts.begin(), parts.end(), [](const SortedPartition& part) { return !part.ok; });
+    if (failedParts > 0) {
+        logger.log(std::to_string(failedParts) + " reduce parts could not be merged, output.txt was not written", LogLevel::ERROR);
+        removeSpills();
+        return false;
+    }
+
+    std::vector<MergeCursor> cursors;
+    std::vector<bool> live;
+    int spilledRuns = 0;
+    for (auto& part : parts) {
+        cursors.emplace_back(part.records);
+        live.push_back(cursors.back().next());
+        for (const RunCursor& run : part.spillReader.runs()) {
+            cursors.emplace_back(run);
+            live.push_back(cursors.back().next());
+        }
+        spilledRuns += part.spilledRuns;
+    }
+    if (spilledRuns > 0) {
+        logger.log("Final merge spilled " + std::to_string(spilledRuns) + " sorted runs to disk", LogLevel::INFO);
+    }
+
+    auto cursorByCount = [](const MergeCursor& a, const MergeCursor& b) {
+        return byCountThenWord(a.record(), b.record());
+    };
+    LoserTree<MergeCursor, decltype(cursorByCount)> runs(cursors, std::move(live), cursorByCount);
+
+    // written under a temporary name, so a failed merge never leaves a partial output.txt
+    std::string outputPath = config.outputDir + "/output.txt";
+    BlockWriter outputFile;
+    bool ok = outputFile.open(outputPath + ".tmp", codecByName(config.compressOutput));
+    typename JobT::Reducer reducer;
+    std::string out;
+    std::size_t written = 0;
+    while (ok && !runs.empty() && (config.topK == 0 || written < config.topK)) {
+        const KeyCount& record = runs.top().record();
+        ++written;
+        reducer(record.key, record.count, out);
+        if (out.size() >= MERGE_WRITE_BUFFER_BYTES) {
+            ok = outputFile.write(out);
+            out.clear();
+        }
+        runs.advance();
+    }
+    ok = ok && outputFile.write(out) && outputFile.close() && std::rename((outputPath + ".tmp").c_str(), outputPath.c_str()) == 0;
+    if (!ok) {
+        logger.log("Failed to write " + outputPath, LogLevel::ERROR);
+        fs::remove(outputPath + ".tmp");
+    }
+    removeSpills();
+    return ok;
+}
+
+// Any other job: the parts are sorted by key and never share one, so
+// output.txt is one k-way merge of them by key.
+template <typename JobT>
+bool Master::mergeByKey() {
+    using Value = typename JobT::Value;
+    Logger& logger = Logger::getInstance();
+    TaskMetrics metrics = startTaskMetrics("merge", 0, 0);
+
+    std::vector<IntermediateReader> readers(config.nReduce);
+    std::vector<JobRunCursor<Value>> cursors;
+    std::vector<bool> live;
+    for (int r = 0; r < config.nReduce; ++r) {
+        std::string fileName = config.outputDir + "/reduce.part-" + std::to_string(r) + ".bin";
+        ScopedTimer io(metrics.ioMicros);
+        if (!readers[r].open(fileName)) {
+            logger.log("Failed to read reduce output: " + fileName + " (" + readers[r].error() + "), output.txt was not written", LogLevel::ERROR);
+            metrics.endMicros = metricsClockMicros();
+            Metrics::getInstance().recordTask(metrics);
+            return false;
+        }
+        metrics.bytesRead += readers[r].fileBytes();
+        for (const RunExtent& run : readers[r].extents()) {
+            cursors.emplace_back(run);
+            live.push_back(cursors.back().next());
+        }
+    }
+    auto byKey = [](const JobRunCursor<Value>& a, const JobRunCursor<Value>& b) {
+        return a.key() < b.key();
+    };
+    metrics.runs = cursors.size();
+    LoserTree<JobRunCursor<Value>, decltype(byKey)> runs(cursors, std::move(live), byKey);
+
+    std::string outputPath = config.outputDir + "/output.txt";
+    BlockWriter outputFile;
+    bool written = outputFile.open(outputPath + ".tmp", codecByName(config.compressOutput));
+    typename JobT::Reducer reducer;
+    std::string out;
+    while (written && !runs.empty()) {
+        reducer(runs.top().key(), runs.top().value(), out);
+        ++metrics.records;
+        if (out.size() >= MERGE_WRITE_BUFFER_BYTES) {
+            ScopedTimer io(metrics.ioMicros);
+            written = outputFile.write(out);
+            out.clear();
+        }
+        runs.advance();
+    }
+    {
+        ScopedTimer io(metrics.ioMicros);
+        written = written && outputFile.write(out) && outputFile.close() && std::rename((outputPath + ".tmp").c_str(), outputPath.c_str()) == 0;
+    }
+    metrics.bytesWritten = outputFile.bytesWritten();
+    metrics.committed = written;
+    if (!written) {
+        logger.log("Failed to write " + outputPath, LogLevel::ERROR);
+        fs::remove(outputPath + ".tmp");
+    }
+    metrics.endMicros = metricsClockMicros();
+    Metrics::getInstance().recordTask(metrics);
+    return written;
+}
+
+bool Master::merge() {
+    PhaseTimer phase("merge");
+    bool ok = false;
+    bool known = withJob(config.job, [&](auto job) {
+        using JobT = decltype(job);
+        if constexpr (JobT::Options::BY_COUNT) {
+            ok = mergeByCount<JobT>();
+        } else {
+            ok = mergeByKey<JobT>();
+        }
+    });
+    if (!known) {
+        Logger::getInstance().log("Unknown job: " + config.job, LogLevel::ERROR);
     }
+    return ok;
 }
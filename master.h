@@ -2,34 +2,94 @@
 #define MASTER_H
 
 #include "config.h"
+#include "scheduler.h"
+#include "count_table.h"
+#include "manifest.h"
 #include <vector>
 #include <string>
 #include <map>
 
-constexpr int CHUNK_SIZE = 1024;
+// Split sizing: with --split-size 0 the master aims for SPLITS_PER_WORKER
+// map tasks per worker, within [MIN_SPLIT_SIZE, MAX_SPLIT_SIZE].
+constexpr std::size_t MIN_SPLIT_SIZE = 1 << 20;
+constexpr std::size_t MAX_SPLIT_SIZE = 256 << 20;
+constexpr std::size_t SPLITS_PER_WORKER = 4;
+// The range partitioner samples about RANGE_SAMPLE_BYTES of input, read in
+// windows of SAMPLE_WINDOW_BYTES spread evenly over every file.
+constexpr std::size_t RANGE_SAMPLE_BYTES = 16 << 20;
+constexpr std::size_t SAMPLE_WINDOW_BYTES = 4 << 10;
+// how long --mode process waits for its worker processes to connect, and how
+// long for them to say goodbye once the last task is done before they are killed
+constexpr int WORKER_CONNECT_TIMEOUT_MS = 10000;
+constexpr int WORKER_EXIT_GRACE_MS = 1000;
 
+struct PackedFile {
+    std::string fileName;
+    std::size_t fileSize;
+};
+
+// One map task: fileSize bytes of fileName from offset, and for a task packed
+// from small files, the whole files in packedFiles after it.
 struct FileMetaData {
     std::string fileName;
     std::size_t fileSize;
     std::size_t offset;
+    int taskId = -1;
+    std::vector<PackedFile> packedFiles;
+};
+
+// Bytes of input a map task reads.
+inline std::size_t taskBytes(const FileMetaData& task) {
+    std::size_t bytes = task.fileSize;
+    for (const auto& file : task.packedFiles) {
+        bytes += file.fileSize;
+    }
+    return bytes;
+}
+
+// One reduce task: a partition, and the map tasks that committed an
+// intermediate file for it. A map task not listed had nothing for the
+// partition; a listed file that is gone is lost output, not an empty one.
+struct ReduceTask {
+    int partition = -1;
+    std::vector<int> mapOutputs;
 };
 
 class Master {
 public:
     Master(const Config& config);
-    void distributeWork();
+    // false if the input cannot be listed
+    bool distributeWork();
     void printWorkLoad() const;
     void printChunkContent() const;
     void printMapperAssignments() const;
-    void startWorkers();
-    void merge();
+    bool startWorkers();
+    // false, leaving output.txt alone, if a part could not be read or merged
+    bool merge();
 
 private:
     Config config;
     std::string inputDirectory;
     int numberOfWorkers;
-    std::vector<FileMetaData> readFileMetadata();
-    std::vector<std::vector<FileMetaData>> mapperAssignments;
+    bool readFileMetadata(std::vector<FileMetaData>& metadata);
+    std::size_t chooseSplitSize(const std::vector<FileMetaData>& files) const;
+    std::vector<FileMetaData> splitFile(const FileMetaData& file, std::size_t splitSize) const;
+    std::vector<FileMetaData> packFiles(const std::vector<FileMetaData>& files, std::size_t packSize) const;
+    void sampleFile(const FileMetaData& file, std::size_t sampleBytes, CountTable& sample) const;
+    void seedMapTasks(const std::vector<FileMetaData>& splits);
+    void resumeWork(JobManifest& previous, const std::string& manifestPath);
+    void addMapOutputs(int mapTaskId, const std::vector<int>& partitions);
+    template <typename W>
+    bool runWorkerThreads();
+    bool startWorkerProcesses();
+    bool serveWorkerProcess(int fd, int workerId);
+    template <typename JobT>
+    bool mergeByCount();
+    template <typename JobT>
+    bool mergeByKey();
+    TaskTracker<FileMetaData> mapTasks;
+    TaskTracker<ReduceTask> reduceTasks;
+    JobManifest manifest;
     std::vector<std::size_t> workerLoad;
     std::vector<std::vector<int>> reduceTasksList; 
 };
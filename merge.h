@@ -0,0 +1,132 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Tournament tree of losers for k-way merging sorted streams.
+//
+// A Source is anything with `bool next()` that moves it to its next record,
+// and Less compares two sources by their current records. Sources are handed
+// in already positioned on their first record; `live[i]` says whether source i
+// has one. Replacing the winner costs one comparison per tree level, half of
+// what a binary heap pays for the same pop-and-push.
+template <typename Source, typename Less>
+class LoserTree {
+public:
+    LoserTree(std::vector<Source>& sources, std::vector<bool> live, Less less)
+        : sources(sources), live(std::move(live)), less(less), tree(sources.size(), 0) {
+        std::size_t n = sources.size();
+        if (n == 0) {
+            return;
+        }
+
+        // leaves sit at n..2n-1; every internal node keeps the loser of its match
+        std::vector<std::size_t> winners(2 * n);
+        for (std::size_t i = 0; i < n; ++i) {
+            winners[n + i] = i;
+        }
+        for (std::size_t node = n - 1; node >= 1; --node) {
+            std::size_t a = winners[2 * node];
+            std::size_t b = winners[2 * node + 1];
+            if (beats(a, b)) {
+                winners[node] = a;
+                tree[node] = b;
+            } else {
+                winners[node] = b;
+                tree[node] = a;
+            }
+        }
+        tree[0] = n == 1 ? 0 : winners[1];
+    }
+
+    bool empty() const {
+        return tree.empty() || !live[tree[0]];
+    }
+
+    // Source holding the smallest current record.
+    Source& top() {
+        return sources[tree[0]];
+    }
+
+    // Moves the winning source to its next record and replays its path to the root.
+    void advance() {
+        std::size_t leaf = tree[0];
+        live[leaf] = sources[leaf].next();
+
+        std::size_t winner = leaf;
+        for (std::size_t node = (sources.size() + leaf) / 2; node >= 1; node /= 2) {
+            if (beats(tree[node], winner)) {
+                std::swap(tree[node], winner);
+            }
+        }
+        tree[0] = winner;
+    }
+
+private:
+    std::vector<Source>& sources;
+    std::vector<bool> live;
+    Less less;
+    std::vector<std::size_t> tree;
+
+    bool beats(std::size_t a, std::size_t b) const {
+        if (!live[a]) {
+            return false;
+        }
+        if (!live[b]) {
+            return true;
+        }
+        return less(sources[a], sources[b]);
+    }
+};
+
+// Keeps the K most frequent words seen so far, ties broken alphabetically,
+// in a bounded heap whose top is the weakest entry kept. Offering a word
+// costs O(log K) and only copies it when it makes the cut.
+class TopKHeap {
+public:
+    explicit TopKHeap(std::size_t k) : k(k) {}
+
+    void offer(std::string_view word, std::uint64_t count) {
+        if (k == 0) {
+            return;
+        }
+        if (entries.size() < k) {
+            entries.emplace_back(count, std::string(word));
+            std::push_heap(entries.begin(), entries.end(), ranksHigher);
+            return;
+        }
+        const Entry& weakest = entries.front();
+        if (count > weakest.first || (count == weakest.first && word < weakest.second)) {
+            std::pop_heap(entries.begin(), entries.end(), ranksHigher);
+            entries.back().first = count;
+            entries.back().second.assign(word);
+            std::push_heap(entries.begin(), entries.end(), ranksHigher);
+        }
+    }
+
+    // Kept entries from most to least frequent; empties the heap.
+    std::vector<std::pair<std::uint64_t, std::string>> take() {
+        std::sort(entries.begin(), entries.end(), ranksHigher);
+        std::vector<Entry> best;
+        best.swap(entries);
+        return best;
+    }
+
+private:
+    using Entry = std::pair<std::uint64_t, std::string>;
+    std::size_t k;
+    std::vector<Entry> entries;
+
+    // heap order: the entry that ranks higher sinks, so the weakest stays on top
+    static bool ranksHigher(const Entry& a, const Entry& b) {
+        return (a.first > b.first) || (a.first == b.first && a.second < b.second);
+    }
+};
+
+#endif // MERGE_H
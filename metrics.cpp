@@ -0,0 +1,253 @@
+#include "metrics.h"
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <sys/resource.h>
+
+std::int64_t metricsClockMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TaskMetrics startTaskMetrics(const std::string& phase, int taskId, int workerId) {
+    TaskMetrics metrics;
+    metrics.phase = phase;
+    metrics.taskId = taskId;
+    metrics.workerId = workerId;
+    metrics.startMicros = metricsClockMicros();
+    return metrics;
+}
+
+PhaseTimer::~PhaseTimer() {
+    Metrics::getInstance().recordPhase(name, start, metricsClockMicros());
+}
+
+void Metrics::recordTask(const TaskMetrics& task) {
+    std::lock_guard<std::mutex> lock(mtx);
+    tasks.push_back(task);
+}
+
+void Metrics::recordPhase(const std::string& name, std::int64_t startMicros, std::int64_t endMicros) {
+    std::lock_guard<std::mutex> lock(mtx);
+    phases.push_back({name, startMicros, endMicros});
+}
+
+static std::string jsonString(const std::string& value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out.append(escaped);
+        } else {
+            out.push_back(c);
+        }
+    }
+    out.push_back('"');
+    return out;
+}
+
+static std::string decimal(double value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.6f", value);
+    return buffer;
+}
+
+static std::string seconds(std::int64_t micros) {
+    return decimal(micros / 1e6);
+}
+
+static void writeCounters(std::ostream& out, const TaskMetrics& task) {
+    out << "\"ioSeconds\": " << seconds(task.ioMicros)
+        << ", \"bytesRead\": " << task.bytesRead
+        << ", \"tokens\": " << task.tokens
+        << ", \"records\": " << task.records
+        << ", \"bytesWritten\": " << task.bytesWritten
+        << ", \"runs\": " << task.runs
+        << ", \"tableEntries\": " << task.tableEntries;
+}
+
+static void accumulate(TaskMetrics& total, const TaskMetrics& task) {
+    total.ioMicros += task.ioMicros;
+    total.bytesRead += task.bytesRead;
+    total.tokens += task.tokens;
+    total.records += task.records;
+    total.bytesWritten += task.bytesWritten;
+    total.runs += task.runs;
+    total.tableEntries = std::max(total.tableEntries, task.tableEntries);
+}
+
+static bool writeFile(const std::string& path, const std::string& data, const char* what) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+    if (!file.flush()) {
+        Logger::getInstance().log(std::string("Failed to write ") + what + ": " + path, LogLevel::WARNING);
+        return false;
+    }
+    return true;
+}
+
+std::int64_t Metrics::origin() const {
+    std::int64_t start = metricsClockMicros();
+    for (const auto& phase : phases) {
+        start = std::min(start, phase.startMicros);
+    }
+    for (const auto& task : tasks) {
+        start = std::min(start, task.startMicros);
+    }
+    return start;
+}
+
+bool Metrics::writeSummary(const std::string& path, const Config& config) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::int64_t jobStart = origin();
+    std::ostringstream out;
+    out << "{\n";
+    out << "  \"input\": " << jsonString(config.inputDir) << ",\n";
+    out << "  \"output\": " << jsonString(config.outputDir) << ",\n";
+    out << "  \"mode\": " << jsonString(config.mode) << ",\n";
+    out << "  \"nWorkers\": " << config.nWorkers << ",\n";
+    out << "  \"nReduce\": " << config.nReduce << ",\n";
+    out << "  \"wallSeconds\": " << seconds(metricsClockMicros() - jobStart) << ",\n";
+    // the kernel keeps the peak of the largest child, here the largest worker process
+    struct rusage self = {};
+    struct rusage children = {};
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    out << "  \"peakRssKB\": " << self.ru_maxrss << ",\n";
+    out << "  \"workerPeakRssKB\": " << children.ru_maxrss << ",\n";
+
+    // per phase: its span and how evenly its committed tasks took, which shows stragglers and skew
+    out << "  \"phases\": [";
+    for (std::size_t p = 0; p < phases.size(); ++p) {
+        const Phase& phase = phases[p];
+        std::vector<std::int64_t> durations;
+        int attempts = 0;
+        TaskMetrics total;
+        for (const auto& task : tasks) {
+            if (task.phase != phase.name) {
+                continue;
+            }
+            ++attempts;
+            if (!task.committed) {
+                continue;
+            }
+            durations.push_back(task.endMicros - task.startMicros);
+            accumulate(total, task);
+        }
+        std::sort(durations.begin(), durations.end());
+
+        out << (p == 0 ? "\n" : ",\n") << "    {\"name\": " << jsonString(phase.name)
+            << ", \"startSeconds\": " << seconds(phase.startMicros - jobStart)
+            << ", \"seconds\": " << seconds(phase.endMicros - phase.startMicros);
+        if (attempts > 0) {
+            std::int64_t span = phase.endMicros - phase.startMicros;
+            // bytes per microsecond are MB/s
+            double mbPerSecond = span > 0 ? total.bytesRead / static_cast<double>(span) : 0.0;
+            out << ", \"attempts\": " << attempts << ", \"committed\": " << durations.size();
+            if (!durations.empty()) {
+                out << ", \"minTaskSeconds\": " << seconds(durations.front())
+                    << ", \"medianTaskSeconds\": " << seconds(durations[durations.size() / 2])
+                    << ", \"maxTaskSeconds\": " << seconds(durations.back());
+            }
+            out << ", \"readMBPerSecond\": " << decimal(mbPerSecond) << ", ";
+            writeCounters(out, total);
+        }
+        out << "}";
+    }
+    out << "\n  ],\n";
+
+    // per worker over the map and reduce phases; merge tasks run on the master's threads
+    std::map<int, std::vector<const TaskMetrics*>> byWorker;
+    for (const auto& task : tasks) {
+        if (task.phase == "map" || task.phase == "reduce") {
+            byWorker[task.workerId].push_back(&task);
+        }
+    }
+    out << "  \"workers\": [";
+    bool first = true;
+    for (const auto& [workerId, attempts] : byWorker) {
+        TaskMetrics total;
+        int committed = 0;
+        std::int64_t busy = 0;
+        for (const TaskMetrics* task : attempts) {
+            committed += task->committed ? 1 : 0;
+            busy += task->endMicros - task->startMicros;
+            accumulate(total, *task);
+        }
+        out << (first ? "\n" : ",\n") << "    {\"worker\": " << workerId
+            << ", \"attempts\": " << attempts.size() << ", \"committed\": " << committed
+            << ", \"busySeconds\": " << seconds(busy)
+            << ", \"cpuSeconds\": " << seconds(busy - total.ioMicros) << ", ";
+        writeCounters(out, total);
+        out << "}";
+        first = false;
+    }
+    out << "\n  ],\n";
+
+    out << "  \"tasks\": [";
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+        const TaskMetrics& task = tasks[i];
+        out << (i == 0 ? "\n" : ",\n") << "    {\"phase\": " << jsonString(task.phase)
+            << ", \"task\": " << task.taskId << ", \"worker\": " << task.workerId
+            << ", \"committed\": " << (task.committed ? "true" : "false")
+            << ", \"startSeconds\": " << seconds(task.startMicros - jobStart)
+            << ", \"seconds\": " << seconds(task.endMicros - task.startMicros) << ", ";
+        writeCounters(out, task);
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    return writeFile(path, out.str(), "metrics summary");
+}
+
+// Trace rows: process 1 holds one thread per worker with its map and reduce
+// attempts, process 0 the master's phases and final merge threads.
+static constexpr int TRACE_MASTER_PID = 0;
+static constexpr int TRACE_WORKERS_PID = 1;
+
+bool Metrics::writeTrace(const std::string& path) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::int64_t jobStart = origin();
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << TRACE_MASTER_PID << ", \"args\": {\"name\": \"master\"}},\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << TRACE_WORKERS_PID << ", \"args\": {\"name\": \"workers\"}},\n";
+    out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << TRACE_MASTER_PID << ", \"tid\": 0, \"args\": {\"name\": \"phases\"}}";
+
+    std::map<std::pair<int, int>, std::string> threadNames;
+    for (const auto& task : tasks) {
+        bool merging = task.phase == "merge";
+        int pid = merging ? TRACE_MASTER_PID : TRACE_WORKERS_PID;
+        int tid = merging ? task.workerId + 1 : task.workerId;
+        threadNames[{pid, tid}] = (merging ? "merge thread " : "worker ") + std::to_string(task.workerId);
+    }
+    for (const auto& [row, name] : threadNames) {
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << row.first << ", \"tid\": " << row.second
+            << ", \"args\": {\"name\": " << jsonString(name) << "}}";
+    }
+
+    for (const auto& phase : phases) {
+        out << ",\n{\"name\": " << jsonString(phase.name) << ", \"cat\": \"phase\", \"ph\": \"X\", \"ts\": "
+            << phase.startMicros - jobStart << ", \"dur\": " << phase.endMicros - phase.startMicros
+            << ", \"pid\": " << TRACE_MASTER_PID << ", \"tid\": 0}";
+    }
+    for (const auto& task : tasks) {
+        bool merging = task.phase == "merge";
+        out << ",\n{\"name\": " << jsonString(task.phase + " " + std::to_string(task.taskId))
+            << ", \"cat\": " << jsonString(task.phase) << ", \"ph\": \"X\", \"ts\": " << task.startMicros - jobStart
+            << ", \"dur\": " << task.endMicros - task.startMicros
+            << ", \"pid\": " << (merging ? TRACE_MASTER_PID : TRACE_WORKERS_PID)
+            << ", \"tid\": " << (merging ? task.workerId + 1 : task.workerId)
+            << ", \"args\": {\"committed\": " << (task.committed ? "true" : "false") << ", ";
+        writeCounters(out, task);
+        out << "}}";
+    }
+    out << "\n]}\n";
+    return writeFile(path, out.str(), "trace");
+}
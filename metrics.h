@@ -0,0 +1,101 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "config.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Microseconds on the steady clock. It is CLOCK_MONOTONIC, so timestamps taken
+// by worker processes line up with the master's.
+std::int64_t metricsClockMicros();
+
+// Counters of one task attempt, reported when the attempt ends, whether or not
+// its output was committed. Map tasks count the bytes they scan, the words
+// they tokenize and the records and sorted runs they write; reduce tasks the
+// intermediate bytes they read, the runs they merge and the lines they write;
+// merge tasks the lines they sort and the runs they spill.
+struct TaskMetrics {
+    std::string phase;
+    int taskId = -1;
+    int workerId = -1;
+    bool committed = false;
+    std::int64_t startMicros = 0;
+    std::int64_t endMicros = 0;
+    // time spent opening, reading and writing files; page faults on mapped
+    // input are not visible here and count as CPU time
+    std::int64_t ioMicros = 0;
+    std::uint64_t bytesRead = 0;
+    std::uint64_t tokens = 0;
+    std::uint64_t records = 0;
+    std::uint64_t bytesWritten = 0;
+    std::uint64_t runs = 0;
+    // largest number of distinct words held in a hash table at once
+    std::uint64_t tableEntries = 0;
+};
+
+// Counters of an attempt starting now.
+TaskMetrics startTaskMetrics(const std::string& phase, int taskId, int workerId);
+
+// Adds the time until the end of the scope to a counter.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(std::int64_t& total) : total(total), start(metricsClockMicros()) {}
+    ~ScopedTimer() { total += metricsClockMicros() - start; }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    std::int64_t& total;
+    std::int64_t start;
+};
+
+// Records the span of a job phase from construction to the end of the scope.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(std::string name) : name(std::move(name)), start(metricsClockMicros()) {}
+    ~PhaseTimer();
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    std::string name;
+    std::int64_t start;
+};
+
+// Task metrics and phase timings of the job. The master writes them out at
+// the end as a JSON summary (<outputdir>/metrics.json) and, with --trace, as a
+// Chrome trace_event file that chrome://tracing or Perfetto shows as a
+// timeline with one row per worker.
+class Metrics {
+public:
+    static Metrics& getInstance() {
+        static Metrics instance;
+        return instance;
+    }
+
+    void recordTask(const TaskMetrics& task);
+    void recordPhase(const std::string& name, std::int64_t startMicros, std::int64_t endMicros);
+
+    bool writeSummary(const std::string& path, const Config& config) const;
+    bool writeTrace(const std::string& path) const;
+
+private:
+    struct Phase {
+        std::string name;
+        std::int64_t startMicros;
+        std::int64_t endMicros;
+    };
+
+    mutable std::mutex mtx;
+    std::vector<TaskMetrics> tasks;
+    std::vector<Phase> phases;
+
+    Metrics() = default;
+    // the earliest recorded time, which the written timestamps count from
+    std::int64_t origin() const;
+};
+
+#endif // METRICS_H
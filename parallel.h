@@ -0,0 +1,35 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Runs body(i) for i in [0, n) on up to nThreads threads. With a single
+// thread the loop runs on the caller's, without starting one.
+template <typename Body>
+void parallelFor(std::size_t n, int nThreads, Body body) {
+    std::size_t count = std::min<std::size_t>(std::max(nThreads, 1), n);
+    if (count <= 1) {
+        for (std::size_t i = 0; i < n; ++i) {
+            body(i);
+        }
+        return;
+    }
+    std::atomic<std::size_t> nextIndex(0);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < count; ++t) {
+        threads.emplace_back([&]() {
+            for (std::size_t i = nextIndex++; i < n; i = nextIndex++) {
+                body(i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+#endif // PARALLEL_H
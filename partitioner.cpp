@@ -0,0 +1,59 @@
+#include "partitioner.h"
+#include <algorithm>
+
+RangePlan computeRangeBoundaries(const CountTable& sample, int nReduce) {
+    RangePlan plan;
+    if (nReduce <= 1 || sample.empty()) {
+        return plan;
+    }
+
+    std::vector<KeyCount> words;
+    sample.sortedRecords(words);
+    std::uint64_t remainingWeight = 0;
+    for (const auto& word : words) {
+        remainingWeight += word.count;
+    }
+    const std::uint64_t heavyWeight = remainingWeight / nReduce;
+    const std::size_t wanted = static_cast<std::size_t>(nReduce) - 1;
+
+    std::uint64_t current = 0;
+    std::string_view previous;
+    for (const auto& word : words) {
+        if (plan.boundaries.size() == wanted) {
+            break;
+        }
+        std::size_t partitionsLeft = nReduce - plan.boundaries.size();
+
+        if (heavyWeight > 0 && word.count >= heavyWeight) {
+            // close whatever was collected before it, then give it a partition alone
+            if (current > 0) {
+                plan.boundaries.emplace_back(previous);
+                remainingWeight -= current;
+                current = 0;
+                if (plan.boundaries.size() == wanted) {
+                    break;
+                }
+            }
+            plan.boundaries.emplace_back(word.key);
+            ++plan.heavyKeys;
+            remainingWeight -= word.count;
+            previous = word.key;
+            continue;
+        }
+
+        current += word.count;
+        previous = word.key;
+        if (current * partitionsLeft >= remainingWeight) {
+            plan.boundaries.emplace_back(word.key);
+            remainingWeight -= current;
+            current = 0;
+        }
+    }
+    return plan;
+}
+
+int rangePartitionOf(const std::vector<std::string>& boundaries, std::string_view word) {
+    auto it = std::lower_bound(boundaries.begin(), boundaries.end(), word,
+                               [](const std::string& boundary, std::string_view w) { return boundary < w; });
+    return static_cast<int>(it - boundaries.begin());
+}
@@ -0,0 +1,29 @@
+#ifndef PARTITIONER_H
+#define PARTITIONER_H
+
+#include "count_table.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Range partitioning: reduce partition i holds the words w with
+// boundaries[i-1] < w <= boundaries[i], and the last partition everything
+// above the last boundary. Partitions are therefore ordered relative to each
+// other, and reading the records of reduce.part-0..N-1 in turn gives the
+// words in alphabetical order.
+
+struct RangePlan {
+    std::vector<std::string> boundaries;
+    // words frequent enough in the sample to get a partition of their own
+    std::size_t heavyKeys = 0;
+};
+
+// Picks nReduce - 1 boundaries that split the sampled word frequencies into
+// roughly equal shares. A word whose own share is a full partition or more
+// is isolated in a partition of its own instead of dragging its neighbours
+// along with it.
+RangePlan computeRangeBoundaries(const CountTable& sample, int nReduce);
+
+int rangePartitionOf(const std::vector<std::string>& boundaries, std::string_view word);
+
+#endif // PARTITIONER_H
@@ -0,0 +1,303 @@
+#include "rpc.h"
+#include "logger.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void putLittleEndian(std::string& out, std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+static std::uint64_t getLittleEndian(const char* p, int bytes) {
+    std::uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= static_cast<std::uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return value;
+}
+
+void PayloadWriter::putU64(std::uint64_t value) {
+    putLittleEndian(buffer, value, 8);
+}
+
+void PayloadWriter::putString(std::string_view value) {
+    putLittleEndian(buffer, value.size(), 4);
+    buffer.append(value);
+}
+
+std::uint64_t PayloadReader::getU64() {
+    if (!valid || pos.size() < 8) {
+        valid = false;
+        return 0;
+    }
+    std::uint64_t value = getLittleEndian(pos.data(), 8);
+    pos.remove_prefix(8);
+    return value;
+}
+
+std::string PayloadReader::getString() {
+    if (!valid || pos.size() < 4) {
+        valid = false;
+        return std::string();
+    }
+    std::uint64_t length = getLittleEndian(pos.data(), 4);
+    pos.remove_prefix(4);
+    if (pos.size() < length) {
+        valid = false;
+        return std::string();
+    }
+    std::string value(pos.substr(0, length));
+    pos.remove_prefix(length);
+    return value;
+}
+
+static bool writeFully(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        // MSG_NOSIGNAL: a worker that went away must not take the master down with SIGPIPE
+        ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+static bool readFully(int fd, char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t n = ::read(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+bool sendMessage(int fd, MessageType type, const std::string& payload) {
+    std::string frame;
+    frame.reserve(5 + payload.size());
+    putLittleEndian(frame, payload.size() + 1, 4);
+    frame.push_back(static_cast<char>(type));
+    frame.append(payload);
+    return writeFully(fd, frame.data(), frame.size());
+}
+
+bool receiveMessage(int fd, Message& message) {
+    char header[5];
+    if (!readFully(fd, header, sizeof(header))) {
+        return false;
+    }
+    std::uint64_t length = getLittleEndian(header, 4);
+    if (length == 0 || length > MAX_FRAME_BYTES) {
+        return false;
+    }
+    message.type = static_cast<MessageType>(header[4]);
+    message.payload.resize(length - 1);
+    return readFully(fd, &message.payload[0], message.payload.size());
+}
+
+static bool fillAddress(const std::string& path, sockaddr_un& address) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        Logger::getInstance().log("Socket path too long: " + path, LogLevel::ERROR);
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+int listenUnixSocket(const std::string& path, int backlog) {
+    Logger& logger = Logger::getInstance();
+    sockaddr_un address;
+    if (!fillAddress(path, address)) {
+        return -1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        logger.log("Failed to create socket: " + std::string(std::strerror(errno)), LogLevel::ERROR);
+        return -1;
+    }
+    // a socket file left behind by an earlier run would make bind fail
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+        || ::listen(fd, backlog) != 0) {
+        logger.log("Failed to listen on " + path + ": " + std::strerror(errno), LogLevel::ERROR);
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connectUnixSocket(const std::string& path) {
+    Logger& logger = Logger::getInstance();
+    sockaddr_un address;
+    if (!fillAddress(path, address)) {
+        return -1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        logger.log("Failed to create socket: " + std::string(std::strerror(errno)), LogLevel::ERROR);
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        logger.log("Failed to connect to " + path + ": " + std::strerror(errno), LogLevel::ERROR);
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::string encodeConfig(const Config& config) {
+    PayloadWriter writer;
+    writer.putString(config.inputDir);
+    writer.putString(config.outputDir);
+    writer.putU64(config.nWorkers);
+    writer.putU64(config.nReduce);
+    writer.putU64(config.splitSize);
+    writer.putU64(config.mapBufferBytes);
+    writer.putU64(config.combine ? 1 : 0);
+    writer.putU64(config.combineLimitBytes);
+    writer.putString(config.tokenizer);
+    writer.putU64(config.memoryLimitBytes);
+    writer.putString(config.partitioner);
+    writer.putU64(config.rangeBoundaries.size());
+    for (const auto& boundary : config.rangeBoundaries) {
+        writer.putString(boundary);
+    }
+    writer.putU64(config.topK);
+    writer.putU64(config.nMapTasks);
+    writer.putString(config.logLevel);
+    writer.putU64(config.quiet ? 1 : 0);
+    writer.putString(config.job);
+    writer.putString(config.pattern);
+    writer.putString(config.compressIntermediate);
+    writer.putString(config.compressOutput);
+    return writer.data();
+}
+
+bool decodeConfig(PayloadReader& reader, Config& config) {
+    config.inputDir = reader.getString();
+    config.outputDir = reader.getString();
+    config.nWorkers = static_cast<int>(reader.getU64());
+    config.nReduce = static_cast<int>(reader.getU64());
+    config.splitSize = reader.getU64();
+    config.mapBufferBytes = reader.getU64();
+    config.combine = reader.getU64() != 0;
+    config.combineLimitBytes = reader.getU64();
+    config.tokenizer = reader.getString();
+    config.memoryLimitBytes = reader.getU64();
+    config.partitioner = reader.getString();
+    std::uint64_t boundaries = reader.getU64();
+    config.rangeBoundaries.clear();
+    for (std::uint64_t i = 0; i < boundaries && reader.ok(); ++i) {
+        config.rangeBoundaries.push_back(reader.getString());
+    }
+    config.topK = reader.getU64();
+    config.nMapTasks = static_cast<int>(reader.getU64());
+    config.logLevel = reader.getString();
+    config.quiet = reader.getU64() != 0;
+    config.job = reader.getString();
+    config.pattern = reader.getString();
+    config.compressIntermediate = reader.getString();
+    config.compressOutput = reader.getString();
+    return reader.ok();
+}
+
+void encodeTask(PayloadWriter& writer, const FileMetaData& task) {
+    writer.putString(task.fileName);
+    writer.putU64(task.offset);
+    writer.putU64(task.fileSize);
+    writer.putU64(static_cast<std::uint64_t>(task.taskId));
+    writer.putU64(task.packedFiles.size());
+    for (const auto& file : task.packedFiles) {
+        writer.putString(file.fileName);
+        writer.putU64(file.fileSize);
+    }
+}
+
+void encodeTask(PayloadWriter& writer, const ReduceTask& task) {
+    writer.putU64(static_cast<std::uint64_t>(task.partition));
+    encodeIds(writer, task.mapOutputs);
+}
+
+void decodeTask(PayloadReader& reader, FileMetaData& task) {
+    task.fileName = reader.getString();
+    task.offset = reader.getU64();
+    task.fileSize = reader.getU64();
+    task.taskId = static_cast<int>(reader.getU64());
+    std::uint64_t packed = reader.getU64();
+    task.packedFiles.clear();
+    for (std::uint64_t i = 0; i < packed && reader.ok(); ++i) {
+        std::string fileName = reader.getString();
+        task.packedFiles.push_back({fileName, static_cast<std::size_t>(reader.getU64())});
+    }
+}
+
+void decodeTask(PayloadReader& reader, ReduceTask& task) {
+    task.partition = static_cast<int>(reader.getU64());
+    decodeIds(reader, task.mapOutputs);
+}
+
+void encodeIds(PayloadWriter& writer, const std::vector<int>& ids) {
+    writer.putU64(ids.size());
+    for (int id : ids) {
+        writer.putU64(static_cast<std::uint64_t>(id));
+    }
+}
+
+void decodeIds(PayloadReader& reader, std::vector<int>& ids) {
+    std::uint64_t count = reader.getU64();
+    ids.clear();
+    for (std::uint64_t i = 0; i < count && reader.ok(); ++i) {
+        ids.push_back(static_cast<int>(reader.getU64()));
+    }
+}
+
+std::string encodeMetrics(const TaskMetrics& metrics) {
+    PayloadWriter writer;
+    writer.putString(metrics.phase);
+    writer.putU64(static_cast<std::uint64_t>(metrics.taskId));
+    writer.putU64(static_cast<std::uint64_t>(metrics.workerId));
+    writer.putU64(metrics.committed ? 1 : 0);
+    writer.putU64(static_cast<std::uint64_t>(metrics.startMicros));
+    writer.putU64(static_cast<std::uint64_t>(metrics.endMicros));
+    writer.putU64(static_cast<std::uint64_t>(metrics.ioMicros));
+    writer.putU64(metrics.bytesRead);
+    writer.putU64(metrics.tokens);
+    writer.putU64(metrics.records);
+    writer.putU64(metrics.bytesWritten);
+    writer.putU64(metrics.runs);
+    writer.putU64(metrics.tableEntries);
+    return writer.data();
+}
+
+bool decodeMetrics(PayloadReader& reader, TaskMetrics& metrics) {
+    metrics.phase = reader.getString();
+    metrics.taskId = static_cast<int>(reader.getU64());
+    metrics.workerId = static_cast<int>(reader.getU64());
+    metrics.committed = reader.getU64() != 0;
+    metrics.startMicros = static_cast<std::int64_t>(reader.getU64());
+    metrics.endMicros = static_cast<std::int64_t>(reader.getU64());
+    metrics.ioMicros = static_cast<std::int64_t>(reader.getU64());
+    metrics.bytesRead = reader.getU64();
+    metrics.tokens = reader.getU64();
+    metrics.records = reader.getU64();
+    metrics.bytesWritten = reader.getU64();
+    metrics.runs = reader.getU64();
+    metrics.tableEntries = reader.getU64();
+    return reader.ok();
+}
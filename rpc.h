@@ -0,0 +1,183 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include "config.h"
+#include "master.h"
+#include "scheduler.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Master <-> worker process protocol over a Unix-domain stream socket.
+//
+//   frame   u32 length | u8 type | payload (length - 1 bytes)
+//
+// Integers are little-endian and strings are u32 length + bytes. A worker
+// process connects and sends Register (its pid); the master answers with
+// Welcome (worker id + job configuration). The worker then asks for map tasks
+// until it gets NoTask, and for reduce tasks until NoTask, and says Bye. The
+// master holds back the first NoTask of a phase until the phase is complete.
+// After running a task the worker sends CommitTask and, if granted, moves its
+// output into place and sends TaskDone with the partitions a map task wrote; a
+// failed attempt sends TaskFailed.
+// Either way TaskMetrics with the attempt's counters follows. Abort tells a
+// worker the job has failed.
+
+enum class MessageType : std::uint8_t {
+    Register = 1,
+    Welcome,
+    RequestMapTask,
+    MapTask,
+    RequestReduceTask,
+    ReduceTask,
+    NoTask,
+    CommitTask,
+    CommitGranted,
+    CommitDenied,
+    TaskDone,
+    TaskFailed,
+    Abort,
+    Bye,
+    TaskMetrics
+};
+
+constexpr std::uint32_t MAX_FRAME_BYTES = 64 << 20;
+
+struct Message {
+    MessageType type;
+    std::string payload;
+};
+
+// Appends fields to a payload.
+class PayloadWriter {
+public:
+    void putU64(std::uint64_t value);
+    void putString(std::string_view value);
+    const std::string& data() const { return buffer; }
+
+private:
+    std::string buffer;
+};
+
+// Reads fields back in the order they were written; ok() turns false on a
+// truncated payload and every later read returns zero or empty.
+class PayloadReader {
+public:
+    explicit PayloadReader(std::string_view payload) : pos(payload) {}
+    std::uint64_t getU64();
+    std::string getString();
+    bool ok() const { return valid; }
+
+private:
+    std::string_view pos;
+    bool valid = true;
+};
+
+bool sendMessage(int fd, MessageType type, const std::string& payload = std::string());
+// Blocks for the next frame; false on end of stream or a malformed frame.
+bool receiveMessage(int fd, Message& message);
+
+// Socket descriptors, or -1 after logging why.
+int listenUnixSocket(const std::string& path, int backlog);
+int connectUnixSocket(const std::string& path);
+
+std::string encodeConfig(const Config& config);
+bool decodeConfig(PayloadReader& reader, Config& config);
+
+void encodeTask(PayloadWriter& writer, const FileMetaData& task);
+void encodeTask(PayloadWriter& writer, const ReduceTask& task);
+void decodeTask(PayloadReader& reader, FileMetaData& task);
+void decodeTask(PayloadReader& reader, ReduceTask& task);
+
+// A list of task or partition ids: u64 count, then u64 each.
+void encodeIds(PayloadWriter& writer, const std::vector<int>& ids);
+void decodeIds(PayloadReader& reader, std::vector<int>& ids);
+
+std::string encodeMetrics(const TaskMetrics& metrics);
+bool decodeMetrics(PayloadReader& reader, TaskMetrics& metrics);
+
+// Task source of a worker process: every call is one round trip to the
+// master. failed() tells a drained source apart from a lost or aborted job.
+template <typename Task>
+class RemoteTaskSource : public TaskSource<Task> {
+public:
+    RemoteTaskSource(int fd, MessageType request, MessageType reply)
+        : fd(fd), request(request), reply(reply) {}
+
+    bool next(int, Task& task) override {
+        if (lost) {
+            return false;
+        }
+        Message message;
+        if (!sendMessage(fd, request) || !receiveMessage(fd, message)) {
+            lost = true;
+            return false;
+        }
+        if (message.type == MessageType::NoTask) {
+            return false;
+        }
+        PayloadReader reader(message.payload);
+        if (message.type == reply) {
+            decodeTask(reader, task);
+        }
+        if (message.type != reply || !reader.ok()) {
+            lost = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool commit(int, int taskId) override {
+        Message message;
+        if (!report(MessageType::CommitTask, taskId) || !receiveMessage(fd, message)) {
+            lost = true;
+            return false;
+        }
+        if (message.type != MessageType::CommitGranted && message.type != MessageType::CommitDenied) {
+            lost = true;
+        }
+        return message.type == MessageType::CommitGranted;
+    }
+
+    void finish(int, int taskId, const std::vector<int>& partitions) override {
+        report(MessageType::TaskDone, taskId, partitions);
+    }
+
+    void abandon(int, int taskId) override {
+        report(MessageType::TaskFailed, taskId);
+    }
+
+    // asking would cost a round trip per check; a straggler is killed by the master instead
+    bool superseded(int) const override {
+        return false;
+    }
+
+    void report(const TaskMetrics& metrics) override {
+        if (!lost && !sendMessage(fd, MessageType::TaskMetrics, encodeMetrics(metrics))) {
+            lost = true;
+        }
+    }
+
+    bool failed() const { return lost; }
+
+private:
+    int fd;
+    MessageType request;
+    MessageType reply;
+    bool lost = false;
+
+    bool report(MessageType type, int taskId, const std::vector<int>& partitions = {}) {
+        PayloadWriter writer;
+        writer.putU64(static_cast<std::uint64_t>(taskId));
+        if (type == MessageType::TaskDone) {
+            encodeIds(writer, partitions);
+        }
+        if (lost || !sendMessage(fd, type, writer.data())) {
+            lost = true;
+        }
+        return !lost;
+    }
+};
+
+#endif // RPC_H
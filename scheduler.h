@@ -0,0 +1,464 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "logger.h"
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Shared task pool for one phase. Every worker owns a deque that is seeded up
+// front; a worker pops from the front of its own deque and, once that is empty,
+// steals from the back of the others, so fast workers drain slow workers' tasks.
+template <typename Task>
+class WorkStealingQueue {
+public:
+    explicit WorkStealingQueue(int nWorkers) {
+        for (int i = 0; i < nWorkers; ++i) {
+            deques.push_back(std::make_unique<Deque>());
+        }
+    }
+
+    void push(int workerId, Task task) {
+        Deque& own = *deques[workerId];
+        std::lock_guard<std::mutex> lock(own.mtx);
+        own.tasks.push_back(std::move(task));
+    }
+
+    // Returns false once no worker has anything left to hand out.
+    bool next(int workerId, Task& task) {
+        if (popFront(*deques[workerId], task)) {
+            return true;
+        }
+        for (std::size_t i = 1; i < deques.size(); ++i) {
+            Deque& victim = *deques[(workerId + i) % deques.size()];
+            if (popBack(victim, task)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Copy of the tasks currently queued for a worker, for reporting.
+    std::vector<Task> tasksOf(int workerId) const {
+        Deque& own = *deques[workerId];
+        std::lock_guard<std::mutex> lock(own.mtx);
+        return std::vector<Task>(own.tasks.begin(), own.tasks.end());
+    }
+
+    int numberOfWorkers() const {
+        return static_cast<int>(deques.size());
+    }
+
+private:
+    struct Deque {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+    std::vector<std::unique_ptr<Deque>> deques;
+
+    static bool popFront(Deque& d, Task& task) {
+        std::lock_guard<std::mutex> lock(d.mtx);
+        if (d.tasks.empty()) {
+            return false;
+        }
+        task = std::move(d.tasks.front());
+        d.tasks.pop_front();
+        return true;
+    }
+
+    static bool popBack(Deque& d, Task& task) {
+        std::lock_guard<std::mutex> lock(d.mtx);
+        if (d.tasks.empty()) {
+            return false;
+        }
+        task = std::move(d.tasks.back());
+        d.tasks.pop_back();
+        return true;
+    }
+};
+
+// Where a worker gets its tasks from and reports them back to: a TaskTracker
+// when workers are threads, the master's socket (rpc.h) when they are
+// processes. Every task a worker is handed ends in exactly one of:
+//   commit() false             another attempt already won; drop the output
+//   commit() true, finish()    the output was moved into place; a map task
+//                              names the partitions it wrote a file for
+//   abandon()                  the attempt failed before or while committing
+// and is then described by one report() for the job's metrics.
+template <typename Task>
+class TaskSource {
+public:
+    virtual ~TaskSource() = default;
+    // Blocks until there is a task for this worker; false once the phase is over.
+    virtual bool next(int workerId, Task& task) = 0;
+    // Asks to make this worker's output the task's output; true at most once per task.
+    virtual bool commit(int workerId, int taskId) = 0;
+    virtual void finish(int workerId, int taskId, const std::vector<int>& partitions) = 0;
+    virtual void abandon(int workerId, int taskId) = 0;
+    // True once the task is done by some other attempt, so a slow copy may stop early.
+    virtual bool superseded(int taskId) const = 0;
+    virtual void report(const TaskMetrics& metrics) = 0;
+};
+
+struct TaskPolicy {
+    // failed attempts of one task before the whole job is given up
+    int maxAttempts = 4;
+    // attempts running longer than this are presumed lost and started again
+    std::chrono::milliseconds timeout = std::chrono::minutes(10);
+    // launch backup copies of straggling tasks once nothing is left to start
+    bool speculate = true;
+};
+
+// A straggler is an attempt running SPECULATION_SLOWDOWN times longer than the
+// median finished task, and at least SPECULATION_MIN_ELAPSED.
+constexpr double SPECULATION_SLOWDOWN = 2.0;
+constexpr std::chrono::milliseconds SPECULATION_MIN_ELAPSED(200);
+// how often an idle worker looks again for timed out or straggling tasks
+constexpr std::chrono::milliseconds TRACKER_POLL_INTERVAL(20);
+
+// Median of the durations added so far, kept in two heaps: the lower half
+// in a max-heap and the upper half, which holds the median, in a min-heap.
+class RunningMedian {
+public:
+    void add(double value) {
+        if (upper.empty() || value >= upper.top()) {
+            upper.push(value);
+        } else {
+            lower.push(value);
+        }
+        if (upper.size() > lower.size() + 1) {
+            lower.push(upper.top());
+            upper.pop();
+        } else if (lower.size() > upper.size()) {
+            upper.push(lower.top());
+            lower.pop();
+        }
+    }
+    bool empty() const { return upper.empty(); }
+    // the upper median for an even count
+    double median() const { return upper.top(); }
+
+private:
+    std::priority_queue<double> lower;
+    std::priority_queue<double, std::vector<double>, std::greater<double>> upper;
+};
+
+// Task state of one phase. Pending tasks wait in a work-stealing queue; a task
+// failed by one worker is queued again for the next worker, and near the end of
+// the phase idle workers start backup copies of the slowest running tasks. The
+// first attempt to commit wins and every other attempt's output is discarded.
+// Task ids are the order in which tasks were added.
+template <typename Task>
+class TaskTracker : public TaskSource<Task> {
+public:
+    TaskTracker(const std::string& phase, int nWorkers, TaskPolicy policy)
+        : phase(phase), nWorkers(nWorkers), policy(policy), pending(nWorkers) {}
+
+    // Only before the phase starts; returns the task's id.
+    int add(int workerId, Task task) {
+        int id = static_cast<int>(tasks.size());
+        tasks.emplace_back(std::move(task));
+        doneFlags.emplace_back(false);
+        pending.push(workerId, id);
+        return id;
+    }
+
+    std::size_t size() const { return tasks.size(); }
+
+    // Only before the phase starts: the task's output survives from an earlier run.
+    void markDone(int taskId) {
+        if (tasks[taskId].status != Status::Done) {
+            tasks[taskId].status = Status::Done;
+            doneFlags[taskId] = true;
+            ++done;
+        }
+    }
+
+    // Called with the id of every task whose output is committed and the
+    // partitions finish() named, outside the lock but before the task counts
+    // as done, so whoever waits for the phase sees what it recorded.
+    void setCommitListener(std::function<void(int, const std::vector<int>&)> listener) {
+        onCommit = std::move(listener);
+    }
+
+    // Changes a task under the lock, for what is learnt about it while other
+    // tasks run; a worker gets the task as it is when the worker is handed it.
+    template <typename Change>
+    void update(int taskId, Change change) {
+        std::lock_guard<std::mutex> lock(mtx);
+        change(tasks[taskId].task);
+    }
+
+    // Tasks currently queued for a worker, for reporting.
+    std::vector<Task> tasksOf(int workerId) const {
+        std::vector<Task> queued;
+        for (int id : pending.tasksOf(workerId)) {
+            queued.push_back(tasks[id].task);
+        }
+        return queued;
+    }
+
+    // The deques are popped before the tracker's lock is taken, so workers
+    // only meet on it for the O(log n) bookkeeping of an attempt.
+    bool next(int workerId, Task& task) override {
+        for (;;) {
+            int id;
+            bool popped = pending.next(workerId, id);
+            std::unique_lock<std::mutex> lock(mtx);
+            if (failedJob || done >= tasks.size()) {
+                return false;
+            }
+            auto now = Clock::now();
+            expireAttempts(now);
+
+            if (popped) {
+                if (tasks[id].status == Status::Pending) {
+                    start(id, workerId, now);
+                    task = tasks[id].task;
+                    return true;
+                }
+                continue;
+            }
+            if (policy.speculate) {
+                id = pickStraggler(workerId, now);
+                if (id >= 0) {
+                    Logger::getInstance().log("Launching backup of slow " + phase + " task " + std::to_string(id) + " on worker " + std::to_string(workerId), LogLevel::INFO);
+                    start(id, workerId, now);
+                    task = tasks[id].task;
+                    return true;
+                }
+            }
+            changed.wait_for(lock, TRACKER_POLL_INTERVAL);
+        }
+    }
+
+    bool commit(int workerId, int taskId) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        State& state = tasks[taskId];
+        auto attempt = findAttempt(state, workerId);
+        if (state.status == Status::Committing || state.status == Status::Done) {
+            if (attempt != state.running.end()) {
+                endAttempt(taskId, attempt);
+            }
+            return false;
+        }
+        // a timed out attempt may still finish first, but its duration says nothing about the median
+        state.timed = attempt != state.running.end();
+        if (state.timed) {
+            state.commitStarted = attempt->started;
+            endAttempt(taskId, attempt);
+        }
+        state.status = Status::Committing;
+        state.committer = workerId;
+        return true;
+    }
+
+    void finish(int workerId, int taskId, const std::vector<int>& partitions) override {
+        std::unique_lock<std::mutex> lock(mtx);
+        State& state = tasks[taskId];
+        if (state.status != Status::Committing || state.committer != workerId) {
+            return;
+        }
+        // only this worker can end its commit, so the task is still its own after the listener
+        if (onCommit) {
+            lock.unlock();
+            onCommit(taskId, partitions);
+            lock.lock();
+        }
+        state.status = Status::Done;
+        doneFlags[taskId] = true;
+        if (state.timed) {
+            std::chrono::duration<double> elapsed = Clock::now() - state.commitStarted;
+            durations.add(elapsed.count());
+        }
+        ++done;
+        changed.notify_all();
+    }
+
+    void abandon(int workerId, int taskId) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        abandonLocked(workerId, taskId, "failed");
+    }
+
+    bool superseded(int taskId) const override {
+        return doneFlags[taskId].load(std::memory_order_relaxed);
+    }
+
+    void report(const TaskMetrics& metrics) override {
+        Metrics::getInstance().recordTask(metrics);
+    }
+
+    // Gives up every attempt the worker is running or committing.
+    void workerLost(int workerId) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (std::size_t id = 0; id < tasks.size(); ++id) {
+            const State& state = tasks[id];
+            bool committing = state.status == Status::Committing && state.committer == workerId;
+            if (committing || findAttempt(tasks[id], workerId) != state.running.end()) {
+                abandonLocked(workerId, static_cast<int>(id), "lost with its worker");
+            }
+        }
+    }
+
+    // Stops handing out tasks and fails the phase, unless it is already complete.
+    void abort() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (done < tasks.size()) {
+            failedJob = true;
+        }
+        changed.notify_all();
+    }
+
+    // Blocks until every task is done or the phase failed; true on success.
+    bool wait() {
+        std::unique_lock<std::mutex> lock(mtx);
+        changed.wait(lock, [this]() { return failedJob || done == tasks.size(); });
+        return !failedJob;
+    }
+
+    bool failed() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return failedJob;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    enum class Status { Pending, Running, Committing, Done };
+
+    struct Attempt {
+        int workerId;
+        Clock::time_point started;
+    };
+
+    struct State {
+        explicit State(Task task) : task(std::move(task)) {}
+        Task task;
+        Status status = Status::Pending;
+        std::vector<Attempt> running;
+        int failures = 0;
+        int committer = -1;
+        Clock::time_point commitStarted;
+        bool timed = false;
+    };
+
+    std::string phase;
+    int nWorkers;
+    TaskPolicy policy;
+    WorkStealingQueue<int> pending;
+    std::vector<State> tasks;
+    // read without the lock by superseded(); a deque never moves its elements
+    std::deque<std::atomic<bool>> doneFlags;
+    // every running attempt as (started, task id, worker id), oldest first:
+    // the front is the next to time out and the likeliest straggler
+    std::set<std::tuple<Clock::time_point, int, int>> runningAttempts;
+    RunningMedian durations;
+    std::function<void(int, const std::vector<int>&)> onCommit;
+    std::size_t done = 0;
+    bool failedJob = false;
+    mutable std::mutex mtx;
+    std::condition_variable changed;
+
+    static typename std::vector<Attempt>::iterator findAttempt(State& state, int workerId) {
+        return std::find_if(state.running.begin(), state.running.end(),
+                            [workerId](const Attempt& a) { return a.workerId == workerId; });
+    }
+
+    static typename std::vector<Attempt>::const_iterator findAttempt(const State& state, int workerId) {
+        return std::find_if(state.running.begin(), state.running.end(),
+                            [workerId](const Attempt& a) { return a.workerId == workerId; });
+    }
+
+    void start(int id, int workerId, Clock::time_point now) {
+        tasks[id].status = Status::Running;
+        tasks[id].running.push_back({workerId, now});
+        runningAttempts.emplace(now, id, workerId);
+    }
+
+    void endAttempt(int id, typename std::vector<Attempt>::iterator attempt) {
+        runningAttempts.erase(std::make_tuple(attempt->started, id, attempt->workerId));
+        tasks[id].running.erase(attempt);
+    }
+
+    void abandonLocked(int workerId, int taskId, const std::string& why) {
+        State& state = tasks[taskId];
+        auto attempt = findAttempt(state, workerId);
+        if (state.status == Status::Committing && state.committer == workerId) {
+            state.status = state.running.empty() ? Status::Pending : Status::Running;
+            state.committer = -1;
+        } else if (attempt != state.running.end()) {
+            endAttempt(taskId, attempt);
+        } else {
+            // already written off, e.g. timed out
+            return;
+        }
+        ++state.failures;
+        Logger::getInstance().log("Attempt of " + phase + " task " + std::to_string(taskId) + " on worker " + std::to_string(workerId) + " " + why
+                                  + " (" + std::to_string(state.failures) + " of " + std::to_string(policy.maxAttempts) + " failures)", LogLevel::WARNING);
+        retryIfIdle(taskId, workerId);
+    }
+
+    // Queues a task that has no running attempt left, preferably on another worker.
+    void retryIfIdle(int taskId, int lastWorker) {
+        State& state = tasks[taskId];
+        if (state.status != Status::Running && state.status != Status::Pending) {
+            return;
+        }
+        if (!state.running.empty()) {
+            return;
+        }
+        if (state.failures >= policy.maxAttempts) {
+            Logger::getInstance().log("Giving up on " + phase + " task " + std::to_string(taskId) + " after " + std::to_string(state.failures) + " failed attempts", LogLevel::ERROR);
+            failedJob = true;
+        } else {
+            state.status = Status::Pending;
+            pending.push((lastWorker + 1) % nWorkers, taskId);
+        }
+        changed.notify_all();
+    }
+
+    // Writes off the attempts past the timeout; looks at nothing else while
+    // the oldest attempt is still within it.
+    void expireAttempts(Clock::time_point now) {
+        while (!runningAttempts.empty() && now - std::get<0>(*runningAttempts.begin()) >= policy.timeout) {
+            auto [started, id, workerId] = *runningAttempts.begin();
+            endAttempt(id, findAttempt(tasks[id], workerId));
+            ++tasks[id].failures;
+            Logger::getInstance().log("Attempt of " + phase + " task " + std::to_string(id) + " on worker " + std::to_string(workerId) + " timed out", LogLevel::WARNING);
+            retryIfIdle(id, workerId);
+        }
+    }
+
+    // The running task furthest behind the median, if it deserves a backup copy.
+    int pickStraggler(int workerId, Clock::time_point now) const {
+        if (durations.empty()) {
+            return -1;
+        }
+        std::chrono::duration<double> threshold(std::max(SPECULATION_SLOWDOWN * durations.median(),
+                                                         std::chrono::duration<double>(SPECULATION_MIN_ELAPSED).count()));
+        // oldest first, so the first one that qualifies is the slowest
+        for (const auto& [started, id, runner] : runningAttempts) {
+            if (now - started <= threshold) {
+                break;
+            }
+            const State& state = tasks[id];
+            // one backup per task, never on the worker already running it
+            if (state.status == Status::Running && state.running.size() == 1 && runner != workerId) {
+                return id;
+            }
+        }
+        return -1;
+    }
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,109 @@
+#include "shuffle.h"
+#include <algorithm>
+
+ShuffleStore::ShuffleStore(int nMapTasks, int nReduce, std::size_t memoryBudget)
+    : partitions(nReduce), published(nMapTasks, false), nMapTasks(nMapTasks), budget(memoryBudget) {}
+
+bool ShuffleStore::reserve(std::size_t bytes) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (usedBytes + bytes > budget) {
+        return false;
+    }
+    usedBytes += bytes;
+    peak = std::max(peak, usedBytes);
+    return true;
+}
+
+void ShuffleStore::unreserve(std::size_t bytes) {
+    std::lock_guard<std::mutex> lock(mtx);
+    usedBytes -= std::min(usedBytes, bytes);
+}
+
+void ShuffleStore::publish(int mapTaskId, std::vector<ShuffleBatch> batches) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (published[mapTaskId]) {
+            return;
+        }
+        published[mapTaskId] = true;
+        ++publishedTasks;
+        for (std::size_t r = 0; r < partitions.size(); ++r) {
+            // the task had nothing for this partition
+            if (!batches[r].image && batches[r].path.empty()) {
+                continue;
+            }
+            spilled += batches[r].image ? 0 : 1;
+            partitions[r].batches.push_back(std::make_shared<const ShuffleBatch>(std::move(batches[r])));
+            ++partitions[r].version;
+        }
+    }
+    changed.notify_all();
+}
+
+bool ShuffleStore::wait(int reduceId, std::uint64_t& version, ShuffleBatches& batches, bool& complete) {
+    std::unique_lock<std::mutex> lock(mtx);
+    Partition& partition = partitions[reduceId];
+    changed.wait(lock, [&] {
+        return aborted || partition.version != version || publishedTasks == nMapTasks;
+    });
+    if (aborted) {
+        return false;
+    }
+    version = partition.version;
+    batches = partition.batches;
+    complete = publishedTasks == nMapTasks;
+    return true;
+}
+
+bool ShuffleStore::replace(int reduceId, const ShuffleBatches& merged, ShuffleBatch result) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        ShuffleBatches& batches = partitions[reduceId].batches;
+        for (const auto& batch : merged) {
+            if (std::find(batches.begin(), batches.end(), batch) == batches.end()) {
+                return false;
+            }
+        }
+        for (const auto& batch : merged) {
+            batches.erase(std::find(batches.begin(), batches.end(), batch));
+            usedBytes -= batch->image ? std::min(usedBytes, batch->image->size()) : 0;
+        }
+        // a merge is about as large as its inputs, so it takes their place without asking the budget
+        usedBytes += result.image ? result.image->size() : 0;
+        peak = std::max(peak, usedBytes);
+        batches.push_back(std::make_shared<const ShuffleBatch>(std::move(result)));
+        ++partitions[reduceId].version;
+    }
+    changed.notify_all();
+    return true;
+}
+
+void ShuffleStore::release(int reduceId) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (const auto& batch : partitions[reduceId].batches) {
+        usedBytes -= batch->image ? std::min(usedBytes, batch->image->size()) : 0;
+    }
+    partitions[reduceId].batches.clear();
+}
+
+void ShuffleStore::abort() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        aborted = true;
+    }
+    changed.notify_all();
+}
+
+std::size_t ShuffleStore::peakBytes() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return peak;
+}
+
+int ShuffleStore::spilledBatches() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return spilled;
+}
+
+bool openBatch(IntermediateReader& reader, const ShuffleBatch& batch) {
+    return batch.image ? reader.open(batch.image) : reader.open(batch.path);
+}
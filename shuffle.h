@@ -0,0 +1,101 @@
+#ifndef SHUFFLE_H
+#define SHUFFLE_H
+
+#include "intermediate.h"
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// In-memory shuffle of `--shuffle memory`. Map tasks build their partitions
+// as intermediate file images in memory and, once committed, hand them to the
+// ShuffleStore instead of writing map.part files. Reduce tasks run next to the
+// map tasks and pick their partition's batches up as they arrive. Only images
+// that would take the store over --shuffle-memory are spilled to the map.part
+// file they would have had anyway.
+
+// A piece of one reduce partition: the image of a map output, or the merge of
+// several of them, held in memory or spilled to path.
+struct ShuffleBatch {
+    std::shared_ptr<const std::string> image;
+    std::string path;
+};
+
+using ShuffleBatches = std::vector<std::shared_ptr<const ShuffleBatch>>;
+
+class ShuffleStore {
+public:
+    ShuffleStore(int nMapTasks, int nReduce, std::size_t memoryBudget);
+
+    // Claims budget for an image about to be kept in memory; false if it does not fit.
+    bool reserve(std::size_t bytes);
+    void unreserve(std::size_t bytes);
+
+    // Adds the committed output of a map task, one batch per partition; a
+    // batch with neither image nor path stands for an empty partition.
+    void publish(int mapTaskId, std::vector<ShuffleBatch> batches);
+
+    // Blocks until the batches of a partition differ from the `version` the
+    // caller saw last, then copies them out and updates version. complete is
+    // set once every map task is in. False if the job was aborted.
+    bool wait(int reduceId, std::uint64_t& version, ShuffleBatches& batches, bool& complete);
+
+    // Replaces the given batches of a partition by their merge. Does nothing
+    // if another attempt of the same reduce task got to any of them first.
+    bool replace(int reduceId, const ShuffleBatches& merged, ShuffleBatch result);
+
+    // Drops the batches of a committed reduce task.
+    void release(int reduceId);
+
+    // Wakes every waiting reducer for good; called when the map phase failed.
+    void abort();
+
+    std::size_t peakBytes() const;
+    int spilledBatches() const;
+
+private:
+    struct Partition {
+        ShuffleBatches batches;
+        std::uint64_t version = 0;
+    };
+
+    mutable std::mutex mtx;
+    std::condition_variable changed;
+    std::vector<Partition> partitions;
+    std::vector<bool> published;
+    int nMapTasks;
+    int publishedTasks = 0;
+    int spilled = 0;
+    bool aborted = false;
+    std::size_t budget;
+    std::size_t usedBytes = 0;
+    std::size_t peak = 0;
+};
+
+// in-memory batches a reducer merges into one while map tasks are still running
+constexpr std::size_t SHUFFLE_MERGE_FANIN = 8;
+
+// Opens a batch from memory or from its spill file.
+bool openBatch(IntermediateReader& reader, const ShuffleBatch& batch);
+
+// Blocks until every map task's output for the partition is in batches, and
+// calls onBatches(batches) whenever they changed before that. False if the
+// job was aborted.
+template <typename OnBatches>
+bool collectPartition(ShuffleStore& store, int reduceId, ShuffleBatches& batches, OnBatches&& onBatches) {
+    std::uint64_t version = 0;
+    bool complete = false;
+    while (!complete) {
+        if (!store.wait(reduceId, version, batches, complete)) {
+            return false;
+        }
+        if (!complete) {
+            onBatches(batches);
+        }
+    }
+    return true;
+}
+
+#endif // SHUFFLE_H
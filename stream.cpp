@@ -0,0 +1,679 @@
+#include "stream.h"
+#include "codec.h"
+#include "count_table.h"
+#include "gzip_input.h"
+#include "input_files.h"
+#include "intermediate.h"
+#include "logger.h"
+#include "manifest.h"
+#include "merge.h"
+#include "parallel.h"
+#include "tokenizer.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// bytes taken from a pipe per read
+static constexpr std::size_t PIPE_READ_BYTES = 1 << 20;
+
+namespace {
+
+using StreamClock = std::chrono::steady_clock;
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) {
+    stopRequested = 1;
+}
+
+// text[from..] is a source's unfinished word followed by what was just read
+// from it. Whatever follows the last separator goes back into carry, so a
+// batch always ends between two words.
+void keepUnfinishedWord(std::string& text, std::size_t from, std::string& carry) {
+    std::size_t cut = text.size();
+    while (cut > from && !isWordSeparator(text[cut - 1])) {
+        --cut;
+    }
+    carry.assign(text, cut, std::string::npos);
+    text.resize(cut);
+}
+
+// The source has ended, so its unfinished word is complete after all.
+void flushUnfinishedWord(std::string& text, std::string& carry) {
+    if (!carry.empty()) {
+        text.append(carry);
+        text.push_back('\n');
+        carry.clear();
+    }
+}
+
+std::string secondsLabel(StreamClock::duration elapsed) {
+    std::ostringstream label;
+    label << std::fixed << std::setprecision(1) << std::chrono::duration<double>(elapsed).count() << " s";
+    return label.str();
+}
+
+struct PipeSource {
+    std::string name;
+    int fd = -1;
+    std::string carry;
+    bool ended = false;
+};
+
+struct TailedFile {
+    std::string path;
+    int fd = -1;
+    std::uint64_t offset = 0;
+    std::string carry;
+    // gzip files cannot be read as they grow
+    bool skipped = false;
+};
+
+// Tailed files are told apart by device and inode, so a file renamed by log
+// rotation is read on from where it was, and the new file from its start.
+using FileId = std::pair<dev_t, ino_t>;
+
+class StreamInput {
+public:
+    StreamInput() = default;
+    ~StreamInput();
+    StreamInput(const StreamInput&) = delete;
+    StreamInput& operator=(const StreamInput&) = delete;
+
+    bool open(const Config& config);
+    // Waits up to timeoutMillis for a pipe to have data, and appends what
+    // arrived to text as long as text stays below limit.
+    void poll(std::string& text, std::size_t limit, int timeoutMillis);
+    // Appends what was added to the tailed files, after listing them again
+    // if a rescan is due.
+    void readFiles(std::string& text, std::size_t limit);
+    // Appends everything still unread, unfinished last words included.
+    void finish(std::string& text);
+    // Whether every source has ended; tailed files never do.
+    bool ended() const;
+
+private:
+    std::string input;
+    bool tailDirectory = false;
+    std::vector<std::string> includeGlobs;
+    std::vector<std::string> excludeGlobs;
+    std::vector<PipeSource> pipes;
+    std::map<FileId, TailedFile> files;
+    StreamClock::time_point nextScan;
+
+    // false, with the files left as they were, if the directory cannot be listed
+    bool rescan(std::string& text);
+    void readPipe(PipeSource& pipe, std::string& text, std::size_t limit);
+    void readFile(TailedFile& file, std::string& text, std::size_t limit);
+};
+
+StreamInput::~StreamInput() {
+    for (const auto& pipe : pipes) {
+        if (pipe.fd != STDIN_FILENO) {
+            ::close(pipe.fd);
+        }
+    }
+    for (const auto& entry : files) {
+        ::close(entry.second.fd);
+    }
+}
+
+bool StreamInput::open(const Config& config) {
+    Logger& logger = Logger::getInstance();
+    input = config.inputDir;
+    includeGlobs = config.includeGlobs;
+    excludeGlobs = config.excludeGlobs;
+    if (input == "-") {
+        pipes.push_back({"standard input", STDIN_FILENO});
+        return true;
+    }
+
+    struct stat info {};
+    if (::stat(input.c_str(), &info) != 0) {
+        logger.log("Cannot open stream input " + input, LogLevel::ERROR);
+        return false;
+    }
+    if (S_ISFIFO(info.st_mode)) {
+        // opened for writing too, so the FIFO does not read as ended while no writer has it open
+        int fd = ::open(input.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            logger.log("Cannot open FIFO " + input, LogLevel::ERROR);
+            return false;
+        }
+        pipes.push_back({input, fd});
+        return true;
+    }
+    if (!S_ISDIR(info.st_mode) && !S_ISREG(info.st_mode)) {
+        logger.log("Stream input " + input + " is not a file, directory or FIFO", LogLevel::ERROR);
+        return false;
+    }
+    tailDirectory = S_ISDIR(info.st_mode);
+    std::string nothing;
+    return rescan(nothing);
+}
+
+bool StreamInput::rescan(std::string& text) {
+    Logger& logger = Logger::getInstance();
+    nextScan = StreamClock::now() + std::chrono::milliseconds(STREAM_RESCAN_MILLIS);
+
+    std::vector<std::string> paths;
+    if (tailDirectory) {
+        std::vector<ManifestInput> found;
+        if (!findInputFiles(input, includeGlobs, excludeGlobs, found)) {
+            return false;
+        }
+        for (auto& file : found) {
+            paths.push_back(std::move(file.path));
+        }
+    } else {
+        paths.push_back(input);
+    }
+
+    std::map<FileId, TailedFile> current;
+    int added = 0;
+    for (const auto& path : paths) {
+        struct stat info {};
+        if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        FileId id(info.st_dev, info.st_ino);
+        if (current.count(id) > 0) {
+            continue;
+        }
+        auto known = files.find(id);
+        if (known != files.end()) {
+            known->second.path = path;
+            current.insert(files.extract(known));
+            continue;
+        }
+        TailedFile file;
+        file.path = path;
+        file.fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file.fd < 0) {
+            logger.log("Cannot open " + path + " for tailing", LogLevel::WARNING);
+            continue;
+        }
+        logger.log("Tailing " + path, LogLevel::DEBUG);
+        current.emplace(id, std::move(file));
+        ++added;
+    }
+    if (added > 0) {
+        logger.log("Tailing " + std::to_string(added) + (added == 1 ? " new file" : " new files") + (tailDirectory ? " below " : " at ") + input, LogLevel::INFO);
+    }
+
+    // files that were removed or rotated away: read what was added before, then let them go
+    for (auto& entry : files) {
+        TailedFile& file = entry.second;
+        readFile(file, text, std::numeric_limits<std::size_t>::max());
+        flushUnfinishedWord(text, file.carry);
+        ::close(file.fd);
+        logger.log("Stopped tailing " + file.path, LogLevel::INFO);
+    }
+    files = std::move(current);
+    return true;
+}
+
+void StreamInput::poll(std::string& text, std::size_t limit, int timeoutMillis) {
+    std::vector<pollfd> waiting;
+    std::vector<PipeSource*> sources;
+    for (auto& pipe : pipes) {
+        if (!pipe.ended) {
+            waiting.push_back({pipe.fd, POLLIN, 0});
+            sources.push_back(&pipe);
+        }
+    }
+    // without pipes this just sleeps; a signal cuts it short either way
+    if (::poll(waiting.data(), waiting.size(), timeoutMillis) <= 0) {
+        return;
+    }
+    for (std::size_t i = 0; i < waiting.size(); ++i) {
+        if (waiting[i].revents != 0) {
+            readPipe(*sources[i], text, limit);
+        }
+    }
+}
+
+void StreamInput::readPipe(PipeSource& pipe, std::string& text, std::size_t limit) {
+    if (text.size() >= limit) {
+        return;
+    }
+    std::size_t from = text.size();
+    text.append(pipe.carry);
+    std::size_t start = text.size();
+    text.resize(start + std::min(PIPE_READ_BYTES, limit - from));
+    ssize_t got = ::read(pipe.fd, &text[start], text.size() - start);
+    text.resize(start + std::max<ssize_t>(got, 0));
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+        pipe.ended = true;
+        pipe.carry.clear();
+        text.push_back('\n');
+        Logger::getInstance().log("Stream input " + pipe.name + " ended", LogLevel::INFO);
+        return;
+    }
+    keepUnfinishedWord(text, from, pipe.carry);
+}
+
+void StreamInput::readFile(TailedFile& file, std::string& text, std::size_t limit) {
+    Logger& logger = Logger::getInstance();
+    struct stat info {};
+    if (file.skipped || text.size() >= limit || ::fstat(file.fd, &info) != 0) {
+        return;
+    }
+    std::uint64_t size = static_cast<std::uint64_t>(info.st_size);
+    if (size < file.offset) {
+        logger.log(file.path + " was truncated, tailing it again from its start", LogLevel::WARNING);
+        file.offset = 0;
+        file.carry.clear();
+    }
+    if (size == file.offset) {
+        return;
+    }
+
+    std::size_t from = text.size();
+    text.append(file.carry);
+    std::size_t start = text.size();
+    text.resize(start + std::min<std::uint64_t>(size - file.offset, limit - from));
+    ssize_t got = ::pread(file.fd, &text[start], text.size() - start, static_cast<off_t>(file.offset));
+    text.resize(start + std::max<ssize_t>(got, 0));
+    if (file.offset == 0 && isGzip(std::string_view(text).substr(start))) {
+        logger.log(file.path + " is gzip compressed and cannot be tailed, skipping it", LogLevel::WARNING);
+        file.skipped = true;
+        text.resize(from);
+        return;
+    }
+    file.offset += text.size() - start;
+    keepUnfinishedWord(text, from, file.carry);
+}
+
+void StreamInput::readFiles(std::string& text, std::size_t limit) {
+    if (pipes.empty() && StreamClock::now() >= nextScan) {
+        rescan(text);
+    }
+    for (auto& entry : files) {
+        readFile(entry.second, text, limit);
+    }
+}
+
+void StreamInput::finish(std::string& text) {
+    for (auto& pipe : pipes) {
+        flushUnfinishedWord(text, pipe.carry);
+    }
+    for (auto& entry : files) {
+        readFile(entry.second, text, std::numeric_limits<std::size_t>::max());
+        flushUnfinishedWord(text, entry.second.carry);
+    }
+}
+
+bool StreamInput::ended() const {
+    return !pipes.empty() && std::all_of(pipes.begin(), pipes.end(), [](const PipeSource& pipe) {
+        return pipe.ended;
+    });
+}
+
+// Word counts per reduce partition: since the stream started, of the current
+// window, and of each pane in the window when it slides.
+class WindowCounts {
+public:
+    WindowCounts(int nReduce, int nWorkers, std::size_t panesPerWindow);
+
+    // Tokenizes text, which ends between two words, into the open pane.
+    void add(std::string_view text);
+    // Once the window is written out: takes the oldest pane back out of a
+    // full window and opens the next pane.
+    void advance();
+
+    const std::vector<CountTable>& window() const { return windows; }
+    const std::vector<CountTable>& total() const { return totals; }
+    std::uint64_t windowWords() const { return windowTotal; }
+    std::uint64_t totalWords() const { return streamTotal; }
+
+private:
+    int nReduce;
+    int nWorkers;
+    std::size_t panesPerWindow;
+    std::vector<CountTable> totals;
+    std::vector<CountTable> windows;
+    // per partition, the window's panes from the oldest to the open one; only kept when the window slides
+    std::vector<std::deque<CountTable>> panes;
+    std::deque<std::uint64_t> paneWords;
+    // per partition, window entries that dropped to zero since the table was last rebuilt
+    std::vector<std::size_t> zeroed;
+    std::uint64_t windowTotal = 0;
+    std::uint64_t streamTotal = 0;
+    // one batch's counts, per tokenizing thread and partition
+    std::vector<std::vector<CountTable>> batch;
+};
+
+WindowCounts::WindowCounts(int nReduce, int nWorkers, std::size_t panesPerWindow)
+    : nReduce(nReduce), nWorkers(nWorkers), panesPerWindow(panesPerWindow),
+      totals(nReduce), windows(nReduce), zeroed(nReduce, 0), batch(nWorkers) {
+    for (auto& local : batch) {
+        local.resize(nReduce);
+    }
+    if (panesPerWindow > 1) {
+        panes.resize(nReduce);
+        for (auto& partitionPanes : panes) {
+            partitionPanes.emplace_back();
+        }
+        paneWords.push_back(0);
+    }
+}
+
+void WindowCounts::add(std::string_view text) {
+    int threads = text.size() < STREAM_PARALLEL_BYTES ? 1 : nWorkers;
+
+    // every slice ends after a separator, like a map split
+    std::vector<std::string_view> slices;
+    std::size_t begin = 0;
+    for (int t = 0; t < threads; ++t) {
+        std::size_t end = std::max(begin, text.size() * (t + 1) / threads);
+        while (end > 0 && end < text.size() && !isWordSeparator(text[end - 1])) {
+            ++end;
+        }
+        slices.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
+
+    std::vector<std::uint64_t> words(threads, 0);
+    parallelFor(threads, threads, [&](std::size_t t) {
+        std::vector<CountTable>& local = batch[t];
+        std::string word;
+        forEachWord(slices[t], word, [&](const std::string& w) {
+            std::uint64_t hash = hashKey(w);
+            local[partitionOf(hash, nReduce)].add(w, hash, 1);
+            ++words[t];
+        });
+    });
+
+    parallelFor(nReduce, threads, [&](std::size_t r) {
+        for (int t = 0; t < threads; ++t) {
+            CountTable& local = batch[t][r];
+            local.forEach([&](std::string_view key, std::uint64_t count) {
+                std::uint64_t hash = hashKey(key);
+                totals[r].add(key, hash, count);
+                windows[r].add(key, hash, count);
+                if (!panes.empty()) {
+                    panes[r].back().add(key, hash, count);
+                }
+            });
+            if (!local.empty()) {
+                local.clear();
+            }
+        }
+    });
+
+    for (std::uint64_t n : words) {
+        streamTotal += n;
+        windowTotal += n;
+        if (!paneWords.empty()) {
+            paneWords.back() += n;
+        }
+    }
+}
+
+void WindowCounts::advance() {
+    if (panes.empty()) {
+        parallelFor(nReduce, nWorkers, [&](std::size_t r) {
+            windows[r].clear();
+        });
+        windowTotal = 0;
+        return;
+    }
+
+    bool full = paneWords.size() == panesPerWindow;
+    parallelFor(nReduce, nWorkers, [&](std::size_t r) {
+        std::deque<CountTable>& partitionPanes = panes[r];
+        if (!full) {
+            partitionPanes.emplace_back();
+            return;
+        }
+        CountTable expired = std::move(partitionPanes.front());
+        partitionPanes.pop_front();
+        CountTable& window = windows[r];
+        expired.forEach([&](std::string_view key, std::uint64_t count) {
+            if (window.subtract(key, hashKey(key), count)) {
+                ++zeroed[r];
+            }
+        });
+        // words that stopped occurring would otherwise stay in the window for good
+        if (zeroed[r] * 2 > window.size()) {
+            CountTable kept(window.size());
+            window.forEach([&kept](std::string_view key, std::uint64_t count) {
+                if (count > 0) {
+                    kept.add(key, count);
+                }
+            });
+            window = std::move(kept);
+            zeroed[r] = 0;
+        }
+        expired.clear();
+        partitionPanes.push_back(std::move(expired));
+    });
+    if (full) {
+        windowTotal -= paneWords.front();
+        paneWords.pop_front();
+    }
+    paneWords.push_back(0);
+}
+
+struct RecordCursor {
+    const KeyCount* pos;
+    const KeyCount* end;
+    KeyCount current;
+
+    bool next() {
+        if (pos == end) {
+            return false;
+        }
+        current = *pos++;
+        return true;
+    }
+};
+
+// `word,count` lines for the non-zero counts of tables in output.txt order;
+// with limit > 0 only the first limit of them. Each partition is sorted on
+// its own thread and the partitions are then k-way merged.
+std::string sortedCounts(const std::vector<CountTable>& tables, int nThreads, std::size_t limit, std::size_t& distinct) {
+    std::vector<std::vector<KeyCount>> sorted(tables.size());
+    parallelFor(tables.size(), nThreads, [&](std::size_t r) {
+        std::vector<KeyCount>& records = sorted[r];
+        tables[r].forEach([&records](std::string_view key, std::uint64_t count) {
+            if (count > 0) {
+                records.push_back({key, count});
+            }
+        });
+        if (limit > 0 && records.size() > limit) {
+            std::partial_sort(records.begin(), records.begin() + limit, records.end(), byCountThenWord);
+            records.resize(limit);
+        } else {
+            std::sort(records.begin(), records.end(), byCountThenWord);
+        }
+    });
+
+    std::vector<RecordCursor> cursors;
+    std::vector<bool> live;
+    distinct = 0;
+    for (const auto& records : sorted) {
+        cursors.push_back({records.data(), records.data() + records.size(), {}});
+        live.push_back(cursors.back().next());
+        distinct += records.size();
+    }
+    auto cursorByCount = [](const RecordCursor& a, const RecordCursor& b) {
+        return byCountThenWord(a.current, b.current);
+    };
+    LoserTree<RecordCursor, decltype(cursorByCount)> merged(cursors, std::move(live), cursorByCount);
+
+    std::string out;
+    std::size_t written = 0;
+    while (!merged.empty() && (limit == 0 || written < limit)) {
+        const KeyCount& record = merged.top().current;
+        out.append(record.key);
+        out.push_back(',');
+        out.append(std::to_string(record.count));
+        out.push_back('\n');
+        ++written;
+        merged.advance();
+    }
+    return out;
+}
+
+// Bytes of the first `lines` lines of text.
+std::size_t prefixOfLines(const std::string& text, std::size_t lines) {
+    std::size_t end = 0;
+    for (std::size_t i = 0; i < lines && end < text.size(); ++i) {
+        end = text.find('\n', end);
+        end = end == std::string::npos ? text.size() : end + 1;
+    }
+    return end;
+}
+
+// Replaces <name>.txt and, with --topk, <name>.top.txt in the output directory.
+bool writeSnapshot(const Config& config, const std::string& name, const std::vector<CountTable>& tables, std::size_t& distinct) {
+    Logger& logger = Logger::getInstance();
+    Codec codec = codecByName(config.compressOutput);
+    std::string counts = sortedCounts(tables, config.nWorkers, 0, distinct);
+    std::string path = config.outputDir + "/" + name;
+    if (!writeFileAtomically(path + ".txt", compressFile(counts, codec))) {
+        logger.log("Failed to write " + path + ".txt", LogLevel::ERROR);
+        return false;
+    }
+    if (config.topK > 0) {
+        std::string_view top(counts.data(), prefixOfLines(counts, config.topK));
+        if (!writeFileAtomically(path + ".top.txt", compressFile(top, codec))) {
+            logger.log("Failed to write " + path + ".top.txt", LogLevel::ERROR);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+bool runStream(const Config& config) {
+    Logger& logger = Logger::getInstance();
+    std::error_code ec;
+    fs::create_directories(config.outputDir, ec);
+
+    logger.log("Streaming from " + (config.inputDir == "-" ? std::string("standard input") : config.inputDir), LogLevel::INFO);
+
+    StreamInput input;
+    if (!input.open(config)) {
+        return false;
+    }
+
+    // no SA_RESTART: the signal has to cut a waiting poll() short
+    struct sigaction action {};
+    action.sa_handler = requestStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    std::size_t slideMillis = config.slideMillis == 0 ? config.windowMillis : config.slideMillis;
+    WindowCounts counts(config.nReduce, config.nWorkers, config.windowMillis / slideMillis);
+    auto slide = std::chrono::milliseconds(slideMillis);
+    auto windowLength = std::chrono::milliseconds(config.windowMillis);
+    auto batchInterval = std::chrono::milliseconds(config.batchMillis);
+    auto start = StreamClock::now();
+    auto paneEnd = start + slide;
+    auto nextBatch = start + batchInterval;
+
+    bool ok = true;
+    std::string text;
+    std::uint64_t batches = 0;
+    std::uint64_t windowNumber = 0;
+    // longest a batch took from being read to its snapshots being written
+    StreamClock::duration slowestUpdate{};
+
+    // counts what was read so far into the open pane
+    auto countBatch = [&]() {
+        auto batchStart = StreamClock::now();
+        input.readFiles(text, STREAM_BATCH_BYTES);
+        bool counted = !text.empty();
+        if (counted) {
+            counts.add(text);
+            text.clear();
+            ++batches;
+        }
+        nextBatch = batchStart + batchInterval;
+        return counted;
+    };
+
+    // writes the window that ends at end, with the open pane as its last, and the totals with it
+    auto closeWindow = [&](StreamClock::time_point end) {
+        auto writeStart = StreamClock::now();
+        std::size_t windowDistinct = 0;
+        std::size_t totalDistinct = 0;
+        ok = writeSnapshot(config, "window", counts.window(), windowDistinct) && ok;
+        ok = writeSnapshot(config, "total", counts.total(), totalDistinct) && ok;
+        auto from = std::max(start, paneEnd - windowLength);
+        logger.log("Window " + std::to_string(windowNumber++) + " [" + secondsLabel(from - start) + ", " + secondsLabel(end - start) + "): "
+                   + std::to_string(counts.windowWords()) + " words, " + std::to_string(windowDistinct) + " distinct; total "
+                   + std::to_string(counts.totalWords()) + " words, " + std::to_string(totalDistinct) + " distinct; written in "
+                   + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(StreamClock::now() - writeStart).count()) + " ms",
+                   LogLevel::INFO);
+        counts.advance();
+    };
+
+    auto writeLive = [&]() {
+        std::size_t distinct = 0;
+        std::string top = sortedCounts(counts.window(), config.nWorkers, config.topK, distinct);
+        if (!writeFileAtomically(config.outputDir + "/live.top.txt", compressFile(top, codecByName(config.compressOutput)))) {
+            logger.log("Failed to write " + config.outputDir + "/live.top.txt", LogLevel::ERROR);
+            ok = false;
+        }
+    };
+
+    while (!stopRequested) {
+        auto now = StreamClock::now();
+        if (now >= nextBatch || now >= paneEnd || text.size() >= STREAM_BATCH_BYTES) {
+            bool changed = countBatch();
+            while (StreamClock::now() >= paneEnd) {
+                closeWindow(paneEnd);
+                paneEnd += slide;
+                changed = true;
+            }
+            if (changed && config.topK > 0) {
+                writeLive();
+            }
+            slowestUpdate = std::max(slowestUpdate, StreamClock::now() - now);
+            continue;
+        }
+        if (input.ended()) {
+            break;
+        }
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(std::min(nextBatch, paneEnd) - now);
+        input.poll(text, STREAM_BATCH_BYTES, static_cast<int>(wait.count()) + 1);
+    }
+
+    // whatever was read goes into one last, partial window
+    input.finish(text);
+    if (!text.empty()) {
+        counts.add(text);
+        ++batches;
+    }
+    if (config.topK > 0) {
+        writeLive();
+    }
+    auto end = StreamClock::now();
+    closeWindow(end);
+    logger.log("Stream stopped after " + secondsLabel(end - start) + ": " + std::to_string(counts.totalWords()) + " words in "
+               + std::to_string(batches) + " batches, slowest update took "
+               + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(slowestUpdate).count()) + " ms",
+               LogLevel::INFO);
+    return ok;
+}
@@ -0,0 +1,44 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "config.h"
+#include <cstddef>
+
+// Streaming word count (--stream). Instead of one batch job the program keeps
+// running and counts text as it arrives. <inputdir> is one of:
+//
+//   -              standard input, until it ends
+//   a FIFO         read across writers coming and going, until interrupted
+//   a file         tailed: bytes appended to it are read as they show up
+//   a directory    every file below it that --include/--exclude let through is
+//                  tailed, and files that appear later are picked up too
+//
+// Text is gathered into micro-batches, cut after the last word separator of
+// each source, tokenized by nWorkers threads and added to per-partition count
+// tables for the open pane, the current window and the whole stream. A window
+// of --window seconds advances every --slide seconds and is made of
+// window / slide panes; when a pane closes, the window is written out and the
+// oldest pane's counts are subtracted again, so no history is ever recounted.
+//
+// Snapshots in <outputdir>, each replaced atomically:
+//
+//   window.txt      counts of the last closed window, in output.txt order
+//   total.txt       counts since the stream started
+//   *.top.txt       with --topk, the K most frequent words of each
+//   live.top.txt    with --topk, the window that is still open, after every batch
+//
+// SIGINT or SIGTERM stops the stream; what was read is counted, the open pane
+// closes as a last window and the snapshots are written one final time.
+
+// text read in one micro-batch at most, so a backlog is worked off in steps
+constexpr std::size_t STREAM_BATCH_BYTES = 16 << 20;
+// batches smaller than this are tokenized on a single thread
+constexpr std::size_t STREAM_PARALLEL_BYTES = 256 << 10;
+// how often a tailed directory is listed again for new, removed or replaced files
+constexpr std::size_t STREAM_RESCAN_MILLIS = 2000;
+
+// Runs until the input ends or the process is interrupted; false if it could
+// not start or a snapshot could not be written.
+bool runStream(const Config& config);
+
+#endif // STREAM_H
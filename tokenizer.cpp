@@ -0,0 +1,142 @@
+#include "tokenizer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOKENIZER_X86 1
+#endif
+
+static void classifyScalar(const char* data, std::size_t blocks, std::uint64_t* space, std::uint64_t* latin) {
+    for (std::size_t b = 0; b < blocks; ++b) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data + b * 64);
+        std::uint64_t s = 0;
+        std::uint64_t l = 0;
+        for (int i = 0; i < 64; ++i) {
+            unsigned char c = p[i];
+            bool isSpace = c == ' ' || static_cast<unsigned char>(c - '\t') < 5;
+            bool isLatin = static_cast<unsigned char>((c | 0x20) - 'a') < 26;
+            s |= std::uint64_t(isSpace) << i;
+            l |= std::uint64_t(isLatin) << i;
+        }
+        space[b] = s;
+        latin[b] = l;
+    }
+}
+
+#ifdef TOKENIZER_X86
+
+// Range checks use the signed-compare trick: flipping the sign bit turns
+// "unsigned (c - lo) < n" into "signed (c - lo) ^ 0x80 < -128 + n".
+
+__attribute__((target("sse2")))
+static void classifySSE2(const char* data, std::size_t blocks, std::uint64_t* space, std::uint64_t* latin) {
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i letterA = _mm_set1_epi8('a');
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i signBit = _mm_set1_epi8(static_cast<char>(0x80));
+    const __m128i controlBound = _mm_set1_epi8(static_cast<char>(-128 + 5));
+    const __m128i letterBound = _mm_set1_epi8(static_cast<char>(-128 + 26));
+
+    for (std::size_t b = 0; b < blocks; ++b) {
+        std::uint64_t s = 0;
+        std::uint64_t l = 0;
+        for (int part = 0; part < 4; ++part) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + b * 64 + part * 16));
+            __m128i control = _mm_xor_si128(_mm_sub_epi8(v, tab), signBit);
+            __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(v, blank), _mm_cmplt_epi8(control, controlBound));
+            __m128i letter = _mm_xor_si128(_mm_sub_epi8(_mm_or_si128(v, caseBit), letterA), signBit);
+            __m128i isLatin = _mm_cmplt_epi8(letter, letterBound);
+            s |= std::uint64_t(static_cast<std::uint16_t>(_mm_movemask_epi8(isSpace))) << (part * 16);
+            l |= std::uint64_t(static_cast<std::uint16_t>(_mm_movemask_epi8(isLatin))) << (part * 16);
+        }
+        space[b] = s;
+        latin[b] = l;
+    }
+}
+
+__attribute__((target("avx2")))
+static void classifyAVX2(const char* data, std::size_t blocks, std::uint64_t* space, std::uint64_t* latin) {
+    const __m256i blank = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i letterA = _mm256_set1_epi8('a');
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i signBit = _mm256_set1_epi8(static_cast<char>(0x80));
+    const __m256i controlBound = _mm256_set1_epi8(static_cast<char>(-128 + 5));
+    const __m256i letterBound = _mm256_set1_epi8(static_cast<char>(-128 + 26));
+
+    for (std::size_t b = 0; b < blocks; ++b) {
+        std::uint64_t s = 0;
+        std::uint64_t l = 0;
+        for (int part = 0; part < 2; ++part) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + b * 64 + part * 32));
+            __m256i control = _mm256_xor_si256(_mm256_sub_epi8(v, tab), signBit);
+            __m256i isSpace = _mm256_or_si256(_mm256_cmpeq_epi8(v, blank), _mm256_cmpgt_epi8(controlBound, control));
+            __m256i letter = _mm256_xor_si256(_mm256_sub_epi8(_mm256_or_si256(v, caseBit), letterA), signBit);
+            __m256i isLatin = _mm256_cmpgt_epi8(letterBound, letter);
+            s |= std::uint64_t(static_cast<std::uint32_t>(_mm256_movemask_epi8(isSpace))) << (part * 32);
+            l |= std::uint64_t(static_cast<std::uint32_t>(_mm256_movemask_epi8(isLatin))) << (part * 32);
+        }
+        space[b] = s;
+        latin[b] = l;
+    }
+}
+
+#endif // TOKENIZER_X86
+
+namespace {
+
+struct Kernel {
+    const char* name;
+    ClassifyBlocksFn fn;
+};
+
+Kernel detectKernel() {
+#ifdef TOKENIZER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", classifyAVX2};
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return {"sse2", classifySSE2};
+    }
+#endif
+    return {"scalar", classifyScalar};
+}
+
+Kernel& activeKernel() {
+    static Kernel kernel = detectKernel();
+    return kernel;
+}
+
+} // namespace
+
+ClassifyBlocksFn classifyBlocks() {
+    return activeKernel().fn;
+}
+
+const char* tokenizerImplementation() {
+    return activeKernel().name;
+}
+
+bool setTokenizerImplementation(const std::string& name) {
+    if (name == "auto") {
+        activeKernel() = detectKernel();
+        return true;
+    }
+    if (name == "scalar") {
+        activeKernel() = {"scalar", classifyScalar};
+        return true;
+    }
+#ifdef TOKENIZER_X86
+    __builtin_cpu_init();
+    if (name == "sse2" && __builtin_cpu_supports("sse2")) {
+        activeKernel() = {"sse2", classifySSE2};
+        return true;
+    }
+    if (name == "avx2" && __builtin_cpu_supports("avx2")) {
+        activeKernel() = {"avx2", classifyAVX2};
+        return true;
+    }
+#endif
+    return false;
+}
@@ -0,0 +1,143 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Word splitting for the map phase, with the same rules as the old
+// operator>> + cleanWord + isValidLatinWord pipeline:
+//   - tokens are runs of bytes other than ' ', '\t', '\n', '\v', '\f', '\r'
+//   - a token is trimmed to its first and last Latin letter
+//   - it is kept only if the trimmed part is all Latin letters, i.e. the token
+//     holds exactly one run of letters; the run is lowercased
+//
+// Bytes are classified 64 at a time into a whitespace bitmask and a letter
+// bitmask by a SIMD kernel picked at runtime, and token boundaries are then
+// found with bit operations on those masks.
+
+// Whether c separates tokens; a split may safely start at such a byte.
+inline bool isWordSeparator(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Fills space[i] / latin[i] with one bit per byte of the 64-byte block i.
+using ClassifyBlocksFn = void (*)(const char* data, std::size_t blocks, std::uint64_t* space, std::uint64_t* latin);
+
+// Kernel picked for this CPU ("avx2", "sse2" or "scalar") unless overridden.
+ClassifyBlocksFn classifyBlocks();
+const char* tokenizerImplementation();
+// Forces a kernel by name ("auto" restores detection). Returns false if the
+// name is unknown or the CPU cannot run it.
+bool setTokenizerImplementation(const std::string& name);
+
+namespace tokenizer_detail {
+
+struct ScanState {
+    std::uint64_t prevSpace = 1;   // the text starts as if after a separator
+    std::uint64_t prevLatin = 0;
+    int latinRuns = 0;
+    std::size_t wordStart = 0;
+    std::size_t wordEnd = 0;
+};
+
+template <typename OnWord>
+inline void finishToken(std::string_view text, ScanState& st, std::string& word, OnWord& onWord) {
+    if (st.latinRuns == 1) {
+        const char* src = text.data() + st.wordStart;
+        std::size_t length = st.wordEnd - st.wordStart;
+        word.resize(length);
+        char* dst = &word[0];
+        // every byte is an ASCII letter, so setting bit 5 lowercases it
+        for (std::size_t i = 0; i < length; ++i) {
+            dst[i] = static_cast<char>(src[i] | 0x20);
+        }
+        onWord(static_cast<const std::string&>(word));
+    }
+    st.latinRuns = 0;
+}
+
+template <typename OnWord>
+inline void scanBlock(std::string_view text, std::size_t base, std::uint64_t space, std::uint64_t latin,
+                      ScanState& st, std::string& word, OnWord& onWord) {
+    std::uint64_t spaceBefore = (space << 1) | st.prevSpace;
+    std::uint64_t latinBefore = (latin << 1) | st.prevLatin;
+
+    // tokens need no start event: letter runs only occur inside tokens and
+    // finishToken resets the run count at every token end
+    std::uint64_t tokenEnd = space & ~spaceBefore;
+    std::uint64_t latinStart = latin & ~latinBefore;
+    std::uint64_t latinEnd = ~latin & latinBefore;
+
+    std::uint64_t events = tokenEnd | latinStart | latinEnd;
+    while (events != 0) {
+        int i = __builtin_ctzll(events);
+        std::uint64_t bit = std::uint64_t(1) << i;
+        std::size_t pos = base + i;
+        // a letter run can end at the separator that ends its token
+        if (latinEnd & bit) {
+            if (st.latinRuns == 1) {
+                st.wordEnd = pos;
+            }
+        }
+        if (tokenEnd & bit) {
+            finishToken(text, st, word, onWord);
+        }
+        if (latinStart & bit) {
+            if (++st.latinRuns == 1) {
+                st.wordStart = pos;
+            }
+        }
+        events &= events - 1;
+    }
+
+    st.prevSpace = space >> 63;
+    st.prevLatin = latin >> 63;
+}
+
+} // namespace tokenizer_detail
+
+// Calls onWord(const std::string&) with each lowercased word of text, in order.
+// `word` is scratch storage reused between calls.
+template <typename OnWord>
+void forEachWord(std::string_view text, std::string& word, OnWord&& onWord) {
+    using namespace tokenizer_detail;
+    constexpr std::size_t WINDOW_BLOCKS = 64;
+
+    ClassifyBlocksFn classify = classifyBlocks();
+    std::uint64_t space[WINDOW_BLOCKS];
+    std::uint64_t latin[WINDOW_BLOCKS];
+    ScanState st;
+
+    for (std::size_t base = 0; base < text.size(); base += WINDOW_BLOCKS * 64) {
+        std::size_t length = std::min(text.size() - base, WINDOW_BLOCKS * 64);
+        std::size_t blocks = length / 64;
+        classify(text.data() + base, blocks, space, latin);
+
+        if (length % 64 != 0) {
+            // pad the tail with separators so it can go through the same kernel
+            char tail[64];
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, text.data() + base + blocks * 64, length % 64);
+            classify(tail, 1, space + blocks, latin + blocks);
+            ++blocks;
+        }
+
+        for (std::size_t b = 0; b < blocks; ++b) {
+            scanBlock(text, base + b * 64, space[b], latin[b], st, word, onWord);
+        }
+    }
+
+    // the end of the text closes whatever is still open
+    if (st.prevLatin && st.latinRuns == 1) {
+        st.wordEnd = text.size();
+    }
+    if (!st.prevSpace) {
+        finishToken(text, st, word, onWord);
+    }
+}
+
+#endif // TOKENIZER_H
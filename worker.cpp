@@ -1,161 +1,74 @@
 #include "worker.h"
-#include <fstream>
-#include <iostream>
-#include <cctype>
-#include <locale>
-#include <mutex>
-#include <sstream>
-#include <algorithm>
-#include <map>
-#include <vector>
+#include "job_worker.h"
+#include "jobs.h"
 #include "logger.h"
-#include <chrono>
+#include "tokenizer.h"
+#include "rpc.h"
+#include <unistd.h>
 
-static std::mutex printMutex;
-
-Worker::Worker(int id, const Config& config) : workerId(id), config(config) {
-    Logger::getInstance().log("Worker " + std::to_string(workerId) + " created", LogLevel::INFO);
-}
-
-void Worker::processMapTasks(const std::vector<FileMetaData>& tasks) {
-    for (const auto& task : tasks) {
-        map(task.fileName, task.offset, task.fileSize);
-    }
-}
-
-bool Worker::is_latin(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
-}
-
-size_t Worker::find_first_latin(const std::string& word) {
-    for (size_t i = 0; i < word.length(); ++i) {
-        if (is_latin(word[i])) {
-            return i;
-        }
-    }
-    return std::string::npos;
+std::string attemptFileName(const std::string& path, int workerId) {
+    return path + ".w" + std::to_string(workerId) + ".tmp";
 }
 
-size_t Worker::find_last_latin(const std::string& word) {
-    for (size_t i = word.length(); i > 0; --i) {
-        if (is_latin(word[i-1])) {
-            return i-1;
-        }
+// Runs both phases with tasks from the master on fd; false if the master went away.
+template <typename W>
+static bool serveTasks(int fd, int workerId, const Config& config) {
+    Logger& logger = Logger::getInstance();
+    // the master only answers the first request of the reduce phase once every map task is committed
+    W worker(workerId, config);
+    RemoteTaskSource<FileMetaData> mapTasks(fd, MessageType::RequestMapTask, MessageType::MapTask);
+    worker.processMapTasks(mapTasks);
+    if (mapTasks.failed()) {
+        logger.log("Worker " + std::to_string(workerId) + " lost the master during the map phase", LogLevel::ERROR);
+        return false;
     }
-    return std::string::npos;
-}
-
-
-std::string Worker::cleanWord(const std::string& word) {
-    size_t start = find_first_latin(word);
-    if (start == std::string::npos) return "";
-
-    size_t end = find_last_latin(word);
-    std::string cleaned = word.substr(start, end - start + 1);
 
-    std::transform(cleaned.begin(), cleaned.end(), cleaned.begin(), ::tolower);
-    return cleaned;
-}
-
-bool Worker::isValidLatinWord(const std::string& word) {
-    for (char ch : word) {
-        if (!is_latin(ch)) {
-            return false;
-        }
+    RemoteTaskSource<ReduceTask> reduceTasks(fd, MessageType::RequestReduceTask, MessageType::ReduceTask);
+    worker.processReduceTasks(reduceTasks);
+    if (reduceTasks.failed()) {
+        logger.log("Worker " + std::to_string(workerId) + " lost the master during the reduce phase", LogLevel::ERROR);
+        return false;
     }
     return true;
 }
 
-int Worker::getReduceTaskIndex(const std::string& key, int nReduce) {
-    std::hash<std::string> hasher;
-    return hasher(key) % nReduce;
-}
-
-void Worker::map(const std::string& fileName, std::size_t offset, std::size_t size) {
+int runWorkerProcess(const std::string& socketPath) {
     Logger& logger = Logger::getInstance();
-    std::ifstream file(fileName, std::ifstream::binary);
-    if (!file) {
-        logger.log("Worker " + std::to_string(workerId) + " could not open file: " + fileName, LogLevel::ERROR);
-        return;
+    int fd = connectUnixSocket(socketPath);
+    if (fd < 0) {
+        return 1;
     }
 
-    file.seekg(offset);
-    std::vector<char> buffer(size);
-    if (!file.read(buffer.data(), size)) {
-        logger.log("Worker " + std::to_string(workerId) + " could not read from file: " + fileName, LogLevel::ERROR);
-        return;
+    Message welcome;
+    PayloadWriter hello;
+    hello.putU64(static_cast<std::uint64_t>(getpid()));
+    if (!sendMessage(fd, MessageType::Register, hello.data()) || !receiveMessage(fd, welcome) || welcome.type != MessageType::Welcome) {
+        logger.log("Worker process " + std::to_string(getpid()) + " was not admitted by the master", LogLevel::ERROR);
+        ::close(fd);
+        return 1;
     }
-
-    std::string text(buffer.begin(), buffer.end());
-    std::istringstream iss(text);
-    std::string word;
-
-    while (iss >> word) {
-        std::string cleanedWord = cleanWord(word);
-        if (!cleanedWord.empty() && isValidLatinWord(cleanedWord)) {
-            int reduceIndex = getReduceTaskIndex(cleanedWord, config.nReduce);
-            std::ostringstream oss;
-            oss << config.outputDir << "/map.part-" << workerId << "-" << reduceIndex << ".txt";
-            std::ofstream out(oss.str(), std::ios::app); // Open in append mode
-            out << cleanedWord << ",1\n";
-        }
-    }
-}
-
-void Worker::processReduceTasks(const std::vector<int> reduceTasksList) {
-    for (int reduceTaskId : reduceTasksList) {
-        reduce(reduceTaskId);
+    PayloadReader reader(welcome.payload);
+    int workerId = static_cast<int>(reader.getU64());
+    Config config;
+    if (!decodeConfig(reader, config) || !setTokenizerImplementation(config.tokenizer)) {
+        logger.log("Worker process " + std::to_string(getpid()) + " received an unusable configuration", LogLevel::ERROR);
+        ::close(fd);
+        return 1;
     }
-}
-
-void Worker::reduce(const int reduceTaskId) {
-    Logger& logger = Logger::getInstance();
-    logger.log("Worker " + std::to_string(workerId) + " starts reduce task ID: " + std::to_string(reduceTaskId), LogLevel::INFO);
-    auto start_time = std::chrono::high_resolution_clock::now();
-    std::map<std::string, int> wordCountMap;
-
-
-    for (int i = 0; i < config.nWorkers; ++i) {
-        std::ostringstream oss;
-        oss << config.outputDir << "/map.part-" << i << "-" << reduceTaskId << ".txt";
-
-        std::ifstream inFile(oss.str());
-        std::string line;
-
-        if (!inFile) {
-            logger.log("Worker " + std::to_string(workerId) + " failed to open intermediate file: " + oss.str(), LogLevel::WARNING);
-            continue;
-        }
-
-        while (getline(inFile, line)) {
-            std::istringstream lineStream(line);
-            std::string key;
-            int value;
-
-            if (std::getline(lineStream, key, ',') && lineStream >> value) {
-                key = cleanWord(key);
-
-                if (!key.empty()) {
-                    wordCountMap[key] += value;
-                }
-            }
-        }
+    LogLevel minLevel;
+    if (parseLogLevel(config.logLevel, minLevel)) {
+        logger.setMinLevel(minLevel);
     }
+    logger.setConsoleEcho(!config.quiet);
+    logger.log("Worker process " + std::to_string(getpid()) + " registered as worker " + std::to_string(workerId), LogLevel::INFO);
 
-    std::ostringstream oss;
-    oss << config.outputDir << "/reduce.part-" << reduceTaskId << ".txt";
-    std::ofstream outFile(oss.str());
-
-    if (!outFile) {
-        logger.log("Worker " + std::to_string(workerId) + " failed to open output file: " + oss.str(), LogLevel::ERROR);
-        return;
+    bool served = false;
+    if (!withJob(config.job, [&](auto job) { served = serveTasks<JobWorker<decltype(job)>>(fd, workerId, config); })) {
+        logger.log("Worker process " + std::to_string(getpid()) + " was given an unknown job: " + config.job, LogLevel::ERROR);
     }
-
-    for (const auto& pair : wordCountMap) {
-        outFile << pair.first << "," << pair.second << std::endl;
+    if (served) {
+        sendMessage(fd, MessageType::Bye);
     }
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> eplased = end_time - start_time;
-    logger.log("Worker " + std::to_string(workerId) + " completed reduce task ID: " + std::to_string(reduceTaskId) + " in " + std::to_string(eplased.count()) + " seconds", LogLevel::INFO);
+    ::close(fd);
+    return served ? 0 : 1;
 }
@@ -1,28 +1,218 @@
 #ifndef WORKER_H
 #define WORKER_H
 
+#include <algorithm>
+#include <cstdio>
 #include <string>
+#include <string_view>
 #include <vector>
 #include "config.h"
+#include "logger.h"
 #include "master.h"
+#include "scheduler.h"
+#include "intermediate.h"
+#include "job.h"
+#include "merge.h"
+#include "metrics.h"
+#include "shuffle.h"
 
-class Worker {
-public:
-    Worker(int id, const Config& config);
-    void processMapTasks(const std::vector<FileMetaData>& tasks);
-    void map(const std::string& fileName, std::size_t offset, std::size_t size);
-    bool is_latin(char c);
-    size_t find_first_latin(const std::string& word);
-    size_t find_last_latin(const std::string& word);
-    std::string cleanWord(const std::string& word);
-    bool isValidLatinWord(const std::string& word);
-    int getReduceTaskIndex(const std::string& key, int nReduce);
-
-    void processReduceTasks(std::vector<int> reduceTasksList);
-private:
-    int workerId;
-    Config config;
-    void reduce(const int taskId);
-};
+// map and reduce look for a newer attempt having won after every slice of this size
+constexpr std::size_t TASK_SLICE_BYTES = 4 << 20;
+
+// Name under which an attempt writes a file before the file is committed.
+std::string attemptFileName(const std::string& path, int workerId);
+
+// Moves the files of an attempt under their final names if it is the attempt
+// that counts, and returns whether it did; otherwise they are deleted. stale
+// names the outputs the attempt had nothing for: a file an earlier run left
+// under one of those names is removed with the commit, before the task counts
+// as done. partitions, for a map task, are the ones it wrote anything for.
+template <typename Task>
+bool commitAttempt(TaskSource<Task>& tasks, int workerId, int taskId, const std::vector<std::string>& outputs, bool ok,
+                   const std::vector<std::string>& stale = {}, const std::vector<int>& partitions = {}) {
+    Logger& logger = Logger::getInstance();
+    bool committed = ok && tasks.commit(workerId, taskId);
+    for (std::size_t i = 0; committed && i < outputs.size(); ++i) {
+        if (std::rename(attemptFileName(outputs[i], workerId).c_str(), outputs[i].c_str()) != 0) {
+            logger.log("Worker " + std::to_string(workerId) + " could not commit " + outputs[i], LogLevel::ERROR);
+            committed = false;
+            ok = false;
+        }
+    }
+    if (committed) {
+        for (const auto& output : stale) {
+            std::remove(output.c_str());
+        }
+        tasks.finish(workerId, taskId, partitions);
+        return true;
+    }
+
+    for (const auto& output : outputs) {
+        std::remove(attemptFileName(output, workerId).c_str());
+    }
+    if (!ok) {
+        tasks.abandon(workerId, taskId);
+    } else {
+        logger.log("Worker " + std::to_string(workerId) + " dropped its copy of task " + std::to_string(taskId) + ", another attempt finished first", LogLevel::INFO);
+    }
+    return false;
+}
+
+// Commits a map attempt whose writers were built in memory: every finished
+// image is kept in memory if the budget allows and spilled otherwise, the
+// spilled files are committed as usual, and the images go to the store if
+// this attempt is the one that counts.
+template <typename Task>
+bool commitShuffleAttempt(ShuffleStore& store, TaskSource<Task>& tasks, int workerId, int taskId,
+                          std::vector<IntermediateWriter>& writers, const std::vector<std::string>& outputs, bool ok) {
+    std::vector<ShuffleBatch> batches(writers.size());
+    std::vector<std::string> spilledOutputs;
+    std::vector<int> partitions;
+    std::size_t reserved = 0;
+    for (std::size_t r = 0; r < writers.size(); ++r) {
+        // an empty partition gets neither an image nor a file
+        if (writers[r].empty()) {
+            continue;
+        }
+        partitions.push_back(static_cast<int>(r));
+        std::size_t bytes = writers[r].bytesWritten();
+        if (store.reserve(bytes)) {
+            reserved += bytes;
+            batches[r].image = std::make_shared<const std::string>(writers[r].takeImage());
+            continue;
+        }
+        batches[r].path = outputs[r];
+        spilledOutputs.push_back(outputs[r]);
+        if (ok && !writers[r].spill()) {
+            Logger::getInstance().log("Worker " + std::to_string(workerId) + " could not spill shuffle output: " + writers[r].path(), LogLevel::ERROR);
+            ok = false;
+        }
+    }
+    if (!commitAttempt(tasks, workerId, taskId, spilledOutputs, ok, {}, partitions)) {
+        store.unreserve(reserved);
+        return false;
+    }
+    store.publish(taskId, std::move(batches));
+    return true;
+}
+
+// reduce tasks merge at most this many intermediate files at once
+constexpr std::size_t REDUCE_MERGE_FANIN = 64;
+
+// Brings the intermediate files of a partition down to REDUCE_MERGE_FANIN, so
+// a reducer never maps more than that many: merge(inputs, output) folds
+// groups of them into one file under output, in passes until few enough are
+// left. Files of an earlier pass are removed once they are merged again; the
+// ones left in files are listed in merged for the caller to remove after it
+// opened them. False if a merge failed, with everything it made removed.
+template <typename Merge>
+bool mergeToFanIn(std::vector<std::string>& files, const std::string& mergePrefix, int workerId,
+                  std::vector<std::string>& merged, Merge merge) {
+    std::vector<bool> made(files.size(), false);
+    for (int pass = 0; files.size() > REDUCE_MERGE_FANIN; ++pass) {
+        std::vector<std::string> next;
+        std::vector<bool> nextMade;
+        bool ok = true;
+        for (std::size_t begin = 0; begin < files.size(); begin += REDUCE_MERGE_FANIN) {
+            std::size_t end = std::min(begin + REDUCE_MERGE_FANIN, files.size());
+            if (!ok || end - begin == 1) {
+                next.insert(next.end(), files.begin() + begin, files.begin() + end);
+                nextMade.insert(nextMade.end(), made.begin() + begin, made.begin() + end);
+                continue;
+            }
+            std::string output = attemptFileName(mergePrefix + std::to_string(pass) + "-" + std::to_string(next.size()) + ".bin", workerId);
+            ok = merge(std::vector<std::string>(files.begin() + begin, files.begin() + end), output);
+            for (std::size_t i = begin; i < end; ++i) {
+                if (made[i]) {
+                    std::remove(files[i].c_str());
+                }
+            }
+            next.push_back(output);
+            nextMade.push_back(true);
+        }
+        files.swap(next);
+        made.swap(nextMade);
+        if (!ok) {
+            for (std::size_t i = 0; i < files.size(); ++i) {
+                if (made[i]) {
+                    std::remove(files[i].c_str());
+                }
+            }
+            return false;
+        }
+    }
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        if (made[i]) {
+            merged.push_back(files[i]);
+        }
+    }
+    return true;
+}
+
+// The merge step of mergeToFanIn: merges intermediate files of one partition
+// into output, folding the values of each key with combiner, in runs of about
+// --map-buffer bytes.
+template <typename Value, typename Combiner>
+bool mergeIntermediateFiles(const std::vector<std::string>& inputs, const std::string& output, const Config& config,
+                            int workerId, const Combiner& combiner, TaskMetrics& metrics) {
+    Logger& logger = Logger::getInstance();
+    std::vector<IntermediateReader> readers(inputs.size());
+    std::vector<JobRunCursor<Value>> cursors;
+    std::vector<bool> live;
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        ScopedTimer io(metrics.ioMicros);
+        if (!readers[i].open(inputs[i])) {
+            logger.log("Worker " + std::to_string(workerId) + " failed to read intermediate file: " + inputs[i] + " (" + readers[i].error() + ")", LogLevel::ERROR);
+            return false;
+        }
+        metrics.bytesRead += readers[i].fileBytes();
+        for (const RunExtent& run : readers[i].extents()) {
+            cursors.emplace_back(run);
+            live.push_back(cursors.back().next());
+        }
+    }
+    auto byKey = [](const JobRunCursor<Value>& a, const JobRunCursor<Value>& b) {
+        return a.key() < b.key();
+    };
+    LoserTree<JobRunCursor<Value>, decltype(byKey)> runs(cursors, std::move(live), byKey);
+
+    IntermediateWriter writer(output, false, codecByName(config.compressIntermediate));
+    std::string key;
+    std::string encoded;
+    std::uint64_t records = 0;
+    bool ok = true;
+    while (ok && !runs.empty()) {
+        key.assign(runs.top().key());
+        Value value = std::move(runs.top().value());
+        runs.advance();
+        while (!runs.empty() && runs.top().key() == key) {
+            combiner(value, std::move(runs.top().value()));
+            runs.advance();
+        }
+        putVarint(encoded, key.size());
+        encoded.append(key);
+        ValueCodec<Value>::put(encoded, value);
+        ++records;
+        if (encoded.size() >= config.mapBufferBytes) {
+            ScopedTimer io(metrics.ioMicros);
+            ok = writer.appendEncodedRun(encoded, records);
+            encoded.clear();
+            records = 0;
+        }
+    }
+    {
+        ScopedTimer io(metrics.ioMicros);
+        ok = ok && writer.appendEncodedRun(encoded, records) && writer.finish();
+    }
+    metrics.bytesWritten += writer.bytesWritten();
+    if (!ok) {
+        logger.log("Worker " + std::to_string(workerId) + " failed to write merged intermediate file: " + output, LogLevel::ERROR);
+    }
+    return ok;
+}
+
+// Entry point of `mapreduce --worker <socket>`: registers with the master
+// listening on socket, runs the tasks it hands out and returns the exit code.
+int runWorkerProcess(const std::string& socketPath);
 
 #endif // WORKER_H